@@ -0,0 +1,159 @@
+/*!
+  \file        allocation_counter.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+A test mode counting the heap allocations made by the annotators.
+
+If USE_ALLOCATION_COUNTER is set, malloc() and friends are replaced
+by counting wrappers around the glibc allocator
+(cv::Mat buffers use malloc(), not operator new).
+ALLOCATION_CHECK(name) then counts the allocations made in the current scope:
+the first run of each call site for a given workspace generation is a warm-up,
+after that any allocation is reported and aborts the program.
+ALLOCATION_CHECK_IGNORE() excludes the allocations made by third-party code
+in the current scope (image codecs, cv::Canny() internals).
+
+Without USE_ALLOCATION_COUNTER, all the macros are empty.
+As the replacement functions are defined here, this header must be
+included by one translation unit only - which is the case of the annotators.
+ */
+
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include "contour_image_annotator_path.h"
+
+#if USE_ALLOCATION_COUNTER
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void  __libc_free(void* ptr);
+}
+
+namespace allocation_counter {
+
+//! the number of allocations made by the current thread
+static __thread unsigned long nallocs = 0;
+//! if > 0, the allocations of the current thread are not counted
+static __thread int ignore_depth = 0;
+//! incremented each time the workspaces are resized (new image size)
+static unsigned int workspace_generation = 0;
+
+inline void count_allocation() {
+  if (ignore_depth == 0)
+    ++nallocs;
+}
+
+//! to call when the workspaces are reallocated: all call sites warm up again
+inline void new_workspace_generation() {
+  ++workspace_generation;
+}
+
+//! the state of an ALLOCATION_CHECK() call site
+struct SiteState {
+  SiteState() : warm(false), generation(0) {}
+  bool warm;
+  unsigned int generation;
+};
+
+class ScopedCheck {
+public:
+  ScopedCheck(const char* name, SiteState & site) :
+    _name(name), _site(site), _nallocs_start(nallocs) {}
+  ~ScopedCheck() {
+    unsigned long n = nallocs - _nallocs_start;
+    bool steady = (_site.warm && _site.generation == workspace_generation);
+    _site.warm = true;
+    _site.generation = workspace_generation;
+    if (n == 0)
+      return;
+    printf("allocation_counter: %lu allocations in '%s' (%s)\n",
+           n, _name, (steady ? "steady state" : "warm-up"));
+    if (steady) {
+      printf("allocation_counter: '%s' should not allocate in steady state! Aborting.\n",
+             _name);
+      abort();
+    }
+  }
+private:
+  const char* _name;
+  SiteState & _site;
+  unsigned long _nallocs_start;
+}; // end class ScopedCheck
+
+class ScopedIgnore {
+public:
+  ScopedIgnore()  { ++ignore_depth; }
+  ~ScopedIgnore() { --ignore_depth; }
+}; // end class ScopedIgnore
+
+} // end namespace allocation_counter
+
+////////////////////////////////////////////////////////////////////////////////
+
+extern "C" {
+void* malloc(size_t size) {
+  allocation_counter::count_allocation();
+  return __libc_malloc(size);
+}
+void* calloc(size_t nmemb, size_t size) {
+  allocation_counter::count_allocation();
+  return __libc_calloc(nmemb, size);
+}
+void* realloc(void* ptr, size_t size) {
+  allocation_counter::count_allocation();
+  return __libc_realloc(ptr, size);
+}
+void* memalign(size_t alignment, size_t size) {
+  allocation_counter::count_allocation();
+  return __libc_memalign(alignment, size);
+}
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+  allocation_counter::count_allocation();
+  *memptr = __libc_memalign(alignment, size);
+  return (*memptr == NULL ? 12 /* ENOMEM */ : 0);
+}
+void free(void* ptr) {
+  __libc_free(ptr);
+}
+} // end extern "C"
+
+#define ALLOCATION_CHECK(name) \
+  static allocation_counter::SiteState allocation_site_state; \
+  allocation_counter::ScopedCheck allocation_check(name, allocation_site_state);
+#define ALLOCATION_CHECK_IGNORE() \
+  allocation_counter::ScopedIgnore allocation_ignore;
+#define ALLOCATION_NEW_WORKSPACE_GENERATION() \
+  allocation_counter::new_workspace_generation();
+
+#else // no USE_ALLOCATION_COUNTER
+#define ALLOCATION_CHECK(name)                  // empty
+#define ALLOCATION_CHECK_IGNORE()               // empty
+#define ALLOCATION_NEW_WORKSPACE_GENERATION()   // empty
+#endif // USE_ALLOCATION_COUNTER
+
+#endif // ALLOCATION_COUNTER_H
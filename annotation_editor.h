@@ -0,0 +1,273 @@
+/*!
+  \file        annotation_editor.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+\class AnnotationEditor
+The editing core of the annotators, without window:
+the contours and the user image of a frame, the floodfills, the contour strokes,
+undo, redo and clear, recorded in an UndoHistory.
+ContourImageAnnotator adds the window, the journal and the pyramids around it,
+reannotate replays journals with it: both edit a frame the same way.
+
+A contour stroke joins its points by thick segments, so that fast drags
+leave no gap a floodfill could leak through.
+The segments are only drawn into _stroke_mask: flush_stroke() turns them
+into new edges of _contours, recorded as runs in the undo history.
+ */
+
+#ifndef ANNOTATION_EDITOR_H
+#define ANNOTATION_EDITOR_H
+
+#include <algorithm>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "scanline_floodfill.h"
+#include "undo_history.h"
+#include "annotation_journal.h"
+
+//! the brush radius of the contour strokes (pixels)
+static const int DEFAULT_BRUSH_RADIUS = 3, MAX_BRUSH_RADIUS = 30;
+
+class AnnotationEditor {
+public:
+  AnnotationEditor() : _stroke_active(false), _stroke_dirty(false),
+    _stroke_radius(DEFAULT_BRUSH_RADIUS) {}
+
+  /*!
+   * Start editing a frame: its contours, binarized, and its user image,
+   * resized to them if needed. Call reserve() if the size changed.
+   */
+  void set_frame(const cv::Mat3b & user_image, const cv::Mat1b & contours) {
+    user_image.copyTo(_user_image);
+    cv::threshold(contours, _contours, 128, 255, CV_THRESH_BINARY);
+    _contours.copyTo(_contours_pristine); // for clear()
+    if (_contours.size() != _user_image.size())
+      cv::resize(_user_image, _user_image, _contours.size());
+    _stroke_active = _stroke_dirty = false; // a stroke does not go on in the new image
+    _history.clear(); // the actions were made on the previous image
+  }
+
+  //! allocate the buffers of the edits: in steady state, they allocate nothing
+  void reserve(const cv::Size & img_size) {
+    _contours_clone.create(img_size);
+    _stroke_mask.create(img_size);
+    _stroke_mask.setTo(0);
+    _floodfill_seeds.reserve(image_utils::scanline_floodfill_buffer_size(img_size));
+  }
+
+  inline const cv::Mat3b & user_image() const { return _user_image; }
+  inline const cv::Mat1b & contours() const { return _contours; }
+
+  //! true if (x, y) is in the image and not on an edge: an edit can start there
+  inline bool is_free(int x, int y) const {
+    return (x >= 0 && x < _contours.cols && y >= 0 && y < _contours.rows
+            && _contours(y, x) == 255);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! floodfill the region of (x, y) with color, \return false if not is_free()
+  bool fill(int x, int y, const cv::Vec3b & color) {
+    end_stroke(); // one action at a time in the history
+    if (!is_free(x, y))
+      return false;
+    // use a buffer image to get the floodfilled area,
+    // and paint the user image span by span while filling it
+    _contours.copyTo(_contours_clone);
+    image_utils::FloodfillSpanPainter<cv::Vec3b> painter(_user_image, color);
+    RecordingSpanPainter recorder(_history, _user_image, painter);
+    _history.begin_action(UndoHistory::LAYER_USER_IMAGE, color.val);
+    image_utils::scanline_floodfill(_contours_clone, cv::Point(x, y), 127,
+                                    _floodfill_seeds, recorder);
+    _history.end_action();
+    return true;
+  }
+
+  //! start a stroke, ending the previous one. \return false if not is_free()
+  bool begin_stroke(int x, int y, int radius) {
+    end_stroke();
+    if (!is_free(x, y))
+      return false;
+    _stroke_active = true;
+    _stroke_radius = std::min(std::max(radius, 1), MAX_BRUSH_RADIUS);
+    _stroke_last = cv::Point(x, y);
+    const uchar edge = 0;
+    _history.begin_action(UndoHistory::LAYER_CONTOURS, &edge);
+    cv::circle(_stroke_mask, _stroke_last, _stroke_radius, cv::Scalar::all(255), -1);
+    add_stroke_dirty_rect(_stroke_last, _stroke_last);
+    return true;
+  }
+
+  //! \return false if no stroke is active, or if the point is the last one
+  bool extend_stroke(int x, int y) {
+    cv::Point pt(x, y);
+    if (!_stroke_active || pt == _stroke_last)
+      return false;
+    // thick lines have round caps: the joints are round too
+    cv::line(_stroke_mask, _stroke_last, pt, cv::Scalar::all(255), 2 * _stroke_radius + 1);
+    add_stroke_dirty_rect(_stroke_last, pt);
+    _stroke_last = pt;
+    return true;
+  }
+
+  /*!
+   * Turn the free pixels of _stroke_mask into edges, recording them as runs
+   * in the undo history.
+   * \return the rectangle of _contours that may have changed, empty if none
+   */
+  cv::Rect flush_stroke() {
+    if (!_stroke_dirty)
+      return cv::Rect();
+    cv::Rect roi = _stroke_dirty_rect & cv::Rect(0, 0, _contours.cols, _contours.rows);
+    for (int row = roi.y; row < roi.y + roi.height; ++row) {
+      uchar* mask_ptr = _stroke_mask.ptr<uchar>(row);
+      uchar* contours_ptr = _contours.ptr<uchar>(row);
+      int run_begin = -1;
+      for (int col = roi.x; col <= roi.x + roi.width; ++col) {
+        bool new_edge = (col < roi.x + roi.width
+                         && mask_ptr[col] && contours_ptr[col] == 255);
+        if (new_edge && run_begin < 0)
+          run_begin = col;
+        else if (!new_edge && run_begin >= 0) {
+          _history.add_run(row, run_begin, col - run_begin, contours_ptr + run_begin);
+          memset(contours_ptr + run_begin, 0, col - run_begin);
+          run_begin = -1;
+        }
+      } // end loop col
+      memset(mask_ptr + roi.x, 0, roi.width);
+    } // end loop row
+    _stroke_dirty = false;
+    return roi;
+  } // end flush_stroke()
+
+  //! flush and end the stroke, \return false if none was active
+  bool end_stroke() {
+    if (!_stroke_active)
+      return false;
+    flush_stroke();
+    _stroke_active = false;
+    _history.end_action();
+    return true;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! undo the last action, \return false if none
+  inline bool undo(UndoHistory::Layer & layer, cv::Rect & changed) {
+    end_stroke();
+    return _history.undo(_user_image, _contours, layer, changed);
+  }
+  //! redo the last undone action, \return false if none
+  inline bool redo(UndoHistory::Layer & layer, cv::Rect & changed) {
+    end_stroke();
+    return _history.redo(_user_image, _contours, layer, changed);
+  }
+
+  //! discard the floodfills and the contour strokes
+  void clear() {
+    end_stroke();
+    _contours_pristine.copyTo(_contours);
+    _user_image.setTo(cv::Scalar::all(0));
+    _history.clear();
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Apply journal operations.
+   * \param fills (out)
+   *    if not NULL, the fills and pre-fills are appended to it
+   * \return true if an operation other than a pre-fill changed the frame
+   */
+  bool replay(const AnnotationJournal::Ops & ops, AnnotationJournal::Ops* fills = NULL) {
+    bool edited = false;
+    UndoHistory::Layer layer;
+    cv::Rect changed;
+    for (unsigned int i = 0; i < ops.size(); ++i) {
+      const AnnotationJournal::Op & op = ops[i];
+      switch (op.type) {
+        case AnnotationJournal::OP_FILL:
+        case AnnotationJournal::OP_PREFILL: {
+          // on an edge, nothing to do: reannotate flags it
+          bool filled = fill(op.x, op.y, cv::Vec3b(op.color[0], op.color[1], op.color[2]));
+          edited = edited || (filled && op.type == AnnotationJournal::OP_FILL);
+          if (fills)
+            fills->push_back(op);
+          break;
+        }
+        case AnnotationJournal::OP_STROKE_BEGIN:
+          edited = begin_stroke(op.x, op.y, op.radius) || edited;
+          break;
+        case AnnotationJournal::OP_STROKE_TO:  extend_stroke(op.x, op.y); break;
+        case AnnotationJournal::OP_STROKE_END: end_stroke(); break;
+        case AnnotationJournal::OP_UNDO:       edited = undo(layer, changed) || edited; break;
+        case AnnotationJournal::OP_REDO:       edited = redo(layer, changed) || edited; break;
+        case AnnotationJournal::OP_CLEAR:      clear(); edited = true; break;
+        case AnnotationJournal::OP_VISIT:
+        case AnnotationJournal::OP_WRITTEN:    break; // markers
+      } // end switch
+    } // end loop i
+    end_stroke();
+    return edited;
+  } // end replay()
+
+protected:
+  //! extend the rectangle to update by flush_stroke() with the segment [a, b]
+  void add_stroke_dirty_rect(const cv::Point & a, const cv::Point & b) {
+    cv::Point margin(_stroke_radius + 1, _stroke_radius + 1);
+    cv::Rect segment(cv::Point(std::min(a.x, b.x), std::min(a.y, b.y)) - margin,
+                     cv::Point(std::max(a.x, b.x), std::max(a.y, b.y)) + margin + cv::Point(1, 1));
+    _stroke_dirty_rect = (_stroke_dirty ? (_stroke_dirty_rect | segment) : segment);
+    _stroke_dirty = true;
+  }
+
+  //! a span visitor storing each span in the history before painting it
+  struct RecordingSpanPainter {
+    RecordingSpanPainter(UndoHistory & history, const cv::Mat3b & img,
+                         image_utils::FloodfillSpanPainter<cv::Vec3b> & painter) :
+      _history(history), _img(img), _painter(painter) {}
+    inline void operator()(int row, int col_begin, int col_end) {
+      _history.add_run(row, col_begin, col_end - col_begin,
+                       _img.ptr<uchar>(row) + 3 * col_begin);
+      _painter(row, col_begin, col_end);
+    }
+    UndoHistory & _history;
+    const cv::Mat3b & _img;
+    image_utils::FloodfillSpanPainter<cv::Vec3b> & _painter;
+  }; // end struct RecordingSpanPainter
+
+  cv::Mat3b _user_image; // does not include contours
+  cv::Mat1b _contours;
+  cv::Mat1b _contours_pristine; //!< _contours before any contour stroke
+  UndoHistory _history;
+  // workspaces, reused across the edits
+  cv::Mat1b _contours_clone; //!< the floodfilled copy of _contours
+  std::vector<cv::Point> _floodfill_seeds;
+  // contour strokes
+  bool _stroke_active, _stroke_dirty;
+  int _stroke_radius; //!< the brush radius of the current stroke
+  cv::Point _stroke_last; //!< the last position of the stroke, full resolution
+  cv::Rect _stroke_dirty_rect; //!< what changed since the last flush_stroke()
+  cv::Mat1b _stroke_mask; //!< the stroke pixels not yet flushed into _contours
+}; // end class AnnotationEditor
+
+#endif // ANNOTATION_EDITOR_H
@@ -0,0 +1,553 @@
+/*!
+  \file        annotation_journal.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+\class AnnotationJournal
+An append-only journal of the annotation operations,
+for recovering the work lost by a crash or a killed session.
+
+Each operation is a text line, the frame filename being the end of the line:
+  visit HASH FRAME        the first edit of a visit of the frame: the user image
+                          it started from has this image_content_hash(), 0 if none
+  fill X Y B G R FRAME    floodfill from (X, Y) with the color (B, G, R)
+  prefill X Y B G R FRAME the same, for a region pre-filled from the previous frame
+  stroke RADIUS X Y FRAME begin a contour stroke
+  path N X1 Y1 .. XN YN FRAME
+                          extend the contour stroke through N points
+  to X Y FRAME            the same with one point, from older journals
+  end FRAME               end the contour stroke
+  undo FRAME, redo FRAME, clear FRAME
+  written HASH FRAME      the frame was saved: the operations before are done,
+                          the written user image has this image_content_hash()
+  saved FRAME             the same, without hash, from older journals
+  discard FRAME           the operations before were not recovered,
+                          or the frame was left without being written
+The lines are buffered, never written in the mouse callbacks:
+tick() writes them with a fdatasync() once the oldest one is SYNC_PERIOD_MS old,
+sync() when the annotator is idle, much cheaper than saving a PNG per edit.
+The points of a stroke are buffered too, one "path" line per loop of the annotator
+(flush_stroke_points()) instead of one line per mouse move.
+
+At opening, the operations of each frame after its last "written"
+are pending: replaying them over the frame, as loaded from the disk,
+rebuilds its state at the time of the crash.
+When no operation is pending, a journal longer than ROTATE_SIZE is archived
+as "FILE.1", "FILE.2"..., so that opening it stays fast;
+read_history() reads them all back, in their order.
+The hashes tell whether the saved operations of a frame rebuild its user image
+from a blank one, cf covers_from_blank().
+ */
+
+#ifndef ANNOTATION_JOURNAL_H
+#define ANNOTATION_JOURNAL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class AnnotationJournal {
+public:
+  //! the longest a line waits in the buffer before being written and synced (ms)
+  static const unsigned int SYNC_PERIOD_MS = 500;
+  //! the most points of a "path" line
+  static const unsigned int MAX_PATH_POINTS = 32;
+  //! the size from which a journal without pending operation is archived (bytes)
+  static const long ROTATE_SIZE = 1 << 20;
+  //! the size of the line buffer, a full buffer is written at once (bytes)
+  static const unsigned int BUFFER_SIZE = 8192;
+  //! the longest line
+  static const unsigned int MAX_LINE_SIZE = 1024;
+
+  enum OpType {
+    OP_FILL = 0,
+    OP_STROKE_BEGIN,
+    OP_STROKE_TO,
+    OP_STROKE_END,
+    OP_UNDO,
+    OP_REDO,
+    OP_CLEAR,
+    OP_PREFILL,
+    OP_VISIT,
+    OP_WRITTEN
+  };
+  //! an operation to replay
+  struct Op {
+    OpType type;
+    int x, y;
+    int radius; //!< OP_STROKE_BEGIN
+    unsigned char color[3]; //!< OP_FILL, OP_PREFILL
+    unsigned long long hash; //!< OP_VISIT, OP_WRITTEN, 0 if unknown
+  };
+  typedef std::vector<Op> Ops;
+  //! frame -> its operations
+  typedef std::map<std::string, Ops> OpsMap;
+
+  AnnotationJournal() : _fd(-1), _buffer_used(0), _first_buffered_ms(0),
+    _npath_points(0), _paused(false) {}
+  ~AnnotationJournal() { close(); }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Read the operations pending in the journal, then open it for appending.
+   * \return false if it could not be opened
+   */
+  bool open(const std::string & filename) {
+    close();
+    _filename = filename;
+    bool truncated = read_pending_ops();
+    if (_pending.empty() && rotate())
+      truncated = false; // a new file
+    _fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (_fd < 0) {
+      printf("AnnotationJournal: could not open '%s'!\n", filename.c_str());
+      return false;
+    }
+    if (truncated && ::write(_fd, "\n", 1) != 1) // end the truncated line
+      printf("AnnotationJournal: could not write '%s'!\n", filename.c_str());
+    return true;
+  }
+
+  //! write the buffered lines and close the journal
+  void close() {
+    if (_fd < 0)
+      return;
+    sync();
+    ::close(_fd);
+    _fd = -1;
+  }
+
+  inline bool is_open() const { return _fd >= 0; }
+  inline const std::string & filename() const { return _filename; }
+
+  //! while paused, nothing is recorded, for instance during a replay
+  inline void set_paused(bool paused) { _paused = paused; }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! the number of pending operations, all frames together
+  unsigned int npending_ops() const {
+    unsigned int nops = 0;
+    for (OpsMap::const_iterator it = _pending.begin(); it != _pending.end(); ++it)
+      nops += it->second.size();
+    return nops;
+  }
+  inline unsigned int npending_frames() const { return _pending.size(); }
+
+  /*!
+   * Move the pending operations of a frame into ops.
+   * \return false if it has none
+   */
+  bool take_pending_ops(const std::string & frame, Ops & ops) {
+    OpsMap::iterator it = _pending.find(frame);
+    if (it == _pending.end())
+      return false;
+    ops.swap(it->second);
+    _pending.erase(it);
+    return true;
+  }
+
+  //! forget all the pending operations, also in the journal file
+  void discard_pending_ops() {
+    for (OpsMap::const_iterator it = _pending.begin(); it != _pending.end(); ++it)
+      add_line("discard", it->first);
+    _pending.clear();
+    sync();
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  inline void fill(const std::string & frame, int x, int y, const unsigned char* color) {
+    add_fill("fill", frame, x, y, color);
+  }
+  inline void prefill(const std::string & frame, int x, int y, const unsigned char* color) {
+    add_fill("prefill", frame, x, y, color);
+  }
+  inline void stroke_begin(const std::string & frame, int radius, int x, int y) {
+    if (!recording())
+      return;
+    snprintf(_line, MAX_LINE_SIZE, "stroke %i %i %i", radius, x, y);
+    add_line(_line, frame);
+  }
+  //! only buffered, cf flush_stroke_points()
+  inline void stroke_to(const std::string & frame, int x, int y) {
+    if (!recording())
+      return;
+    if (_npath_points >= MAX_PATH_POINTS)
+      flush_stroke_points(frame);
+    _path_points[2 * _npath_points] = x;
+    _path_points[2 * _npath_points + 1] = y;
+    ++_npath_points;
+  }
+  //! journal the points of stroke_to() since the last call as one "path" line
+  void flush_stroke_points(const std::string & frame) {
+    if (_npath_points == 0)
+      return;
+    int pos = snprintf(_path_line, MAX_LINE_SIZE, "path %i", _npath_points);
+    for (unsigned int i = 0; i < _npath_points; ++i)
+      pos += snprintf(_path_line + pos, MAX_LINE_SIZE - pos, " %i %i",
+                      _path_points[2 * i], _path_points[2 * i + 1]);
+    _npath_points = 0; // before add_line(), that flushes them
+    add_line(_path_line, frame);
+  }
+  inline void stroke_end(const std::string & frame) { add_op("end", frame); }
+  inline void undo(const std::string & frame)       { add_op("undo", frame); }
+  inline void redo(const std::string & frame)       { add_op("redo", frame); }
+  inline void clear(const std::string & frame)      { add_op("clear", frame); }
+  //! before the first edit of a visit, \arg user_hash 0 if it has no user image
+  inline void visit(const std::string & frame, unsigned long long user_hash) {
+    add_hash("visit", frame, user_hash);
+  }
+  //! the frame was saved: written at once
+  inline void written(const std::string & frame, unsigned long long user_hash) {
+    add_hash("written", frame, user_hash);
+    sync();
+  }
+  //! the frame was left without writing it: its operations are not part of it
+  inline void discard(const std::string & frame) {
+    add_op("discard", frame);
+    sync();
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! write the buffered lines if the oldest one waited SYNC_PERIOD_MS. Once per loop
+  inline void tick() {
+    if (_buffer_used > 0 && now_ms() - _first_buffered_ms >= SYNC_PERIOD_MS)
+      sync();
+  }
+
+  //! write the buffered lines to the disk
+  void sync() {
+    if (_fd < 0 || _buffer_used == 0)
+      return;
+    const char* data = _buffer;
+    size_t left = _buffer_used;
+    while (left > 0) {
+      ssize_t nwritten = ::write(_fd, data, left);
+      if (nwritten <= 0) {
+        printf("AnnotationJournal: could not write '%s'!\n", _filename.c_str());
+        break;
+      }
+      data += nwritten;
+      left -= nwritten;
+    }
+    fdatasync(_fd);
+    _buffer_used = 0;
+  } // end sync()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Read the operations of a journal file, without opening it for appending.
+   * \param saved (out)
+   *    the operations of each frame that reached its saved annotation,
+   *    in their order, each save being an OP_WRITTEN. Can be NULL.
+   * \param pending (out)
+   *    the operations of each frame after its last "written"
+   * \param truncated (out)
+   *    true if the last line is truncated (crash while writing it). Can be NULL.
+   * \return false if the file could not be read
+   */
+  static bool read_ops(const std::string & filename, OpsMap* saved, OpsMap & pending,
+                       bool* truncated = NULL) {
+    pending.clear();
+    if (saved)
+      saved->clear();
+    return read_file(filename, saved, pending, truncated);
+  }
+
+  /*!
+   * read_ops() on the archives of the journal, cf rotate(), then on the journal.
+   * \return false if none could be read
+   */
+  static bool read_history(const std::string & filename, OpsMap & saved, OpsMap & pending) {
+    pending.clear();
+    saved.clear();
+    bool success = false;
+    for (unsigned int archive_idx = 1; ; ++archive_idx) {
+      if (!read_file(archive_filename(filename, archive_idx), &saved, pending))
+        break;
+      success = true;
+    }
+    return read_file(filename, &saved, pending) || success;
+  }
+
+  //! the archive #archive_idx of a journal, cf rotate()
+  static std::string archive_filename(const std::string & filename,
+                                      unsigned int archive_idx) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%i", archive_idx);
+    return filename + suffix;
+  }
+
+  /*!
+   * \return true if the saved operations of a frame, as given by read_ops(),
+   * rebuild its user image from a blank one:
+   * its first visit started without user image, each visit started from
+   * the user image written by the previous one, and the last one wrote the user
+   * image that is on the disk now, of hash \a user_hash (0 if none).
+   * False if an edit was not journaled, for instance in a session without journal,
+   * or if the journal is older than the hashes.
+   */
+  static bool covers_from_blank(const Ops & saved_ops, unsigned long long user_hash) {
+    unsigned long long disk_hash = 0; // no user image
+    bool in_visit = false;
+    for (unsigned int i = 0; i < saved_ops.size(); ++i) {
+      const Op & op = saved_ops[i];
+      if (op.type == OP_VISIT) {
+        if (op.hash != disk_hash) // again after a crash: the same user image
+          return false;
+        in_visit = true;
+      }
+      else if (op.type == OP_WRITTEN) {
+        if (!in_visit || op.hash == 0)
+          return false; // written without journaled edits, or no hash
+        disk_hash = op.hash;
+        in_visit = false;
+      }
+      else if (!in_visit)
+        return false; // an edit before any visit: an older journal
+    } // end loop i
+    return (!in_visit && disk_hash == user_hash);
+  } // end covers_from_blank()
+
+private:
+  inline bool recording() const { return _fd >= 0 && !_paused; }
+
+  static inline double now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1000. * now.tv_sec + 1E-6 * now.tv_nsec;
+  }
+
+  //! the lines of a file appended to saved and pending, cf read_ops()
+  static bool read_file(const std::string & filename, OpsMap* saved, OpsMap & pending,
+                        bool* truncated = NULL) {
+    if (truncated)
+      *truncated = false;
+    FILE* file = fopen(filename.c_str(), "r");
+    if (file == NULL)
+      return false;
+    char line[MAX_LINE_SIZE];
+    unsigned int nlines = 0, nbad_lines = 0;
+    bool last_truncated = false;
+    while (fgets(line, MAX_LINE_SIZE, file) != NULL) {
+      ++nlines;
+      size_t line_size = strlen(line);
+      last_truncated = (line_size == 0 || line[line_size - 1] != '\n');
+      if (last_truncated) {
+        ++nbad_lines;
+        continue;
+      }
+      line[line_size - 1] = '\0';
+      if (!parse_line(line, saved, pending))
+        ++nbad_lines;
+    }
+    fclose(file);
+    if (nbad_lines)
+      printf("AnnotationJournal: ignored %i bad lines out of %i in '%s'\n",
+             nbad_lines, nlines, filename.c_str());
+    if (truncated)
+      *truncated = last_truncated;
+    return true;
+  } // end read_file()
+
+  inline void add_op(const char* op, const std::string & frame) {
+    if (recording())
+      add_line(op, frame);
+  }
+
+  inline void add_fill(const char* op, const std::string & frame,
+                       int x, int y, const unsigned char* color) {
+    if (!recording())
+      return;
+    snprintf(_line, MAX_LINE_SIZE, "%s %i %i %i %i %i", op, x, y,
+             (int) color[0], (int) color[1], (int) color[2]);
+    add_line(_line, frame);
+  }
+
+  inline void add_hash(const char* op, const std::string & frame,
+                       unsigned long long hash) {
+    if (!recording())
+      return;
+    snprintf(_line, MAX_LINE_SIZE, "%s %llu", op, hash);
+    add_line(_line, frame);
+  }
+
+  //! buffer "op frame\n", write the buffer if it is full. Never allocates
+  void add_line(const char* op, const std::string & frame) {
+    flush_stroke_points(frame); // in their order
+    size_t op_size = strlen(op), line_size = op_size + 1 + frame.size() + 1;
+    if (_buffer_used + line_size > BUFFER_SIZE)
+      sync();
+    if (line_size > BUFFER_SIZE) {
+      printf("AnnotationJournal: frame name '%s' too long!\n", frame.c_str());
+      return;
+    }
+    char* dst = _buffer + _buffer_used;
+    memcpy(dst, op, op_size);
+    dst[op_size] = ' ';
+    memcpy(dst + op_size + 1, frame.data(), frame.size());
+    dst[line_size - 1] = '\n';
+    if (_buffer_used == 0)
+      _first_buffered_ms = now_ms();
+    _buffer_used += line_size;
+  } // end add_line()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Archive the journal as the first free "FILE.N" if it is longer than ROTATE_SIZE.
+   * Only without pending operations: the archives only have saved ones.
+   * \return true if it was archived
+   */
+  bool rotate() {
+    struct stat file_stat;
+    if (stat(_filename.c_str(), &file_stat) != 0 || file_stat.st_size < ROTATE_SIZE)
+      return false;
+    unsigned int archive_idx = 1;
+    while (access(archive_filename(_filename, archive_idx).c_str(), F_OK) == 0)
+      ++archive_idx;
+    std::string archive = archive_filename(_filename, archive_idx);
+    if (rename(_filename.c_str(), archive.c_str()) != 0) {
+      printf("AnnotationJournal: could not archive '%s' as '%s'!\n",
+             _filename.c_str(), archive.c_str());
+      return false;
+    }
+    printf("AnnotationJournal: archived '%s' as '%s'\n", _filename.c_str(), archive.c_str());
+    return true;
+  } // end rotate()
+
+  //! \return true if the last line of the journal is truncated
+  bool read_pending_ops() {
+    bool truncated = false;
+    read_ops(_filename, NULL, _pending, &truncated); // no file: new journal
+    return truncated;
+  }
+
+  static bool parse_line(const char* line, OpsMap* saved, OpsMap & pending) {
+    char op_name[16];
+    int frame_pos = 0;
+    Op op = Op();
+    int b = 0, g = 0, r = 0;
+    if (sscanf(line, "%15s %n", op_name, &frame_pos) != 1)
+      return false;
+    std::string name(op_name);
+    if (name == "fill" || name == "prefill") {
+      op.type = (name == "fill" ? OP_FILL : OP_PREFILL);
+      if (sscanf(line, "%*s %i %i %i %i %i %n", &op.x, &op.y, &b, &g, &r, &frame_pos) != 5)
+        return false;
+      op.color[0] = b; op.color[1] = g; op.color[2] = r;
+    }
+    else if (name == "stroke") {
+      op.type = OP_STROKE_BEGIN;
+      if (sscanf(line, "%*s %i %i %i %n", &op.radius, &op.x, &op.y, &frame_pos) != 3)
+        return false;
+    }
+    else if (name == "to") {
+      op.type = OP_STROKE_TO;
+      if (sscanf(line, "%*s %i %i %n", &op.x, &op.y, &frame_pos) != 2)
+        return false;
+    }
+    else if (name == "path") {
+      unsigned int npoints = 0;
+      int xy[2 * MAX_PATH_POINTS], pos = 0;
+      if (sscanf(line, "%*s %u %n", &npoints, &frame_pos) != 1
+          || npoints == 0 || npoints > MAX_PATH_POINTS)
+        return false;
+      for (unsigned int i = 0; i < npoints; ++i, frame_pos += pos)
+        if (sscanf(line + frame_pos, "%i %i %n", &xy[2 * i], &xy[2 * i + 1], &pos) != 2)
+          return false;
+      std::string frame(line + frame_pos);
+      if (frame.empty())
+        return false;
+      Ops & frame_ops = pending[frame];
+      op.type = OP_STROKE_TO;
+      for (unsigned int i = 0; i < npoints; ++i) {
+        op.x = xy[2 * i];
+        op.y = xy[2 * i + 1];
+        frame_ops.push_back(op);
+      }
+      return true;
+    }
+    else if (name == "visit") {
+      op.type = OP_VISIT;
+      if (sscanf(line, "%*s %llu %n", &op.hash, &frame_pos) != 1)
+        return false;
+    }
+    else if (name == "end")   op.type = OP_STROKE_END;
+    else if (name == "undo")  op.type = OP_UNDO;
+    else if (name == "redo")  op.type = OP_REDO;
+    else if (name == "clear") op.type = OP_CLEAR;
+    else if (name == "written" || name == "saved") {
+      op.type = OP_WRITTEN;
+      if (name == "written" && sscanf(line, "%*s %llu %n", &op.hash, &frame_pos) != 1)
+        return false;
+      std::string frame(line + frame_pos);
+      if (frame.empty())
+        return false;
+      OpsMap::iterator it = pending.find(frame);
+      if (saved) { // even without pending operations: the user image changed
+        Ops & frame_saved = (*saved)[frame];
+        if (it != pending.end())
+          frame_saved.insert(frame_saved.end(), it->second.begin(), it->second.end());
+        frame_saved.push_back(op);
+      }
+      if (it != pending.end())
+        pending.erase(it);
+      return true;
+    }
+    else if (name == "discard") {
+      pending.erase(std::string(line + frame_pos));
+      return true;
+    }
+    else
+      return false;
+    std::string frame(line + frame_pos);
+    if (frame.empty())
+      return false;
+    pending[frame].push_back(op);
+    return true;
+  } // end parse_line()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  std::string _filename;
+  int _fd;
+  char _buffer[BUFFER_SIZE];
+  size_t _buffer_used;
+  double _first_buffered_ms; //!< when the oldest buffered line was added
+  char _line[MAX_LINE_SIZE];
+  int _path_points[2 * MAX_PATH_POINTS]; //!< x, y of the points of stroke_to()
+  unsigned int _npath_points;
+  char _path_line[MAX_LINE_SIZE];
+  bool _paused;
+  OpsMap _pending; //!< frame -> its operations after its last "written"
+}; // end class AnnotationJournal
+
+#endif // ANNOTATION_JOURNAL_H
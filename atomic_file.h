@@ -0,0 +1,174 @@
+/*!
+  \file        atomic_file.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+Writing files safely when several processes share a dataset.
+
+A file is written to a unique temporary file next to it,
+"DIR/.NAME.XXXXXX.EXT", then renamed over it: on the same filesystem,
+rename() is atomic, so a concurrent reader (another annotator,
+a training job) sees either the old file or the new one,
+never a half-written one, and two writers never share a temporary file.
+
+\class FrameLock
+An advisory lock on a file, "FILE.lock" locked with flock(),
+so that two annotators do not edit the same frame at the same time.
+The kernel releases it if the process dies: a stale lock file is harmless.
+ */
+
+#ifndef ATOMIC_FILE_H
+#define ATOMIC_FILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <opencv2/highgui/highgui.hpp>
+
+/*!
+ * Create a unique empty file in the folder of filename, with its extension
+ * (so that the image codecs choose the same format).
+ * \return its name, empty if it could not be created
+ */
+inline std::string make_temp_file(const std::string & filename) {
+  size_t slash_pos = filename.find_last_of('/');
+  std::string folder = (slash_pos == std::string::npos ? "" : filename.substr(0, slash_pos + 1));
+  std::string name = filename.substr(folder.size());
+  size_t dot_pos = name.find_last_of('.');
+  std::string ext = (dot_pos == std::string::npos ? "" : name.substr(dot_pos));
+  std::string pattern = folder + "." + name.substr(0, name.size() - ext.size())
+      + ".XXXXXX" + ext;
+  std::vector<char> buffer(pattern.begin(), pattern.end());
+  buffer.push_back('\0');
+  int fd = mkstemps(&(buffer[0]), ext.size());
+  if (fd < 0) {
+    printf("make_temp_file(): could not create a temporary file for '%s'\n",
+           filename.c_str());
+    return "";
+  }
+  // mkstemps() gives 0600: give the renamed file the usual permissions
+  mode_t mask = umask(0);
+  umask(mask);
+  fchmod(fd, 0666 & ~mask);
+  close(fd);
+  return std::string(&(buffer[0]));
+} // end make_temp_file()
+
+//! rename tmp_filename to filename, or remove it if that fails
+inline bool commit_temp_file(const std::string & tmp_filename,
+                             const std::string & filename) {
+  if (rename(tmp_filename.c_str(), filename.c_str()) == 0)
+    return true;
+  printf("commit_temp_file(): could not rename '%s' to '%s'\n",
+         tmp_filename.c_str(), filename.c_str());
+  remove(tmp_filename.c_str());
+  return false;
+}
+
+//! cv::imwrite() through a temporary file. \return true if success
+inline bool imwrite_atomic(const std::string & filename, const cv::Mat & img,
+                           const std::vector<int> & params = std::vector<int>()) {
+  std::string tmp_filename = make_temp_file(filename);
+  if (tmp_filename.empty())
+    return false;
+  bool success = false;
+  try {
+    success = cv::imwrite(tmp_filename, img, params);
+  }
+  catch (cv::Exception e) {
+    printf("imwrite_atomic(): exception '%s'\n", e.what());
+  }
+  if (!success) {
+    remove(tmp_filename.c_str());
+    return false;
+  }
+  return commit_temp_file(tmp_filename, filename);
+} // end imwrite_atomic()
+
+////////////////////////////////////////////////////////////////////////////////
+
+class FrameLock {
+public:
+  FrameLock() : _fd(-1) {}
+  ~FrameLock() { release(); }
+
+  /*!
+   * Lock "filename" + suffix, releasing the previous lock.
+   * \return false if another process holds it, or on an unexpected error
+   *    (for instance out of file descriptors).
+   *    True if the lock file could not be created because the folder is
+   *    read-only (EROFS, EACCES): there is nothing to protect then.
+   */
+  bool acquire(const std::string & filename, const char* suffix = ".lock") {
+    release();
+    std::string lock_filename = filename + suffix;
+    // the holder may remove the lock file between our open() and flock(): retry
+    for (unsigned int attempt = 0; attempt < 3; ++attempt) {
+      int fd = ::open(lock_filename.c_str(), O_RDWR | O_CREAT, 0666);
+      if (fd < 0 && (errno == EROFS || errno == EACCES)) {
+        printf("FrameLock: could not create '%s' in a read-only folder, not locking it.\n",
+               lock_filename.c_str());
+        return true;
+      }
+      if (fd < 0) {
+        printf("FrameLock: could not create '%s': %s\n",
+               lock_filename.c_str(), strerror(errno));
+        return false;
+      }
+      if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        ::close(fd);
+        return false;
+      }
+      struct stat fd_stat, file_stat;
+      if (fstat(fd, &fd_stat) == 0 && stat(lock_filename.c_str(), &file_stat) == 0
+          && fd_stat.st_dev == file_stat.st_dev && fd_stat.st_ino == file_stat.st_ino) {
+        _fd = fd;
+        _lock_filename = lock_filename;
+        return true;
+      }
+      ::close(fd); // we locked a removed file
+    } // end loop attempt
+    return false;
+  } // end acquire()
+
+  //! remove the lock file, then unlock it
+  void release() {
+    if (_fd < 0)
+      return;
+    remove(_lock_filename.c_str()); // while still locked, cf acquire()
+    ::close(_fd);
+    _fd = -1;
+  }
+
+  inline bool is_locked() const { return _fd >= 0; }
+
+private:
+  int _fd;
+  std::string _lock_filename;
+}; // end class FrameLock
+
+#endif // ATOMIC_FILE_H
@@ -0,0 +1,109 @@
+/*!
+  \file        benchmark_float_uchar_conversion.cpp
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+Measure the scaling of convert_float_to_uchar() and convert_uchar_to_float()
+from 1 to N threads, on a synthetic float depth image with NaNs.
+With 1 thread, the single-threaded path is used.
+The results of all thread counts are checked against the single-threaded ones.
+
+Synopsis:
+$ benchmark_float_uchar_conversion [COLS ROWS [MAX_THREADS [NTIMES]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "cv_conversion_float_uchar.h"
+
+//! a ramp between .5 and 8 meters, with some NaN blobs
+void make_depth_image(cv::Mat1f & depth, int cols, int rows) {
+  depth.create(rows, cols);
+  cv::RNG rng(0);
+  for (int row = 0; row < rows; ++row) {
+    float* depth_ptr = depth.ptr<float>(row);
+    for (int col = 0; col < cols; ++col)
+      depth_ptr[col] = .5f + 7.5f * (row + col) / (rows + cols)
+                       + rng.uniform(0.f, .01f);
+  } // end loop row
+  for (int blob = 0; blob < 50; ++blob)
+    cv::circle(depth, cv::Point(rng.uniform(0, cols), rng.uniform(0, rows)),
+               rng.uniform(5, 50), cv::Scalar::all(image_utils::NAN_DEPTH), -1);
+} // end make_depth_image()
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+  int cols = (argc >= 3 ? atoi(argv[1]) : 1920);
+  int rows = (argc >= 3 ? atoi(argv[2]) : 1080);
+  int max_threads = (argc >= 4 ? atoi(argv[3]) : cv::getNumberOfCPUs());
+  int ntimes = (argc >= 5 ? atoi(argv[4]) : 50);
+  printf("Benchmarking %ix%i images, %i times, from 1 to %i threads "
+         "(parallel above %i values)\n", cols, rows, ntimes, max_threads,
+         image_utils::PARALLEL_CONVERSION_MIN_VALUES);
+
+  cv::Mat1f depth;
+  make_depth_image(depth, cols, rows);
+  cv::Mat depth_uchar, depth_float;
+  image_utils::FloatToUcharWorkspace depth_clean;
+  cv::Mat ref_uchar, ref_float;
+  image_utils::ScaleFactorType alpha, beta, ref_alpha = 0, ref_beta = 0;
+  double ticks2ms = 1000. / cv::getTickFrequency();
+  double ref_float2uchar_ms = 0, ref_uchar2float_ms = 0;
+  bool all_ok = true;
+
+  printf("threads  float->uchar(ms)  speedup  uchar->float(ms)  speedup  results\n");
+  for (int nthreads = 1; nthreads <= max_threads; ++nthreads) {
+    cv::setNumThreads(nthreads);
+    // warm up: allocate the outputs, start the threads
+    image_utils::convert_float_to_uchar(depth, depth_uchar, depth_clean, alpha, beta);
+    image_utils::convert_uchar_to_float(depth_uchar, depth_float, alpha, beta);
+
+    int64 begin_ticks = cv::getTickCount();
+    for (int i = 0; i < ntimes; ++i)
+      image_utils::convert_float_to_uchar(depth, depth_uchar, depth_clean, alpha, beta);
+    double float2uchar_ms = (cv::getTickCount() - begin_ticks) * ticks2ms / ntimes;
+
+    begin_ticks = cv::getTickCount();
+    for (int i = 0; i < ntimes; ++i)
+      image_utils::convert_uchar_to_float(depth_uchar, depth_float, alpha, beta);
+    double uchar2float_ms = (cv::getTickCount() - begin_ticks) * ticks2ms / ntimes;
+
+    // check against the single-threaded results
+    bool ok = true;
+    if (nthreads == 1) {
+      depth_uchar.copyTo(ref_uchar);
+      depth_float.copyTo(ref_float);
+      ref_alpha = alpha;
+      ref_beta = beta;
+      ref_float2uchar_ms = float2uchar_ms;
+      ref_uchar2float_ms = uchar2float_ms;
+    }
+    else
+      ok = (alpha == ref_alpha && beta == ref_beta
+            && cv::countNonZero(depth_uchar != ref_uchar) == 0
+            && cv::countNonZero(depth_float != ref_float) == 0);
+    all_ok = all_ok && ok;
+    printf("%7i  %16.2f  %7.2f  %16.2f  %7.2f  %s\n", nthreads,
+           float2uchar_ms, ref_float2uchar_ms / float2uchar_ms,
+           uchar2float_ms, ref_uchar2float_ms / uchar2float_ms,
+           (ok ? "OK" : "DIFFERENT"));
+  } // end loop nthreads
+  return (all_ok ? 0 : 1);
+}
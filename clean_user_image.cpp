@@ -82,6 +82,6 @@ int main(int argc, char** argv) {
     cv::imshow("user_img_cleaned", user_img_cleaned); cv::waitKey(10);
     std::string filename_out = remove_filename_extension(filename) + "_cleaned.png";
     printf("Saving file '%s'\n", filename_out.c_str());
-    cv::imwrite(filename_out, user_img_cleaned, params);
+    imwrite_atomic(filename_out, user_img_cleaned, params);
   } // end loop i
 }
@@ -0,0 +1,71 @@
+/*!
+  \file        content_hash.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+Content hashes, telling whether an image changed or keying a cache.
+
+A FNV-1a variant reading 64-bit words instead of bytes:
+one multiply per 8 bytes, the latency chain of the byte-wise FNV-1a
+being the bottleneck on full frames.
+A xor-shift after each multiply brings the high bits down,
+so that a change in any byte of a word reaches all the bits of the hash.
+ */
+
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <string.h>
+#include <opencv2/core/core.hpp>
+
+//! the initial value of the hashes
+static const unsigned long long CONTENT_HASH_SEED = 14695981039346656037ULL;
+static const unsigned long long CONTENT_HASH_PRIME = 1099511628211ULL;
+
+//! hash nbytes of data, continuing \a hash
+inline unsigned long long content_hash(const void* data, size_t nbytes,
+                                       unsigned long long hash = CONTENT_HASH_SEED) {
+  const unsigned char* bytes = (const unsigned char*) data;
+  size_t nwords = nbytes / sizeof(unsigned long long);
+  for (size_t i = 0; i < nwords; ++i) {
+    unsigned long long word;
+    memcpy(&word, bytes + i * sizeof(word), sizeof(word)); // unaligned rows
+    hash = (hash ^ word) * CONTENT_HASH_PRIME;
+    hash ^= hash >> 32;
+  }
+  for (size_t i = nwords * sizeof(unsigned long long); i < nbytes; ++i)
+    hash = (hash ^ bytes[i]) * CONTENT_HASH_PRIME;
+  return hash;
+}
+
+/*!
+ * hash the pixels of an image, continuing \a hash.
+ * Row by row, so that the hash does not depend on the layout in memory:
+ * a ROI or a padded image hash as their continuous copy.
+ */
+inline unsigned long long image_content_hash(const cv::Mat & img,
+                                             unsigned long long hash = CONTENT_HASH_SEED) {
+  size_t row_bytes = img.cols * img.elemSize();
+  for (int row = 0; row < img.rows; ++row)
+    hash = content_hash(img.ptr(row), row_bytes, hash);
+  return hash;
+}
+
+#endif // CONTENT_HASH_H
@@ -0,0 +1,354 @@
+/*!
+  \file        contour_cache.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+\class ContourCache
+A persistent, content-addressed cache of contour images.
+
+The key of a contour image is a hash of the depth image it was computed from,
+of a description of the edge detector parameters,
+and of CONTOUR_ALGO_VERSION, to be increased when the edge detection changes.
+So the same depth with the same parameters always gives the same entry,
+whatever the file or the session, and a parameter change gives a new entry.
+
+The entries are files "<key>.rle" in the cache folder.
+The contour images (0 for edges, 255 elsewhere) are stored as runs,
+their lengths being LEB128 varints: a 640x480 contour image takes a few kB.
+The total size of the folder is capped: when it is exceeded,
+the least recently used entries are deleted, their use time being
+their modification time, updated at each hit.
+ */
+
+#ifndef CONTOUR_CACHE_H
+#define CONTOUR_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utime.h>
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <span_tracer.h>
+#include "atomic_file.h"
+#include "content_hash.h"
+
+//! increase it when the edge detection changes, to invalidate the cached contours
+static const unsigned int CONTOUR_ALGO_VERSION = 1;
+
+class ContourCache {
+public:
+  typedef unsigned long long Key;
+  //! the default max size of the cache folder (bytes)
+  static const unsigned long DEFAULT_MAX_BYTES = 256UL * 1024 * 1024;
+  //! when full, the oldest entries are evicted down to this ratio of the max size
+  static const double EVICTION_TARGET_RATIO = .9;
+
+  ContourCache() : _max_bytes(DEFAULT_MAX_BYTES), _total_bytes(0),
+    _nhits(0), _nmisses(0), _nevictions(0) {}
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*! use the folder \a folder, created if needed.
+   * \return false if it cannot be used, the cache is then disabled */
+  bool open(const std::string & folder,
+            unsigned long max_bytes = DEFAULT_MAX_BYTES) {
+    _folder.clear();
+    if (folder.empty() || !mkdir_p(folder)) {
+      printf("ContourCache: cannot use folder '%s', cache disabled.\n",
+             folder.c_str());
+      return false;
+    }
+    _folder = folder;
+    _max_bytes = max_bytes;
+    std::vector<Entry> entries;
+    list_entries(entries);
+    printf("ContourCache: %i entries (%.1f MB) in '%s'\n",
+           (int) entries.size(), _total_bytes / 1E6, _folder.c_str());
+    return true;
+  }
+
+  inline bool is_open() const { return !_folder.empty(); }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * \param depth
+   *    the depth image, any type
+   * \param params
+   *    a description of the parameters of the edge detection,
+   *    for instance "canny 1 1.6 nan 2 1"
+   * \return the key of the contour image
+   */
+  static Key make_key(const cv::Mat & depth, const std::string & params) {
+    TRACE_SPAN("ContourCache::make_key");
+    Key hash = content_hash(&CONTOUR_ALGO_VERSION, sizeof(CONTOUR_ALGO_VERSION));
+    int header[3] = {depth.cols, depth.rows, depth.type()};
+    hash = content_hash(header, sizeof(header), hash);
+    hash = content_hash(params.data(), params.size(), hash);
+    return image_content_hash(depth, hash);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * \param size
+   *    the size of the depth image of the key: an entry of another size is corrupted
+   * \return true if the entry was found, stored in \a contour
+   */
+  bool get(const Key key, const cv::Size & size, cv::Mat1b & contour) {
+    if (!is_open())
+      return false;
+    TRACE_SPAN("ContourCache::get");
+    std::string filename = key2filename(key);
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+      ++_nmisses;
+      return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    _buffer.resize(std::max(file_size, 0L));
+    bool ok = (file_size > 0
+               && fread(&(_buffer[0]), 1, file_size, file) == (size_t) file_size);
+    fclose(file);
+    if (!ok || !decode(_buffer, size, contour)) {
+      printf("ContourCache: corrupted entry '%s', removing it.\n", filename.c_str());
+      remove(filename.c_str());
+      ++_nmisses;
+      return false;
+    }
+    utime(filename.c_str(), NULL); // most recently used
+    ++_nhits;
+    return true;
+  } // end get()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! store a contour image (only made of 0 and 255). \return true if success
+  bool put(const Key key, const cv::Mat1b & contour) {
+    if (!is_open())
+      return false;
+    TRACE_SPAN("ContourCache::put");
+    if (!encode(contour, _buffer))
+      return false; // not a binary image
+    // write then rename, so that a crash never leaves a truncated entry,
+    // through a unique file as several annotators may share the cache
+    std::string filename = key2filename(key), tmp_filename = make_temp_file(filename);
+    if (tmp_filename.empty())
+      return false;
+    FILE* file = fopen(tmp_filename.c_str(), "wb");
+    if (file == NULL) {
+      remove(tmp_filename.c_str());
+      return false;
+    }
+    bool ok = (fwrite(&(_buffer[0]), 1, _buffer.size(), file) == _buffer.size());
+    ok = (fclose(file) == 0) && ok;
+    // the entry may already exist (stored by another annotator): it is replaced
+    struct stat old_stat;
+    unsigned long old_bytes = (stat(filename.c_str(), &old_stat) == 0 ? old_stat.st_size : 0);
+    if (!ok || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+      remove(tmp_filename.c_str());
+      return false;
+    }
+    _total_bytes -= std::min(old_bytes, _total_bytes);
+    _total_bytes += _buffer.size();
+    if (_total_bytes > _max_bytes)
+      evict();
+    return true;
+  } // end put()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! a description of the cache state, for the HUD
+  std::string state() const {
+    if (!is_open())
+      return "cache:off";
+    std::ostringstream out;
+    out << "cache:" << _nhits << " hits/" << _nmisses << " misses/"
+        << _nevictions << " evicted "
+        << (int) (_total_bytes / 1E6) << "/" << (int) (_max_bytes / 1E6) << "MB";
+    return out.str();
+  }
+
+private:
+  struct Entry {
+    std::string filename;
+    time_t mtime;
+    unsigned long bytes;
+    bool operator < (const Entry & b) const { return mtime < b.mtime; }
+  };
+
+  //! the first bytes of an entry file
+  static const unsigned int MAGIC = 0x31524343; // "CCR1"
+
+  inline std::string key2filename(const Key key) const {
+    char name[32];
+    sprintf(name, "/%016llx.rle", key);
+    return _folder + name;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! create a folder and its parents. \return true if it exists afterwards
+  static bool mkdir_p(const std::string & folder) {
+    for (size_t slash = folder.find('/', 1); slash != std::string::npos;
+         slash = folder.find('/', slash + 1))
+      mkdir(folder.substr(0, slash).c_str(), 0755);
+    mkdir(folder.c_str(), 0755);
+    struct stat st;
+    return (stat(folder.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+  }
+
+  //! list the entries of the folder, and update _total_bytes
+  void list_entries(std::vector<Entry> & entries) {
+    entries.clear();
+    _total_bytes = 0;
+    DIR* dir = opendir(_folder.c_str());
+    if (dir == NULL)
+      return;
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+      std::string name(dirent->d_name);
+      if (name.size() < 4 || name.substr(name.size() - 4) != ".rle")
+        continue;
+      Entry entry;
+      entry.filename = _folder + "/" + name;
+      struct stat st;
+      if (stat(entry.filename.c_str(), &st) != 0)
+        continue;
+      entry.mtime = st.st_mtime;
+      entry.bytes = st.st_size;
+      _total_bytes += entry.bytes;
+      entries.push_back(entry);
+    } // end while (dirent)
+    closedir(dir);
+  } // end list_entries()
+
+  //! delete the least recently used entries until below the target size
+  void evict() {
+    TRACE_SPAN("ContourCache::evict");
+    std::vector<Entry> entries;
+    list_entries(entries);
+    std::sort(entries.begin(), entries.end());
+    unsigned long target_bytes = EVICTION_TARGET_RATIO * _max_bytes;
+    for (unsigned int i = 0; i < entries.size() && _total_bytes > target_bytes; ++i) {
+      if (remove(entries[i].filename.c_str()) != 0)
+        continue;
+      _total_bytes -= entries[i].bytes;
+      ++_nevictions;
+    }
+  } // end evict()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  static inline void push_varint(unsigned int val, std::vector<uchar> & out) {
+    while (val >= 0x80) {
+      out.push_back((val & 0x7F) | 0x80);
+      val >>= 7;
+    }
+    out.push_back(val);
+  }
+
+  //! \return false if the buffer is exhausted
+  static inline bool read_varint(const std::vector<uchar> & in, size_t & pos,
+                                 unsigned int & val) {
+    val = 0;
+    for (int shift = 0; pos < in.size() && shift < 35; shift += 7) {
+      uchar byte = in[pos++];
+      val |= (unsigned int) (byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  /*! magic, cols, rows, then the lengths of the alternate runs of 255 and 0,
+   * starting with 255 (maybe an empty run).
+   * \return false if the image has other values than 0 and 255 */
+  static bool encode(const cv::Mat1b & contour, std::vector<uchar> & out) {
+    out.clear();
+    push_varint(MAGIC, out);
+    push_varint(contour.cols, out);
+    push_varint(contour.rows, out);
+    uchar curr_val = 255;
+    unsigned int run = 0;
+    for (int row = 0; row < contour.rows; ++row) {
+      const uchar* contour_ptr = contour.ptr<uchar>(row);
+      for (int col = 0; col < contour.cols; ++col) {
+        uchar val = contour_ptr[col];
+        if (val == curr_val) {
+          ++run;
+          continue;
+        }
+        if (val != 0 && val != 255)
+          return false;
+        push_varint(run, out);
+        curr_val = val;
+        run = 1;
+      } // end loop col
+    } // end loop row
+    push_varint(run, out);
+    return true;
+  } // end encode()
+
+  /*! \return false if the buffer is corrupted, or if its size is not \a size:
+   * its rows and cols are never trusted to allocate */
+  static bool decode(const std::vector<uchar> & in, const cv::Size & size,
+                     cv::Mat1b & contour) {
+    size_t pos = 0;
+    unsigned int magic, cols, rows;
+    if (!read_varint(in, pos, magic) || magic != MAGIC
+        || !read_varint(in, pos, cols) || !read_varint(in, pos, rows)
+        || (int) cols != size.width || (int) rows != size.height || size.area() <= 0)
+      return false;
+    contour.create(rows, cols);
+    if (!contour.isContinuous())
+      return false;
+    uchar* data = contour.ptr<uchar>(0);
+    size_t nvalues = (size_t) rows * cols, filled = 0;
+    uchar curr_val = 255;
+    unsigned int run;
+    while (filled < nvalues) {
+      if (!read_varint(in, pos, run) || run > nvalues - filled)
+        return false;
+      memset(data + filled, curr_val, run);
+      filled += run;
+      curr_val = 255 - curr_val;
+    }
+    return true;
+  } // end decode()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  std::string _folder;
+  unsigned long _max_bytes, _total_bytes;
+  unsigned int _nhits, _nmisses, _nevictions;
+  std::vector<uchar> _buffer;
+}; // end class ContourCache
+
+#endif // CONTOUR_CACHE_H
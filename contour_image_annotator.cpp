@@ -27,6 +27,12 @@ A simple GUI for ContourImageAnnotators.
 
 int main(int argc, char** argv) {
   std::vector<std::string> filenames;
+  bool hud = false, persist_contour_edits = false, recover_without_asking = false;
+  bool propagation = true;
+  WorkClaims::ClaimMode claim_mode = WorkClaims::CLAIM_NONE;
+  unsigned int claim_block_size = WorkClaims::DEFAULT_BLOCK_SIZE;
+  std::string journal_filename;
+  std::string session_summary_filename;
 #if 0
   //cv::Mat1b sample1 = cv::imread(CONTOUR_IMAGE_ANNOTATOR_PATH "samples/sample1.png", CV_LOAD_IMAGE_GRAYSCALE);
   filenames.push_back(CONTOUR_IMAGE_ANNOTATOR_PATH "samples/sample1.png");
@@ -35,10 +41,55 @@ int main(int argc, char** argv) {
   ContourImageAnnotator annot;
   //annot.set_images(sample1);
 #else
-  for (unsigned int i = 1; i < argc; ++i)
-    filenames.push_back(std::string(argv[i]));
+  for (unsigned int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--trace" && i + 1 < argc) {
+      span_tracer::enable(argv[++i]);
+      continue;
+    }
+    if (arg == "--hud") {
+      hud = true;
+      continue;
+    }
+    if (arg == "--session-summary" && i + 1 < argc) {
+      session_summary_filename = argv[++i];
+      continue;
+    }
+    if (arg == "--persist-contour-edits") {
+      persist_contour_edits = true;
+      continue;
+    }
+    if (arg == "--journal" && i + 1 < argc) {
+      journal_filename = argv[++i];
+      continue;
+    }
+    if (arg == "--recover") {
+      recover_without_asking = true;
+      continue;
+    }
+    if (arg == "--no-propagation") {
+      propagation = false;
+      continue;
+    }
+    if (arg == "--claim-frames") {
+      claim_mode = WorkClaims::CLAIM_FRAMES;
+      continue;
+    }
+    if (arg == "--claim-blocks" && i + 1 < argc) {
+      claim_mode = WorkClaims::CLAIM_BLOCKS;
+      claim_block_size = atoi(argv[++i]);
+      continue;
+    }
+    filenames.push_back(arg);
+  }
   ContourImageAnnotator annot;
+  annot.set_hud_enabled(hud);
+  annot.set_session_summary_filename(session_summary_filename);
+  annot.set_persist_contour_edits(persist_contour_edits);
+  annot.set_propagation_enabled(propagation);
+  if (!journal_filename.empty())
+    annot.set_journal(journal_filename, !recover_without_asking);
 #endif
-  annot.load_playlist_images(filenames);
+  annot.load_playlist_images(filenames, claim_mode, claim_block_size);
   annot.run();
 }
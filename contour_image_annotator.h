@@ -31,7 +31,16 @@ ________________________________________________________________________________
 #include <stdio.h>
 #include "depth_canny.h"
 #include "cv_conversion_float_uchar.h"
+#include "scanline_floodfill.h"
+#include "annotation_editor.h"
+#include "atomic_file.h"
+#include "work_claims.h"
+#include "label_propagation.h"
+#include "latency_stats.h"
 #include "contour_image_annotator_path.h"
+#include "button_icons.h" // generated at build time by generate_button_icons
+#include "allocation_counter.h"
+#include "content_hash.h"
 #if USE_IMAGEMAGICK_FOR_16_COLORS_CONVERSION
 #include "convert_n_colors.h"
 #endif
@@ -47,6 +56,8 @@ static const unsigned int NSTATIC_BUTTONS = 7;
 static const unsigned int NSTATIC_BUTTONS = 6;
 #endif
 static const unsigned int BUTTONWIDTH = 32, NBUTTONS = NSTATIC_BUTTONS + NCOLORS;
+//! the embedded icons must have the size of the buttons, cf CMakeLists.txt
+typedef char button_icons_size_check[BUTTON_ICONS_SIZE == (int) BUTTONWIDTH ? 1 : -1];
 static const char* BUTTONS_NAMES[NSTATIC_BUTTONS] =
 {"exit", "first", "prev", "next", "last", "clear"
 #if USE_PCL_FOR_GROUND_PLANE
@@ -65,6 +76,21 @@ static const cv::Scalar USER_COLOR [NCOLORS] = {
   cv::Scalar(0, 160, 255), cv::Scalar(0, 255, 160)
 };
 
+//! the max size of the image part of the window, bigger images are zoomed out
+static const int VIEWPORT_MAX_COLS = 1280, VIEWPORT_MAX_ROWS = 800;
+//! the period of run() while a stroke is being drawn, i.e. its max redraw period (ms)
+static const int STROKE_TICK_MS = 15;
+//! the zoom goes from 1/2^MAX_ZOOM_OUT_LEVEL to 2^MAX_ZOOM_IN_LEVEL
+static const int MAX_ZOOM_OUT_LEVEL = 3, MAX_ZOOM_IN_LEVEL = 3;
+
+//! the interactive operations whose latency is measured
+enum LatencyOperation {
+  LATENCY_FLOODFILL = 0, LATENCY_REDRAW = 1, LATENCY_NAVIGATION = 2, LATENCY_EDGES = 3
+};
+static const unsigned int NLATENCY_OPERATIONS = 4;
+static const char* LATENCY_OPERATION_NAMES[NLATENCY_OPERATIONS] =
+{"floodfill", "redraw", "navigation", "edges"};
+
 ////////////////////////////////////////////////////////////////////////////////
 /// from string_utils
 ////////////////////////////////////////////////////////////////////////////////
@@ -115,12 +141,29 @@ inline std::string remove_filename_extension
 
 ////////////////////////////////////////////////////////////////////////////////
 
-class ContourImageAnnotator {
+class ContourImageAnnotator : public AnnotationEditor {
 public:
 
   ContourImageAnnotator(const std::string & user_image_suffix = "_ground_truth_user") :
       WINNAME("ContourImageAnnotator"),
-      _user_image_suffix(user_image_suffix)
+      _user_image_suffix(user_image_suffix),
+      _persist_contour_edits(false),
+      _user_image_loaded(false),
+      _frame_dirty(false),
+      _saved_hash(0),
+      _saved_hash_valid(false),
+      _saved_user_hash(0),
+      _journal_visit_marked(false),
+      _nsaves(0),
+      _nsaves_avoided(0),
+      _frame_read_only(false),
+      _hud_enabled(false),
+      _current_nregions(-1),
+      _brush_radius(DEFAULT_BRUSH_RADIUS),
+      _propagator(USER_COLOR, NCOLORS),
+      _propagation_enabled(true),
+      _propagate_on_load(false),
+      _zoom_level(0)
   {
     DEBUG_PRINT("ctor\n");
     // declare window
@@ -131,21 +174,19 @@ public:
     _user_image.setTo(cv::Scalar::all(0));
     _contours.create(_user_image.size());
     _contours.setTo(cv::Scalar::all(255));
-    // load button images into _buttons
+    _contours.copyTo(_contours_pristine);
+    // copy the embedded button icons into _buttons
     _buttons.create(BUTTONWIDTH, NBUTTONS * BUTTONWIDTH); // rows, cols
     // static buttons
     for(int i = 0; i < NSTATIC_BUTTONS; ++i) {
-      cv::Mat3b button_resized;
-      std::ostringstream button_name;
-      button_name << CONTOUR_IMAGE_ANNOTATOR_PATH << "icons/" << BUTTONS_NAMES[i] << ".png";
-      DEBUG_PRINT("buttons_name:%s\n", button_name.str().c_str());
-      cv::Mat3b button_src = cv::imread(button_name.str(), CV_LOAD_IMAGE_COLOR);
-      if (button_src.empty())
-        button_src.create(BUTTONWIDTH, BUTTONWIDTH);
-      cv::resize(button_src, button_resized, cv::Size(BUTTONWIDTH, BUTTONWIDTH));
-      // cv::imshow("button_resized", button_resized); cv::waitKey(0);
       cv::Mat3b button_roi_img = _buttons(button_roi(i));
-      button_resized.copyTo(button_roi_img);
+      const unsigned char* icon = find_button_icon(BUTTONS_NAMES[i]);
+      if (icon == NULL) {
+        printf("No embedded icon for button '%s'!\n", BUTTONS_NAMES[i]);
+        button_roi_img.setTo(cv::Scalar::all(128));
+        continue;
+      }
+      cv::Mat3b(BUTTONWIDTH, BUTTONWIDTH, (cv::Vec3b*) icon).copyTo(button_roi_img);
     }
     // user colors
     for(int i = 0; i < NCOLORS; ++i) {
@@ -153,31 +194,104 @@ public:
       button_roi_img.setTo(USER_COLOR[i]);
     }
     _selected_color = 1;
+    draw_buttons_with_selection();
     // playlist
     _playlist_idx = 0;
 
     // cv::imshow("buttons", _buttons); cv::waitKey(0);
     _rgb_ok = false;
+    for (unsigned int op = 0; op < NLATENCY_OPERATIONS; ++op)
+      _pending_latency_ticks[op] = 0;
+    allocate_workspaces(_user_image.size());
+    fit_viewport(false);
+    update_pyramids(cv::Rect(0, 0, _contours.cols, _contours.rows));
     redraw_final_window();
   } // end ctor
 
   //////////////////////////////////////////////////////////////////////////////
 
-  inline bool load_playlist_images(const std::vector<std::string> & playlist) {
+  /*!
+   * \param playlist
+   *    the frames to annotate, or, with a claim mode, the dataset
+   *    shared with other instances, cf WorkClaims
+   * \param claim_mode, claim_block_size
+   *    with CLAIM_FRAMES or CLAIM_BLOCKS, the playlist only contains
+   *    the frames claimed by this instance, new ones being claimed
+   *    when going further than the last one
+   */
+  inline bool load_playlist_images(const std::vector<std::string> & playlist,
+                                   WorkClaims::ClaimMode claim_mode = WorkClaims::CLAIM_NONE,
+                                   unsigned int claim_block_size = WorkClaims::DEFAULT_BLOCK_SIZE) {
     DEBUG_PRINT("load_playlist_images(%i images)\n", playlist.size());
     if (playlist.empty()) {
       printf("Cannot load an empty playlist! Exiting.\n");
       quit(false);
     }
-    _playlist = playlist;
+    _dataset = playlist;
+    _playlist.clear();
+    _playlist_dataset_idx.clear();
+    _user_playlist.clear();
+    _contour_edits_playlist.clear();
+    _frame_records.clear();
+    if (claim_mode == WorkClaims::CLAIM_NONE) {
+      for (unsigned int i = 0; i < _dataset.size(); ++i)
+        add_to_playlist(i);
+    }
+    else {
+      std::vector<std::string> user_filenames;
+      for (unsigned int i = 0; i < _dataset.size(); ++i)
+        user_filenames.push_back(user_filename(_dataset[i]));
+      _claims.set_dataset(user_filenames, claim_mode, claim_block_size);
+      if (!claim_next_frames()) {
+        printf("No frame left to annotate in the %i frames of the dataset! Exiting.\n",
+               (int) _dataset.size());
+        quit(false);
+      }
+    }
     return goto_playlist_image(0, false);
+  } // end load_playlist_images()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! show rolling latencies on top of the image, toggled with 'h'
+  inline void set_hud_enabled(bool enabled) {
+    _hud_enabled = enabled;
+    if (_hud_enabled && _current_nregions < 0) // not computed at load
+      count_current_regions();
+    redraw_final_window();
+  }
+  //! pre-fill the frames reached with "next" from the previous one, cf LabelPropagator
+  inline void set_propagation_enabled(bool enabled) {
+    _propagation_enabled = enabled;
+  }
+  //! where the session summary is written at exit, in addition to stdout
+  inline void set_session_summary_filename(const std::string & filename) {
+    _session_summary_filename = filename;
+  }
+  /*!
+   * If true, the contour strokes of each frame are saved along with
+   * the user image, in "<frame>_contour_edits.png", and restored
+   * when coming back to the frame.
+   */
+  inline void set_persist_contour_edits(bool persist) {
+    _persist_contour_edits = persist;
   }
 
   //////////////////////////////////////////////////////////////////////////////
 
+  //! pre-fill the next frame from this one if it has no user image, cf LabelPropagator
   inline bool goto_next_playlist_image() {
+    if (_claims.enabled() && _playlist_idx + 1 >= _playlist.size())
+      claim_next_frames(); // more work, if any is left
     unsigned int image_idx = (_playlist_idx + 1) % _playlist.size();
-    return goto_playlist_image(image_idx);
+    _propagate_on_load = (_propagation_enabled && image_idx == _playlist_idx + 1);
+    if (_propagate_on_load) {
+      end_stroke();
+      _propagator.remember(_user_image, current_depth());
+    }
+    bool success = goto_playlist_image(image_idx);
+    _propagate_on_load = false;
+    return success;
   }
   inline bool goto_prev_playlist_image() {
     unsigned int image_idx = (_playlist_idx + _playlist.size() - 1) % _playlist.size();
@@ -185,20 +299,119 @@ public:
   }
   inline bool goto_playlist_image(unsigned int playlist_idx,
                                   bool save_before = true) {
+    ALLOCATION_CHECK("goto_playlist_image");
+    TRACE_SPAN("goto_playlist_image");
     if (playlist_idx < 0 || playlist_idx >= _playlist.size())
       return false;
+    begin_latency(LATENCY_NAVIGATION);
     if (save_before)
-      save_current_user_image();
+      save_current_frame();
     _playlist_idx = playlist_idx;
-    load_playlist_image(get_current_filename());
+    lock_current_frame();
+    if (!load_playlist_image(get_current_filename()))
+      return false;
+    if (_persist_contour_edits)
+      load_contour_edits();
+    // the state of the disk (a blank user image if there is no file),
+    // only hashed by before_edit(): browsing a frame costs no hash
+    _saved_hash_valid = false;
+    _frame_dirty = false;
+    _journal_visit_marked = false;
+    if (_propagate_on_load && !_user_image_loaded)
+      propagate_labels();
+    if (journaling()) { // on a read-only frame, kept for when we get its lock
+      ALLOCATION_CHECK_IGNORE(); // only after a crash
+      replay_journal();
+    }
+    return true;
+  }
+
+  inline std::string user_filename(const std::string & frame) const {
+    return remove_filename_extension(frame) + _user_image_suffix + ".png";
   }
 
+  /*!
+   * Append a frame of the dataset to the playlist.
+   * The user filenames are built once, so that navigating does not allocate.
+   */
+  void add_to_playlist(unsigned int dataset_idx) {
+    const std::string & frame = _dataset[dataset_idx];
+    _playlist.push_back(frame);
+    _playlist_dataset_idx.push_back(dataset_idx);
+    _user_playlist.push_back(user_filename(frame));
+    _contour_edits_playlist.push_back(remove_filename_extension(frame)
+                                      + "_contour_edits.png");
+    _frame_records.push_back(FrameRecord());
+  }
+
+  //! claim frames of the dataset, cf WorkClaims. \return the number of new frames
+  unsigned int claim_next_frames() {
+    TRACE_SPAN("claim_next_frames");
+    _claimed_frames.clear();
+    unsigned int nclaimed = _claims.claim_next(_claimed_frames);
+    for (unsigned int i = 0; i < _claimed_frames.size(); ++i)
+      add_to_playlist(_claimed_frames[i]);
+    return nclaimed;
+  }
+
+  /*!
+   * Lock the user image of the current frame, releasing the previous one.
+   * If another instance is editing it, the frame is read-only:
+   * it can be edited but it is not saved.
+   */
+  void lock_current_frame() {
+    ALLOCATION_CHECK_IGNORE(); // file system calls
+    _frame_read_only = !_frame_lock.acquire(get_current_user_filename());
+    if (_frame_read_only)
+      printf("'%s' is being annotated by another instance: "
+             "your changes on this frame will not be saved.\n",
+             get_current_user_filename().c_str());
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Record the annotation operations in an append-only journal.
+   * Call it before loading the playlist: if the journal has operations
+   * that were never saved, for instance after a crash, they are replayed
+   * over their frames when these are loaded.
+   * \param ask
+   *    if true, ask on the terminal whether to recover the pending operations
+   *    (yes by default), otherwise recover them
+   */
+  bool set_journal(const std::string & filename, bool ask = true) {
+    if (!_journal.open(filename))
+      return false;
+    unsigned int nops = _journal.npending_ops();
+    if (nops == 0)
+      return true;
+    printf("The journal '%s' has %i unsaved operations on %i frames.\n",
+           filename.c_str(), nops, _journal.npending_frames());
+    bool recover = true;
+    if (ask) {
+      printf("Recover them? [Y/n] ");
+      fflush(stdout);
+      char answer[16];
+      if (fgets(answer, sizeof(answer), stdin) != NULL
+          && (answer[0] == 'n' || answer[0] == 'N'))
+        recover = false;
+    }
+    if (!recover) {
+      printf("Discarding the unsaved operations.\n");
+      _journal.discard_pending_ops();
+    }
+    return true;
+  } // end set_journal()
+
   //////////////////////////////////////////////////////////////////////////////
 
   inline void run() {
     while(true) {
+      flush_stroke();
+      _journal.tick();
       cv::imshow(WINNAME, _final_window);
-      char c = cv::waitKey(50);
+      end_pending_latencies();
+      char c = cv::waitKey(_stroke_active ? STROKE_TICK_MS : 50);
       int i = (int) c;
       //DEBUG_PRINT("c:%c = %i\n", c, i);
       // 48->57 = 0->9 numbers on the topleft part keyboard (on top of QWERTY)
@@ -224,10 +437,34 @@ public:
         goto_next_playlist_image();
       else if (c == 'c')
         clear_user_image();
+      else if (c == 'u')
+        undo();
+      else if (c == 'r')
+        redo();
+      else if (c == 'h')
+        set_hud_enabled(!_hud_enabled);
+      else if (c == 'z' || i == -85) // -85: keypad '+'
+        zoom(1);
+      else if (c == 'x' || i == -83) // -83: keypad '-'
+        zoom(-1);
+      else if (c == 'v')
+        fit_viewport();
+      else if (c == '[')
+        set_brush_radius(_brush_radius - 1);
+      else if (c == ']')
+        set_brush_radius(_brush_radius + 1);
+      else if (c == 'j') pan(-1, 0);
+      else if (c == 'l') pan(1, 0);
+      else if (c == 'i') pan(0, -1);
+      else if (c == 'k') pan(0, 1);
       else if (c == 27 || c == 'q') {
         quit();
         break;
       }
+      else if (i == -1) { // timeout, no key pressed
+        _journal.sync();
+        idle_handler();
+      }
       else custom_key_handler(c);
     }
   } // end run()
@@ -237,18 +474,29 @@ public:
 protected:
 
   inline virtual bool load_playlist_image(const std::string & filename) {
+    TRACE_SPAN("ContourImageAnnotator::load_playlist_image");
     DEBUG_PRINT("load_playlist_image('%s')\n", filename.c_str());
-    cv::Mat1b contour = cv::imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
-    if (contour.empty())
-      return false;
+    {
+      ALLOCATION_CHECK_IGNORE(); // codec internals
+      if (!image_utils::imread_into(filename, _contours_file, CV_LOAD_IMAGE_GRAYSCALE,
+                                    _file_buffer))
+        return false;
+    }
     load_current_user_image();
-    return set_images(_user_image, contour);
+    return set_images(_user_image, _contours_file);
   }
-  inline std::string get_current_filename() const {
+  inline const std::string & get_current_filename() const {
     return _playlist[_playlist_idx];
   }
-  inline std::string get_current_user_filename() const {
-    return remove_filename_extension(get_current_filename()) + _user_image_suffix + ".png";
+  //! the index of the current frame in the playlist given to load_playlist_images()
+  inline unsigned int get_current_dataset_idx() const {
+    return _playlist_dataset_idx[_playlist_idx];
+  }
+  inline const std::string & get_current_user_filename() const {
+    return _user_playlist[_playlist_idx];
+  }
+  inline const std::string & get_current_contour_edits_filename() const {
+    return _contour_edits_playlist[_playlist_idx];
   }
 
   //////////////////////////////////////////////////////////////////////////////
@@ -261,59 +509,257 @@ protected:
       printf("Cannot set an empty contour image!\n");
       return false;
     }
-    user_image.copyTo(_user_image);
-    contours.copyTo(_contours);
-    cv::threshold(_contours, _contours, 128, 255, CV_THRESH_BINARY);
-    // resize user image to contour if needed
-    if (contours.size() != _user_image.size())
-      cv::resize(_user_image, _user_image, contours.size());
+    set_frame(user_image, contours);
+    bool new_size = (_contours.size() != _workspace_size);
+    allocate_workspaces(_contours.size());
+    if (new_size)
+      fit_viewport(false);
+    update_pyramids(cv::Rect(0, 0, _contours.cols, _contours.rows));
+    // session statistics
+    _current_nregions = -1;
+    if (_hud_enabled || !_session_summary_filename.empty())
+      count_current_regions();
+    if (_playlist_idx < _frame_records.size())
+      _frame_records[_playlist_idx].size = _contours.size();
     redraw_final_window();
     return true;
   } // end set_images()
 
   //////////////////////////////////////////////////////////////////////////////
 
+  /*! (re)allocate the buffers used by the events, if the size changed.
+   *  In steady state (same image size), the events do not allocate anything.
+   */
+  void allocate_workspaces(const cv::Size & img_size) {
+    if (img_size == _workspace_size)
+      return;
+    DEBUG_PRINT("allocate_workspaces(%ix%i)\n", img_size.width, img_size.height);
+    _workspace_size = img_size;
+    reserve(img_size);
+    if (_propagation_enabled)
+      _propagator.reserve(img_size);
+    // the zoomed out levels, each one half the size of the previous one
+    cv::Size level_size = img_size;
+    for (int level = 1; level <= MAX_ZOOM_OUT_LEVEL; ++level) {
+      level_size = cv::Size((level_size.width + 1) / 2, (level_size.height + 1) / 2);
+      _contours_pyramid[level].create(level_size);
+      _rgb_pyramid[level].create(level_size);
+    }
+    ALLOCATION_NEW_WORKSPACE_GENERATION();
+  } // end allocate_workspaces()
+
+  //////////////////////////////////////////////////////////////////////////////
+
   inline bool load_current_user_image() {
-    std::string filename = get_current_user_filename();
+    TRACE_SPAN("load_current_user_image");
+    const std::string & filename = get_current_user_filename();
     DEBUG_PRINT("load_current_user_image() : Loading file '%s'\n", filename.c_str());
     bool success = false;
-    cv::Mat3b user_image;
-    try {
-      user_image = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
-      success = !user_image.empty();
-    }
-    catch (cv::Exception e) {
-      printf("load_current_user_image(): exception '%s'\n", e.what());
+    {
+      // decode straight into _user_image, reusing its buffer
+      ALLOCATION_CHECK_IGNORE(); // codec internals
+      success = image_utils::imread_into(filename, _user_image, CV_LOAD_IMAGE_COLOR,
+                                         _file_buffer);
     }
+    _user_image_loaded = success;
     if (!success) {
       printf("load_current_user_image(): could not load '%s'\n",
              get_current_user_filename().c_str());
       _user_image.setTo(cv::Scalar::all(0)); // clear user image
       return false;
     }
-    //cv::imshow("user_image", user_image); cv::waitKey(0);
-    user_image.copyTo(_user_image);
+    //cv::imshow("user_image", _user_image); cv::waitKey(0);
     return true;
   } // end load_current_user_image()
 
   //////////////////////////////////////////////////////////////////////////////
 
   inline bool save_current_user_image() const {
+    ALLOCATION_CHECK_IGNORE(); // codec internals
+    TRACE_SPAN("save_current_user_image");
     std::string filename = get_current_user_filename();
     DEBUG_PRINT("save_current_user_image() - Saving file '%s'\n", filename.c_str());
-    if (!cv::imwrite(filename, _user_image))
-      return false;
+    // never a half-written file for the other readers, cf atomic_file.h
 #if USE_IMAGEMAGICK_FOR_16_COLORS_CONVERSION
-    if (!convert_n_colors(filename, 16, filename))
+    std::string tmp_filename = make_temp_file(filename);
+    if (tmp_filename.empty())
+      return false;
+    if (!cv::imwrite(tmp_filename, _user_image)) {
+      remove(tmp_filename.c_str());
+      return false;
+    }
+    TRACE_SPAN("save_current_user_image(): convert_n_colors()");
+    bool converted = convert_n_colors(tmp_filename, 16, filename);
+    remove(tmp_filename.c_str());
+    if (!converted)
+      return false;
+#else
+    if (!imwrite_atomic(filename, _user_image))
       return false;
 #endif
+    if (_persist_contour_edits)
+      return save_contour_edits();
     return true;
   } // end save_current_user_image()
 
+  /*!
+   * End the stroke, save the frame if its annotation changed,
+   * and mark it in the journal: "written" if it was written, "discard" if not,
+   * so that the pre-filled labels of a frame only browsed are never replayed.
+   */
+  bool save_current_frame() {
+    end_stroke();
+    if (_frame_read_only) {
+      if (annotation_changed())
+        printf("'%s' is locked by another instance, not saving it.\n",
+               get_current_user_filename().c_str());
+      return false;
+    }
+    bool written = annotation_changed();
+    if (written) {
+      if (!save_current_user_image())
+        return false;
+      ++_nsaves;
+      _saved_user_hash = image_content_hash(_user_image);
+      _saved_hash = annotation_hash(_saved_user_hash);
+      _saved_hash_valid = true;
+      _frame_dirty = false;
+      _claims.release(get_current_user_filename()); // the user image says it is done
+    }
+    else {
+      DEBUG_PRINT("save_current_frame(): '%s' unchanged, not saved\n",
+                  get_current_user_filename().c_str());
+      ++_nsaves_avoided;
+      _claims.mark_done(get_current_user_filename()); // reviewed, left as it is
+    }
+    if (journaling() && written)
+      _journal.written(get_current_filename(), _saved_user_hash);
+    else if (journaling() && _journal_visit_marked)
+      _journal.discard(get_current_filename());
+    _journal_visit_marked = false; // the next edits start from what is on the disk
+    return true;
+  } // end save_current_frame()
+
+  //! what is saved: the user image, and the contours if they are persisted
+  inline unsigned long long annotation_hash() const {
+    return annotation_hash(image_content_hash(_user_image));
+  }
+  //! continuing the image_content_hash() of the user image
+  unsigned long long annotation_hash(unsigned long long user_hash) const {
+    TRACE_SPAN("annotation_hash");
+    unsigned long long hash = user_hash;
+    if (_persist_contour_edits)
+      hash = image_content_hash(_contours, hash);
+    return hash;
+  }
+
+  /*!
+   * False if nothing was edited since the last load or save (no hash needed),
+   * or if the edits gave back the same annotation (fill then undo, same color...)
+   */
+  inline bool annotation_changed() const {
+    return _frame_dirty && (!_saved_hash_valid || annotation_hash() != _saved_hash);
+  }
+
+  /*!
+   * Before the first edit of the frame changes it, hash the state of the disk,
+   * and mark the visit in the journal with the user image it starts from.
+   */
+  inline void before_edit() {
+    if (!_saved_hash_valid) {
+      _saved_user_hash = (_user_image_loaded ? image_content_hash(_user_image) : 0);
+      _saved_hash = annotation_hash(_saved_user_hash);
+      _saved_hash_valid = true;
+    }
+    if (journaling() && !_journal_visit_marked) {
+      _journal.visit(get_current_filename(), _saved_user_hash);
+      _journal_visit_marked = true;
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! false on a read-only frame: its edits are never saved, so never recovered
+  inline bool journaling() const {
+    return _journal.is_open() && _playlist_idx < _playlist.size() && !_frame_read_only;
+  }
+
+  //! replay the journal operations of the current frame that were never saved
+  bool replay_journal() {
+    if (!_journal.take_pending_ops(get_current_filename(), _replay_ops))
+      return false;
+    TRACE_SPAN("replay_journal");
+    printf("Replaying %i unsaved operations on '%s'\n",
+           (int) _replay_ops.size(), get_current_filename().c_str());
+    _journal_visit_marked = true; // the replayed operations have their visit
+    before_edit(); // the state of the disk, before them
+    if (replay(_replay_ops)) // pre-filled regions only are not an edit, cf propagate_labels()
+      _frame_dirty = true;
+    _replay_ops.clear();
+    update_pyramids(cv::Rect(0, 0, _contours.cols, _contours.rows));
+    redraw_final_window();
+    return true;
+  } // end replay_journal()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! true if the contour strokes changed _contours since set_images()
+  bool contours_edited() const {
+    if (_contours_pristine.size() != _contours.size())
+      return false;
+    size_t row_size = _contours.cols;
+    for (int row = 0; row < _contours.rows; ++row)
+      if (memcmp(_contours.ptr<uchar>(row), _contours_pristine.ptr<uchar>(row), row_size))
+        return true;
+    return false;
+  }
+
+  //! write the edited contours of the frame, or remove the file if there are none
+  bool save_contour_edits() const {
+    TRACE_SPAN("save_contour_edits");
+    const std::string & filename = get_current_contour_edits_filename();
+    if (!contours_edited()) {
+      remove(filename.c_str()); // cleared edits, if any
+      return true;
+    }
+    DEBUG_PRINT("save_contour_edits() - Saving file '%s'\n", filename.c_str());
+    if (!imwrite_atomic(filename, _contours)) {
+      printf("save_contour_edits(): could not write '%s'\n", filename.c_str());
+      return false;
+    }
+    return true;
+  } // end save_contour_edits()
+
+  //! restore the edited contours of the frame, if they were saved
+  bool load_contour_edits() {
+    TRACE_SPAN("load_contour_edits");
+    const std::string & filename = get_current_contour_edits_filename();
+    {
+      ALLOCATION_CHECK_IGNORE(); // codec internals
+      if (!image_utils::imread_into(filename, _contours_clone, CV_LOAD_IMAGE_GRAYSCALE,
+                                    _file_buffer))
+        return false; // no edits
+    }
+    if (_contours_clone.size() != _contours.size()) {
+      printf("load_contour_edits(): '%s' is %ix%i instead of %ix%i, ignoring it.\n",
+             filename.c_str(), _contours_clone.cols, _contours_clone.rows,
+             _contours.cols, _contours.rows);
+      _contours_clone.create(_contours.size()); // keep the workspace size
+      return false;
+    }
+    DEBUG_PRINT("load_contour_edits('%s')\n", filename.c_str());
+    cv::threshold(_contours_clone, _contours, 128, 255, CV_THRESH_BINARY);
+    update_pyramids(cv::Rect(0, 0, _contours.cols, _contours.rows));
+    redraw_final_window();
+    return true;
+  } // end load_contour_edits()
+
   //////////////////////////////////////////////////////////////////////////////
 
   //! a key handler for children classes
   virtual void custom_key_handler(char c) { }
+  //! called when no key was pressed during the last loop of run()
+  virtual void idle_handler() { }
   virtual void custom_button_handler(const std::string button_name) { }
 
   //////////////////////////////////////////////////////////////////////////////
@@ -321,73 +767,416 @@ protected:
   inline void quit(bool want_save = true) {
     printf("The application will shut down now. Have a nice day.\n");
     if (want_save)
-      save_current_user_image();
+      save_current_frame();
+    _frame_lock.release();
+    _claims.release_all();
+    _journal.close();
+    write_session_summary();
     exit(0);
   } // end exit()
 
   //////////////////////////////////////////////////////////////////////////////
 
+  //! the CV_32F depth of the current frame, NULL if unknown
+  virtual const cv::Mat* current_depth() const { return NULL; }
+
+  //! pre-fill the unlabelled regions of _user_image from the previous frame
+  unsigned int propagate_labels() {
+    unsigned int nfilled = 0;
+    if (_propagator.has_previous())
+      before_edit();
+    {
+      ALLOCATION_CHECK_IGNORE(); // the per-region tables grow with the number of regions
+      nfilled = _propagator.propagate(_contours, current_depth(), _user_image);
+    }
+    printf("Pre-filled %i regions from the previous frame in %g ms\n",
+           nfilled, _propagator.get_last_ms());
+    // not dirty: unreviewed labels are only saved with a real edit of the frame
+    if (nfilled > 0)
+      redraw_final_window();
+    // one floodfill per region in the journal, so that a recovery rebuilds them
+    cv::Point seed;
+    cv::Vec3b color;
+    for (unsigned int region = 0; nfilled > 0 && journaling()
+         && region < _propagator.nregions(); ++region)
+      if (_propagator.filled_region(region, seed, color))
+        _journal.prefill(get_current_filename(), seed.x, seed.y, color.val);
+    return nfilled;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! a description of the prefetch and cache state, for the HUD
+  virtual std::string cache_state() const {
+    return "prefetch:none cache:none";
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*! start measuring the latency of an operation,
+   *  until the end of the next cv::imshow() in run().
+   *  If the operation is already being measured, keep the oldest start.
+   */
+  inline void begin_latency(LatencyOperation op) {
+    if (_pending_latency_ticks[op] == 0)
+      _pending_latency_ticks[op] = cv::getTickCount();
+  }
+
+  //! the number of free regions of the frame, for the HUD and the session summary
+  void count_current_regions() {
+    TRACE_SPAN("count_current_regions");
+    _current_nregions = image_utils::count_regions(_contours, 255, _contours_clone,
+                                                   _floodfill_seeds);
+    if (_playlist_idx < _frame_records.size())
+      _frame_records[_playlist_idx].nregions = _current_nregions;
+  }
+
+  //! to call after cv::imshow(): stores the latencies of the pending operations
+  void end_pending_latencies() {
+    bool some_ended = false;
+    for (unsigned int op = 0; op < NLATENCY_OPERATIONS; ++op) {
+      if (_pending_latency_ticks[op] == 0)
+        continue;
+      double latency_ms = _latencies[op].add_since(_pending_latency_ticks[op]);
+      _pending_latency_ticks[op] = 0;
+      some_ended = true;
+      if (_playlist_idx < _frame_records.size()) {
+        FrameRecord & record = _frame_records[_playlist_idx];
+        ++record.nevents;
+        record.max_latency_ms = std::max(record.max_latency_ms, latency_ms);
+      }
+    } // end loop op
+    if (some_ended && _hud_enabled) // show the new values
+      redraw_final_window();
+  } // end end_pending_latencies()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! the rolling latencies and the state of the current frame, on top of the image
+  void draw_hud() {
+    ALLOCATION_CHECK_IGNORE(); // optional overlay, cv::putText() needs strings
+    std::vector<std::string> lines;
+    char line[256];
+    for (unsigned int op = 0; op < NLATENCY_OPERATIONS; ++op) {
+      const LatencyStats & stats = _latencies[op];
+      snprintf(line, sizeof(line), "%-10s p50:%6.1f p95:%6.1f max:%6.1f ms (n=%u)",
+               LATENCY_OPERATION_NAMES[op], stats.percentile(.5),
+               stats.percentile(.95), stats.max(), stats.window_count());
+      lines.push_back(line);
+    }
+    snprintf(line, sizeof(line), "frame %u/%u %ix%i regions:%i",
+             _playlist_idx + 1, (unsigned int) _playlist.size(),
+             _user_image.cols, _user_image.rows, _current_nregions);
+    lines.push_back(line);
+    lines.push_back(cache_state());
+    // text on a black box, on the top left corner of the user image
+    cv::Mat3b user_image_dst = _final_window(user_image_roi());
+    int line_height = 14;
+    cv::rectangle(user_image_dst, cv::Rect(0, 0, std::min(420, user_image_dst.cols),
+                                           std::min((int) lines.size() * line_height + 6,
+                                                    user_image_dst.rows)),
+                  cv::Scalar::all(0), -1);
+    for (unsigned int i = 0; i < lines.size(); ++i)
+      cv::putText(user_image_dst, lines[i], cv::Point(4, (i + 1) * line_height),
+                  cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar::all(255));
+  } // end draw_hud()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*! print the latencies of the session and the statistics of each frame,
+   *  and write them to _session_summary_filename if it is set
+   */
+  void write_session_summary() const {
+    printf("Session summary:\n");
+    for (unsigned int op = 0; op < NLATENCY_OPERATIONS; ++op) {
+      const LatencyStats & stats = _latencies[op];
+      printf("  %-10s: %u events, p50:%.1f ms, p95:%.1f ms, max:%.1f ms\n",
+             LATENCY_OPERATION_NAMES[op], stats.total_count(),
+             stats.percentile(.5), stats.percentile(.95), stats.max_ever_ms());
+    }
+    printf("  saves     : %u written, %u avoided (unchanged frames)\n",
+           _nsaves, _nsaves_avoided);
+    if (_session_summary_filename.empty())
+      return;
+    cv::FileStorage fs(_session_summary_filename, cv::FileStorage::WRITE);
+    if (!fs.isOpened()) {
+      printf("write_session_summary(): could not open '%s'\n",
+             _session_summary_filename.c_str());
+      return;
+    }
+    fs << "operations" << "[";
+    for (unsigned int op = 0; op < NLATENCY_OPERATIONS; ++op) {
+      const LatencyStats & stats = _latencies[op];
+      fs << "{" << "name" << LATENCY_OPERATION_NAMES[op]
+         << "count" << (int) stats.total_count()
+         << "mean_ms" << (stats.total_count() ? stats.total_ms() / stats.total_count() : 0.)
+         << "p50_ms" << stats.percentile(.5) << "p95_ms" << stats.percentile(.95)
+         << "max_ms" << stats.max_ever_ms() << "}";
+    }
+    fs << "]";
+    fs << "saves" << (int) _nsaves << "saves_avoided" << (int) _nsaves_avoided;
+    fs << "frames" << "[";
+    for (unsigned int i = 0; i < _frame_records.size(); ++i) {
+      const FrameRecord & record = _frame_records[i];
+      if (record.nevents == 0)
+        continue;
+      fs << "{" << "filename" << _playlist[i]
+         << "cols" << record.size.width << "rows" << record.size.height
+         << "nregions" << record.nregions << "nevents" << (int) record.nevents
+         << "max_latency_ms" << record.max_latency_ms << "}";
+    }
+    fs << "]";
+    fs.release();
+    printf("Session summary written to '%s'\n", _session_summary_filename.c_str());
+  } // end write_session_summary()
+
+  //////////////////////////////////////////////////////////////////////////////
+
   void select_color(const unsigned int color_idx) {
+    ALLOCATION_CHECK("select_color");
     if (color_idx < 0 || color_idx >= NCOLORS)
       return;
     _selected_color = color_idx;
+    draw_buttons_with_selection();
     redraw_final_window();
   }
 
   //////////////////////////////////////////////////////////////////////////////
 
-  void redraw_final_window() {
-    DEBUG_PRINT("redraw_final_window()\n");
-    // create the image
-    int cols = std::max(_buttons.cols, _user_image.cols);
-    int rows = _buttons.rows + _user_image.rows;
-    _final_window.create(rows, cols);
-    _final_window.setTo(cv::Scalar::all(128));
-    // copy the buttons
-    cv::Mat3b buttons_dst = _final_window(buttons_roi());
-    _buttons.copyTo(buttons_dst);
-    // select the color
+  //! draw the selection of the current color on a copy of the buttons
+  void draw_buttons_with_selection() {
+    _buttons.copyTo(_buttons_with_selection);
     cv::Rect selected_color_roi = button_roi(NSTATIC_BUTTONS + _selected_color);
     cv::Scalar selection_color = CV_RGB(200, 200, 200);
-    cv::rectangle(buttons_dst, selected_color_roi, selection_color, 2);
-    cv::line(buttons_dst, selected_color_roi.br(), selected_color_roi.tl(), selection_color, 2);
-    cv::line(buttons_dst,
+    cv::rectangle(_buttons_with_selection, selected_color_roi, selection_color, 2);
+    cv::line(_buttons_with_selection, selected_color_roi.br(), selected_color_roi.tl(),
+             selection_color, 2);
+    cv::line(_buttons_with_selection,
              selected_color_roi.tl()+cv::Point(BUTTONWIDTH, 0),
              selected_color_roi.br()-cv::Point(BUTTONWIDTH, 0), selection_color, 2);
-    // copy the user_image_
-    cv::Mat3b user_image_dst = _final_window(user_image_roi());
-    //user_image_dst.setTo(cv::Scalar::all(0));
-    _user_image.copyTo(user_image_dst);
-    if (_rgb_ok) {
-      cv::cvtColor(_user_image, _user_image_mask, CV_BGR2GRAY);
-      _rgb.copyTo(user_image_dst, _user_image_mask == 0);
-    }
-    // cv::addWeighted(user_image_dst, 1, _rgb, .5, 0, user_image_dst);
-    //_user_image.copyTo(user_image_dst, _user_image != cv::Scalar::all(0));
-    // use the contour image
-    user_image_dst.setTo(cv::Scalar::all(100), _contours == 0);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  void redraw_final_window() {
+    ALLOCATION_CHECK("redraw_final_window");
+    TRACE_SPAN("redraw_final_window");
+    int64 begin_ticks = cv::getTickCount();
+    DEBUG_PRINT("redraw_final_window()\n");
+    // create the image - no reallocation if the viewport size did not change
+    int cols = std::max(_buttons.cols, _view_size.width);
+    int rows = _buttons.rows + _view_size.height;
+    _final_window.create(rows, cols);
+    // background, only where neither the buttons nor the viewport are drawn
+    cv::Scalar background_color = cv::Scalar::all(128);
+    const cv::Vec3b background(128, 128, 128);
+    if (cols > _buttons.cols)
+      _final_window(cv::Rect(_buttons.cols, 0, cols - _buttons.cols, _buttons.rows))
+          .setTo(background_color);
+    if (cols > _view_size.width)
+      _final_window(cv::Rect(_view_size.width, _buttons.rows,
+                             cols - _view_size.width, _view_size.height))
+          .setTo(background_color);
+    // copy the buttons, with the selected color already drawn
+    cv::Mat3b buttons_dst = _final_window(buttons_roi());
+    _buttons_with_selection.copyTo(buttons_dst);
+    // compose user image, rgb and contours of the viewport only, in a single pass:
+    // contour pixels in grey, then user colors, then rgb where the user image is black.
+    // Zoomed out, the contours and rgb come from the pyramids,
+    // the user image is sampled: the cost depends on the viewport size only.
+    bool use_rgb = (_rgb_ok && _rgb.type() == CV_8UC3 && _rgb.size() == _user_image.size());
+    int level = std::max(-_zoom_level, 0), zoom_in = 1 << std::max(_zoom_level, 0);
+    const cv::Mat1b & contours = (level == 0 ? _contours : _contours_pyramid[level]);
+    const cv::Mat3b rgb_level0 = (use_rgb ? cv::Mat3b(_rgb) : cv::Mat3b());
+    const cv::Mat3b & rgb = (level == 0 ? rgb_level0 : _rgb_pyramid[level]);
+    const cv::Vec3b contour_color(100, 100, 100), black(0, 0, 0);
+    int origin_row = _view_origin.y >> level;
+    for (int view_row = 0; view_row < _view_size.height; ++view_row) {
+      cv::Vec3b* dst_ptr = _final_window.ptr<cv::Vec3b>(_buttons.rows + view_row);
+      int row = origin_row + view_row / zoom_in; // in the level
+      if (row >= contours.rows) {
+        std::fill(dst_ptr, dst_ptr + _view_size.width, background);
+        continue;
+      }
+      const cv::Vec3b* user_ptr = _user_image.ptr<cv::Vec3b>(row << level);
+      const uchar* contours_ptr = contours.ptr<uchar>(row);
+      const cv::Vec3b* rgb_ptr = (use_rgb ? rgb.ptr<cv::Vec3b>(row) : NULL);
+      for (int view_col = 0; view_col < _view_size.width; ++view_col) {
+        int col = _view_cols[view_col]; // in the level
+        if (col < 0)
+          dst_ptr[view_col] = background;
+        else if (contours_ptr[col] == 0)
+          dst_ptr[view_col] = contour_color;
+        else if (use_rgb && user_ptr[col << level] == black)
+          dst_ptr[view_col] = rgb_ptr[col];
+        else
+          dst_ptr[view_col] = user_ptr[col << level];
+      } // end loop view_col
+    } // end loop view_row
+    _latencies[LATENCY_REDRAW].add_since(begin_ticks);
+    if (_hud_enabled)
+      draw_hud();
   } // end redraw_final_window();
 
   //////////////////////////////////////////////////////////////////////////////
 
+  /*! recompute the zoomed out levels of the contours and rgb in a rectangle
+   *  of the full resolution image, after a change of these images.
+   *  A level pixel is the min of its 2x2 block for the contours,
+   *  so that the edges stay visible, and its mean for the rgb. */
+  void update_pyramids(cv::Rect rect) {
+    TRACE_SPAN("update_pyramids");
+    bool use_rgb = (_rgb_ok && _rgb.type() == CV_8UC3 && _rgb.size() == _user_image.size());
+    const cv::Mat1b* prev_contours = &_contours;
+    cv::Mat3b prev_rgb_level0 = (use_rgb ? cv::Mat3b(_rgb) : cv::Mat3b());
+    const cv::Mat3b* prev_rgb = &prev_rgb_level0;
+    for (int level = 1; level <= MAX_ZOOM_OUT_LEVEL; ++level) {
+      cv::Mat1b & contours = _contours_pyramid[level];
+      cv::Mat3b & rgb = _rgb_pyramid[level];
+      // the rectangle in this level
+      rect = cv::Rect(cv::Point(rect.x / 2, rect.y / 2),
+                      cv::Point((rect.br().x + 1) / 2, (rect.br().y + 1) / 2))
+             & cv::Rect(0, 0, contours.cols, contours.rows);
+      for (int row = rect.y; row < rect.br().y; ++row) {
+        int prev_row1 = 2 * row, prev_row2 = std::min(2 * row + 1, prev_contours->rows - 1);
+        const uchar* prev_ptr1 = prev_contours->ptr<uchar>(prev_row1);
+        const uchar* prev_ptr2 = prev_contours->ptr<uchar>(prev_row2);
+        uchar* contours_ptr = contours.ptr<uchar>(row);
+        for (int col = rect.x; col < rect.br().x; ++col) {
+          int col1 = 2 * col, col2 = std::min(2 * col + 1, prev_contours->cols - 1);
+          contours_ptr[col] = std::min(std::min(prev_ptr1[col1], prev_ptr1[col2]),
+                                       std::min(prev_ptr2[col1], prev_ptr2[col2]));
+        } // end loop col
+        if (!use_rgb)
+          continue;
+        const cv::Vec3b* prev_rgb_ptr1 = prev_rgb->ptr<cv::Vec3b>(prev_row1);
+        const cv::Vec3b* prev_rgb_ptr2 = prev_rgb->ptr<cv::Vec3b>(prev_row2);
+        cv::Vec3b* rgb_ptr = rgb.ptr<cv::Vec3b>(row);
+        for (int col = rect.x; col < rect.br().x; ++col) {
+          int col1 = 2 * col, col2 = std::min(2 * col + 1, prev_contours->cols - 1);
+          for (int channel = 0; channel < 3; ++channel)
+            rgb_ptr[col][channel] = (prev_rgb_ptr1[col1][channel] + prev_rgb_ptr1[col2][channel]
+                                     + prev_rgb_ptr2[col1][channel] + prev_rgb_ptr2[col2][channel]
+                                     + 2) / 4;
+        } // end loop col
+      } // end loop row
+      prev_contours = &contours;
+      prev_rgb = &rgb;
+    } // end loop level
+  } // end update_pyramids()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*! set the zoom and the top left corner of the viewport (full resolution),
+   *  clamped to the image */
+  void set_viewport(int zoom_level, cv::Point origin, bool redraw = true) {
+    _zoom_level = std::min(std::max(zoom_level, -MAX_ZOOM_OUT_LEVEL), MAX_ZOOM_IN_LEVEL);
+    int level = std::max(-_zoom_level, 0), zoom_in = 1 << std::max(_zoom_level, 0);
+    // the viewport size, and how many full resolution pixels it shows
+    int level_cols = (_user_image.cols + (1 << level) - 1) >> level;
+    int level_rows = (_user_image.rows + (1 << level) - 1) >> level;
+    cv::Size view_size(std::min(level_cols * zoom_in, VIEWPORT_MAX_COLS),
+                       std::min(level_rows * zoom_in, VIEWPORT_MAX_ROWS));
+    if (view_size != _view_size) { // the window buffers follow the viewport size
+      _view_size = view_size;
+      _view_cols.resize(_view_size.width);
+      _final_window.create(_buttons.rows + _view_size.height,
+                           std::max(_buttons.cols, _view_size.width));
+      ALLOCATION_NEW_WORKSPACE_GENERATION();
+    }
+    int shown_cols = (_view_size.width << level) / zoom_in;
+    int shown_rows = (_view_size.height << level) / zoom_in;
+    // aligned on the level pixels
+    origin.x = std::max(0, std::min(origin.x, _user_image.cols - shown_cols));
+    origin.y = std::max(0, std::min(origin.y, _user_image.rows - shown_rows));
+    _view_origin = cv::Point((origin.x >> level) << level, (origin.y >> level) << level);
+    // the level column of each viewport column, -1 out of the image
+    _view_cols.resize(_view_size.width);
+    for (int view_col = 0; view_col < _view_size.width; ++view_col) {
+      int col = (_view_origin.x >> level) + view_col / zoom_in;
+      _view_cols[view_col] = (col < level_cols ? col : -1);
+    }
+    if (redraw)
+      redraw_final_window();
+  } // end set_viewport()
+
+  //! zoom in (\a step > 0) or out, keeping the center of the viewport
+  void zoom(int step) {
+    cv::Point center = window_to_image(cv::Point(_view_size.width / 2, _view_size.height / 2));
+    int new_zoom_level = std::min(std::max(_zoom_level + step, -MAX_ZOOM_OUT_LEVEL),
+                                  MAX_ZOOM_IN_LEVEL);
+    // the half size of the new viewport, in full resolution pixels
+    int new_level = std::max(-new_zoom_level, 0), new_zoom_in = 1 << std::max(new_zoom_level, 0);
+    cv::Point half_shown((std::min(_user_image.cols, VIEWPORT_MAX_COLS << new_level)
+                          / new_zoom_in) / 2,
+                         (std::min(_user_image.rows, VIEWPORT_MAX_ROWS << new_level)
+                          / new_zoom_in) / 2);
+    set_viewport(new_zoom_level, center - half_shown);
+    printf("Zoom: %g\n", (_zoom_level >= 0 ? 1. * (1 << _zoom_level)
+                                            : 1. / (1 << -_zoom_level)));
+  }
+
+  //! move the viewport by a quarter of its size in the given direction
+  void pan(int dx, int dy) {
+    int level = std::max(-_zoom_level, 0), zoom_in = 1 << std::max(_zoom_level, 0);
+    cv::Point step(std::max(1, ((_view_size.width << level) / zoom_in) / 4),
+                   std::max(1, ((_view_size.height << level) / zoom_in) / 4));
+    set_viewport(_zoom_level, _view_origin + cv::Point(dx * step.x, dy * step.y));
+  }
+
+  //! the biggest zoom (at most 1) showing the whole image in the viewport
+  void fit_viewport(bool redraw = true) {
+    int zoom_level = 0;
+    while (zoom_level > -MAX_ZOOM_OUT_LEVEL
+           && ((_user_image.cols >> -zoom_level) > VIEWPORT_MAX_COLS
+               || (_user_image.rows >> -zoom_level) > VIEWPORT_MAX_ROWS))
+      --zoom_level;
+    set_viewport(zoom_level, cv::Point(0, 0), redraw);
+  }
+
+  //! \return the full resolution pixel shown at a position of the viewport
+  inline cv::Point window_to_image(const cv::Point & view_pt) const {
+    int level = std::max(-_zoom_level, 0), zoom_in = 1 << std::max(_zoom_level, 0);
+    // the center of the level pixel
+    return cv::Point(std::min(_view_origin.x + ((view_pt.x / zoom_in) << level)
+                              + (1 << level) / 2, _user_image.cols - 1),
+                     std::min(_view_origin.y + ((view_pt.y / zoom_in) << level)
+                              + (1 << level) / 2, _user_image.rows - 1));
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
   static void win_cb(int event, int x, int y, int flags, void* cookie) {
     // DEBUG_PRINT("win_cb(%i, %i): event:%i, flag:%i\n", x, y, event, flags);
+    ContourImageAnnotator* this_cb = ((ContourImageAnnotator*) cookie);
+    bool middle_drag = (event == CV_EVENT_MOUSEMOVE && (flags & CV_EVENT_FLAG_MBUTTON));
+    if (event == CV_EVENT_MBUTTONUP
+        || (event == CV_EVENT_MOUSEMOVE && !middle_drag && this_cb->_stroke_active)) {
+      this_cb->end_stroke();
+      return;
+    }
     if (event != CV_EVENT_LBUTTONDOWN
         && event != CV_EVENT_MBUTTONDOWN
         && event != CV_EVENT_RBUTTONDOWN
-        && flags != 36) // middle button dragging
+        && !middle_drag)
       return;
-    ContourImageAnnotator* this_cb = ((ContourImageAnnotator*) cookie);
     // click on the image -> floodfill
     if (y > BUTTONWIDTH) {
+      if (x >= this_cb->_view_size.width || y - BUTTONWIDTH >= this_cb->_view_size.height)
+        return; // out of the viewport
+      cv::Point img_pt = this_cb->window_to_image(cv::Point(x, y - BUTTONWIDTH));
       if (event == CV_EVENT_LBUTTONDOWN)
-        this_cb->floodfill(x, y - BUTTONWIDTH);
-      else if (event == CV_EVENT_MBUTTONDOWN || flags == 36) // middle button dragging
-        this_cb->paint_contour(x, y - BUTTONWIDTH);
+        this_cb->floodfill(img_pt.x, img_pt.y);
+      else if (event == CV_EVENT_MBUTTONDOWN)
+        this_cb->begin_stroke(img_pt.x, img_pt.y);
+      else if (middle_drag)
+        this_cb->extend_stroke(img_pt.x, img_pt.y);
       else // right button
-        this_cb->floodfill(x, y - BUTTONWIDTH, false, cv::Scalar::all(0));
+        this_cb->floodfill(img_pt.x, img_pt.y, false, cv::Scalar::all(0));
       return;
     }
+    if (middle_drag)
+      return; // dragging over the buttons
 
     // click on one of the buttons
     unsigned int button_idx = x / BUTTONWIDTH;
@@ -418,47 +1207,155 @@ protected:
 
   //////////////////////////////////////////////////////////////////////////////
 
+  //! discard the floodfills and the contour strokes, without reloading the frame
   void clear_user_image() {
     DEBUG_PRINT("clear_user_image()\n");
-    load_playlist_image(get_current_filename()); // reload contour image
-    _user_image.setTo(cv::Scalar::all(0));
+    TRACE_SPAN("clear_user_image");
+    end_stroke();
+    before_edit();
+    clear();
+    _frame_dirty = true;
+    if (journaling())
+      _journal.clear(get_current_filename());
+    update_pyramids(cv::Rect(0, 0, _contours.cols, _contours.rows));
     redraw_final_window();
   }
 
   //////////////////////////////////////////////////////////////////////////////
 
-  void paint_contour(int x, int y, int radius = 3, cv::Scalar color = cv::Scalar::all(0)) {
-    if (_contours(y, x) != 255) {
-      printf("paint_contour(%i, %i) on edge! Doing nothing.\n", x, y);
+  /*!
+   * The contour strokes, drawn with the middle button, cf AnnotationEditor.
+   * The new edges of _contours, the undo history, the pyramids and the window
+   * are updated by flush_stroke(), at most once per loop of run().
+   */
+  void set_brush_radius(int radius) {
+    _brush_radius = std::min(std::max(radius, 1), MAX_BRUSH_RADIUS);
+    printf("Brush radius: %i\n", _brush_radius);
+  }
+
+  //! start a stroke, unless on an edge
+  void begin_stroke(int x, int y) {
+    ALLOCATION_CHECK("begin_stroke");
+    TRACE_SPAN("begin_stroke");
+    end_stroke();
+    if (!is_free(x, y)) {
+      printf("begin_stroke(%i, %i) on edge! Doing nothing.\n", x, y);
+      return;
+    }
+    before_edit();
+    DEBUG_PRINT("begin_stroke(%i, %i)\n", x, y);
+    AnnotationEditor::begin_stroke(x, y, _brush_radius);
+    if (journaling())
+      _journal.stroke_begin(get_current_filename(), _brush_radius, x, y);
+  }
+
+  void extend_stroke(int x, int y) {
+    ALLOCATION_CHECK("extend_stroke");
+    if (AnnotationEditor::extend_stroke(x, y) && journaling())
+      _journal.stroke_to(get_current_filename(), x, y);
+  }
+
+  inline void end_stroke() {
+    if (!_stroke_active)
+      return;
+    flush_stroke();
+    AnnotationEditor::end_stroke();
+    _frame_dirty = true;
+    if (journaling())
+      _journal.stroke_end(get_current_filename());
+  }
+
+  //! flush the stroke into _contours, then update the pyramids and redraw
+  void flush_stroke() {
+    if (journaling()) // one line for the points since the last loop
+      _journal.flush_stroke_points(get_current_filename());
+    if (!_stroke_dirty)
       return;
+    TRACE_SPAN("flush_stroke");
+    cv::Rect roi;
+    {
+      ALLOCATION_CHECK_IGNORE(); // the history grows with the stroke
+      roi = AnnotationEditor::flush_stroke();
     }
-    DEBUG_PRINT("paint_contour(%i, %i)\n", x, y);
-    cv::circle(_contours, cv::Point(x, y), radius, color, -1);
+    update_pyramids(roi);
     redraw_final_window();
   }
 
   //////////////////////////////////////////////////////////////////////////////
 
   void floodfill(int x, int y, bool use_selected_color = true, cv::Scalar color = cv::Scalar()) {
+    ALLOCATION_CHECK("floodfill");
+    TRACE_SPAN("floodfill");
     if (y < 0 || y >= _user_image.rows || x < 0 || x >= _user_image.cols) {
       printf("floodfill(%i, %i) out of bounds! Doing nothing.\n", x, y);
       return;
     }
-    if (_contours(y, x) != 255) {
+    end_stroke(); // one action at a time in the history
+    if (!is_free(x, y)) {
       printf("floodfill(%i, %i) on edge! Doing nothing.\n", x, y);
       return;
     }
     DEBUG_PRINT("floodfill(%i, %i)\n", x, y);
-    // use a buffer image to get the floodfilled area
+    begin_latency(LATENCY_FLOODFILL);
+    before_edit();
     if (use_selected_color)
       color = USER_COLOR[_selected_color];
-    _contours.copyTo(_contours_clone);
-    //cv::imshow("contours_clone", _contours_clone); cv::waitKey(0);
-    cv::floodFill(_contours_clone, cv::Point(x, y), cv::Scalar::all(127));
-    _user_image.setTo(color, _contours_clone == 127);
+    cv::Vec3b value(color[0], color[1], color[2]);
+    {
+      ALLOCATION_CHECK_IGNORE(); // the history grows with the filled area
+      fill(x, y, value);
+    }
+    _frame_dirty = true;
+    if (journaling())
+      _journal.fill(get_current_filename(), x, y, value.val);
     redraw_final_window();
   }
 
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! undo the last floodfill or contour stroke, \return false if none
+  inline bool undo() {
+    end_stroke();
+    UndoHistory::Layer layer;
+    cv::Rect changed;
+    if (_history.can_undo())
+      before_edit();
+    if (!AnnotationEditor::undo(layer, changed)) {
+      printf("Nothing to undo.\n");
+      return false;
+    }
+    if (journaling())
+      _journal.undo(get_current_filename());
+    after_undo_redo(layer, changed);
+    return true;
+  }
+
+  //! redo the last undone action, \return false if none
+  inline bool redo() {
+    end_stroke();
+    UndoHistory::Layer layer;
+    cv::Rect changed;
+    if (_history.can_redo())
+      before_edit();
+    if (!AnnotationEditor::redo(layer, changed)) {
+      printf("Nothing to redo.\n");
+      return false;
+    }
+    if (journaling())
+      _journal.redo(get_current_filename());
+    after_undo_redo(layer, changed);
+    return true;
+  }
+
+  void after_undo_redo(UndoHistory::Layer layer, const cv::Rect & changed) {
+    DEBUG_PRINT("after_undo_redo(layer:%i, %ix%i)\n", layer, changed.width, changed.height);
+    _frame_dirty = true;
+    if (layer == UndoHistory::LAYER_CONTOURS) // the user image has no pyramid
+      update_pyramids(changed);
+    redraw_final_window();
+  }
+
+
   //////////////////////////////////////////////////////////////////////////////
 
   inline cv::Rect buttons_roi() const {
@@ -469,15 +1366,12 @@ protected:
   }
   inline cv::Rect user_image_roi() const {
     return cv::Rect (0, _buttons.rows,
-                     _user_image.cols, _user_image.rows);
+                     _view_size.width, _view_size.height);
   }
 
   //////////////////////////////////////////////////////////////////////////////
 
-  cv::Mat3b _user_image; // does not include contours
-  cv::Mat1b _user_image_mask;
-  cv::Mat1b _contours, _contours_clone;
-  cv::Mat3b _buttons;
+  cv::Mat3b _buttons, _buttons_with_selection;
   cv::Mat _rgb;
   bool _rgb_ok;
   cv::Mat3b _final_window;
@@ -486,7 +1380,61 @@ protected:
   std::string _user_image_suffix;
   // playlist
   std::vector<std::string> _playlist;
+  std::vector<std::string> _user_playlist; //!< the user image filenames
+  std::vector<std::string> _contour_edits_playlist; //!< the contour edits filenames
+  bool _persist_contour_edits;
+  bool _user_image_loaded; //!< false if the current frame had no user image file
+  // saving only the changed frames
+  bool _frame_dirty; //!< true if the annotation was edited since it was loaded or saved
+  unsigned long long _saved_hash; //!< annotation_hash() of what is on the disk
+  bool _saved_hash_valid; //!< false until the first edit or save of the frame
+  unsigned long long _saved_user_hash; //!< image_content_hash() of the user image file, 0 if none
+  bool _journal_visit_marked; //!< true once the visit of the frame is in the journal
+  unsigned int _nsaves, _nsaves_avoided;
+  // several instances on the same dataset
+  FrameLock _frame_lock; //!< on the user image of the current frame
+  WorkClaims _claims;
+  std::vector<std::string> _dataset; //!< given to load_playlist_images()
+  std::vector<unsigned int> _playlist_dataset_idx; //!< the _dataset index of each _playlist frame
+  std::vector<unsigned int> _claimed_frames; //!< buffer of claim_next_frames()
+  bool _frame_read_only; //!< true if another instance holds the lock of the frame
   unsigned int _playlist_idx;
+  // latency measurements
+  bool _hud_enabled;
+  LatencyStats _latencies[NLATENCY_OPERATIONS];
+  int64 _pending_latency_ticks[NLATENCY_OPERATIONS]; //!< 0 if not pending
+  std::string _session_summary_filename;
+  //! the statistics of a frame of the playlist during the session
+  struct FrameRecord {
+    FrameRecord() : nregions(-1), nevents(0), max_latency_ms(0) {}
+    cv::Size size;
+    int nregions; //!< -1 if not computed
+    unsigned int nevents;
+    double max_latency_ms;
+  };
+  std::vector<FrameRecord> _frame_records; //!< one per playlist image
+  int _current_nregions;
+  // workspaces, reused across the events and the frames
+  cv::Size _workspace_size;
+  cv::Mat1b _contours_file; //!< the decoded contour file
+  std::vector<uchar> _file_buffer; //!< the encoded content of the last read file
+  // contour strokes
+  int _brush_radius;
+  // crash recovery
+  AnnotationJournal _journal;
+  AnnotationJournal::Ops _replay_ops; //!< the operations being replayed
+  // label propagation
+  image_utils::LabelPropagator _propagator;
+  bool _propagation_enabled;
+  bool _propagate_on_load; //!< true while going to the next frame
+  // viewport
+  int _zoom_level; //!< 0: 1:1, > 0: zoom in by 2^level, < 0: zoom out by 2^-level
+  cv::Point _view_origin; //!< the top left corner of the viewport, full resolution
+  cv::Size _view_size; //!< the size of the image part of the window
+  std::vector<int> _view_cols; //!< the level column of each viewport column, -1 if none
+  //! zoomed out levels, [level] is 2^level times smaller. [0] is unused
+  cv::Mat1b _contours_pyramid[MAX_ZOOM_OUT_LEVEL + 1];
+  cv::Mat3b _rgb_pyramid[MAX_ZOOM_OUT_LEVEL + 1];
 }; // en class ContourImageAnnotator
 
 #endif // CONTOUR_IMAGE_ANNOTATOR_H
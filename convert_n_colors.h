@@ -26,36 +26,37 @@ ________________________________________________________________________________
 #define CONVERT_N_COLORS_H
 
 #include <stdlib.h>
-#include "exec_system_get_output.h"
+#include <sys/stat.h>
+#include <sstream>
+#include "atomic_file.h"
 
 /*! 
   Reduce the number of colors (and its size) in an image.
   From http://stackoverflow.com/questions/14031965/convert-32-bit-png-to-8-bit-png-with-imagemagick-by-preserving-semi-transparent
+  The conversion is written to a unique temporary file next to file_out,
+  then renamed to it, so that several processes can convert at the same time.
 */
 inline bool convert_n_colors(const std::string & file_in,
                              unsigned int ncolors,
                               const std::string & file_out) {
   // convert to a temporary file
-  std::string tmp_file = "/tmp/ncolors.png";
+  std::string tmp_file = make_temp_file(file_out);
+  if (tmp_file.empty())
+    return false;
   std::ostringstream order; // convert original.png -colors n PNG8:output.png
-  order << "convert " << file_in << " -colors " << ncolors
-      << " PNG8:" << tmp_file;
+  order << "convert '" << file_in << "' -colors " << ncolors
+      << " 'PNG8:" << tmp_file << "'";
   system(order.str().c_str()); // http://www.imagemagick.org/script/exception.php
   // check file size
-  order.str("");
-  order << "ls -l " << tmp_file << " | awk '{ print $5 }'";
-  std::string size_str = exec_system_get_output(order.str().c_str());
-  // printf("size:'%s'\n", size_str.c_str());
-  if (size_str[0] == '0') { 
+  struct stat tmp_stat;
+  if (stat(tmp_file.c_str(), &tmp_stat) != 0 || tmp_stat.st_size == 0) {
     printf("convert_n_colors(): Could not convert '%s' to %i colors!\n", file_in.c_str(), ncolors);
+    remove(tmp_file.c_str());
     return false;
   }
   // printf("convert_n_colors(): Conversion of '%s' to %i colors OK.\n", file_in.c_str(), ncolors);
   // move back file
-  order.str("");
-  order << "mv " << tmp_file << " " << file_out;
-  int retval = system(order.str().c_str());
-  if (retval < 0) {
+  if (!commit_temp_file(tmp_file, file_out)) {
     printf("convert_n_colors(): Could not write to '%s'!\n", file_out.c_str());
     return false;
   }
@@ -26,6 +26,7 @@ compressed_rounded_image_transport is an image_transport plugin for float images
 #define CV_CONVERSION_FLOAT_UCHAR_H
 
 #include <fstream>
+#include <stdio.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -33,6 +34,7 @@ compressed_rounded_image_transport is an image_transport plugin for float images
 //#include "src/time/timer.h"
 #include "nan_handling.h"
 #include "min_max.h"
+#include "span_tracer.h"
 
 namespace image_utils {
 
@@ -134,14 +136,15 @@ inline void compute_alpha_beta(const double & minVal, const double & maxVal,
  \param beta_trans
     the offset factor, obtained with convert_float_to_uchar()
  \return uchar
-    the converted value, as an uchar
+    the converted value, as an uchar.
+    The valid distances out of the range are clamped to [1, 255]:
+    they never become NAN_UCHAR.
 */
 inline uchar dist_to_image_val(const float & distance,
                                const ScaleFactorType & alpha_trans,
                                const ScaleFactorType & beta_trans) {
-  return (is_nan_depth(distance) ?
-            NAN_UCHAR
-          : cv::saturate_cast<uchar>(alpha_trans * distance + beta_trans));
+  uchar val = cv::saturate_cast<uchar>(alpha_trans * distance + beta_trans);
+  return (is_nan_depth(distance) ? NAN_UCHAR : std::max(val, (uchar) 1));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -165,12 +168,298 @@ inline float image_val_to_dist(const uchar & val,
 
 ////////////////////////////////////////////////////////////////////////////////
 
+//! the histogram of DepthRangeOptions covers [0, this depth[ (m)
+static const double DEPTH_RANGE_HISTOGRAM_MAX_DEPTH = 16;
+//! the number of bins of DepthRangeOptions: 4 mm bins over 16 m
+static const int DEPTH_RANGE_HISTOGRAM_NBINS = 4096;
+
+/*!
+ * How convert_float_to_uchar() chooses the depth range mapped to [1, 255].
+ * By default, the range is [min, max] of the valid values of the image,
+ * so a single outlier (a 10 m reflection) squashes the scene into a few
+ * grey levels.
+ * With percentiles, for instance 0.5 and 99.5, the range is
+ * [low percentile, high percentile] of the valid values.
+ * They are read from a histogram with fixed bins, filled during the pass
+ * that already looks for the min and max, so it costs almost nothing more.
+ * The precision of the bounds is a bin (4 mm, much less than a grey level
+ * for usual ranges); the values beyond the histogram fall in its last bin,
+ * the bounds are always kept into [min, max].
+ *
+ * Clamping: the valid values out of the range are clamped to its bounds,
+ * i.e. to 1 (nearer) and 255 (farther). They are never confused with NaN
+ * (NAN_UCHAR) and convert_uchar_to_float() restores them
+ * as the depth of the bound.
+ */
+struct DepthRangeOptions {
+  DepthRangeOptions(double low_percentile_ = 0, double high_percentile_ = 100) :
+    low_percentile(low_percentile_), high_percentile(high_percentile_),
+    histogram_max_depth(DEPTH_RANGE_HISTOGRAM_MAX_DEPTH),
+    histogram_nbins(DEPTH_RANGE_HISTOGRAM_NBINS) {}
+
+  //! true if 0 <= low_percentile < high_percentile <= 100
+  inline bool is_valid() const {
+    return (0 <= low_percentile && low_percentile < high_percentile
+            && high_percentile <= 100);
+  }
+
+  //! false for the plain [min, max] range, also used if the percentiles are invalid
+  inline bool use_percentiles() const {
+    return is_valid() && (low_percentile > 0 || high_percentile < 100);
+  }
+
+  double low_percentile, high_percentile; //!< in [0, 100]
+  double histogram_max_depth; //!< m
+  int histogram_nbins;
+}; // end struct DepthRangeOptions
+
+//! the histogram bin of a valid depth, the values beyond the last bin go in it
+inline int depth_range_bin(const float val, const float bins_per_meter, const int nbins) {
+  int bin = (int) (val * bins_per_meter);
+  return std::min(std::max(bin, 0), nbins - 1);
+}
+
+/*!
+ * Read the bounds of the percentile range from a histogram of the valid values.
+ * \param hist, nvalid
+ *    the histogram, and the sum of its bins
+ * \param min_val, max_val (in/out)
+ *    in: the min and max of the valid values,
+ *    out: the low and high percentiles, into the input [min_val, max_val]
+ */
+inline void percentile_range_from_histogram(const unsigned int* hist,
+                                            const unsigned int nvalid,
+                                            const DepthRangeOptions & options,
+                                            float & min_val, float & max_val) {
+  if (nvalid == 0)
+    return;
+  int nbins = options.histogram_nbins;
+  double bin_width = options.histogram_max_depth / nbins;
+  // the ranks of both percentiles, in [1, nvalid]
+  unsigned int low_rank = std::max(1., ceil(options.low_percentile / 100 * nvalid));
+  unsigned int high_rank = std::max(1., ceil(options.high_percentile / 100 * nvalid));
+  high_rank = std::min(high_rank, nvalid);
+  unsigned int cumul = 0;
+  int low_bin = -1, high_bin = nbins - 1;
+  for (int bin = 0; bin < nbins; ++bin) {
+    cumul += hist[bin];
+    if (low_bin < 0 && cumul >= low_rank)
+      low_bin = bin;
+    if (cumul >= high_rank) {
+      high_bin = bin;
+      break;
+    }
+  } // end loop bin
+  float low_val = low_bin * bin_width, high_val = (high_bin + 1) * bin_width;
+  if (high_bin == nbins - 1) // the last bin also holds the values beyond it
+    high_val = max_val;
+  min_val = std::min(std::max(low_val, min_val), max_val);
+  max_val = std::max(std::min(high_val, max_val), min_val);
+} // end percentile_range_from_histogram()
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * The parallel conversions.
+ * The image is cut into horizontal stripes processed by cv::parallel_for_(),
+ * each stripe keeping its own min/max, merged at the end.
+ * Small images are converted on a single thread,
+ * as the thread dispatch would cost more than the conversion.
+ * cf benchmark_float_uchar_conversion.cpp for the scaling.
+ */
+//! below this number of values, the conversions are made on a single thread
+static const int PARALLEL_CONVERSION_MIN_VALUES = 640 * 480;
+//! the max number of stripes of a parallel conversion
+static const int PARALLEL_CONVERSION_MAX_STRIPES = 64;
+
+//! \return the number of stripes for converting img, 1 for a single-threaded conversion
+inline int parallel_conversion_nstripes(const cv::Mat & img) {
+  int nthreads = cv::getNumThreads();
+  if (nthreads <= 1 || img.rows < 2
+      || img.rows * img.cols * img.channels() < PARALLEL_CONVERSION_MIN_VALUES)
+    return 1;
+  return std::min(std::min(4 * nthreads, img.rows), PARALLEL_CONVERSION_MAX_STRIPES);
+}
+
+//! the rows of a given stripe
+inline cv::Range stripe_rows(int stripe, int nstripes, int rows) {
+  return cv::Range(stripe * rows / nstripes, (stripe + 1) * rows / nstripes);
+}
+
+//! the min and max of a stripe
+struct MinMaxPartial {
+  bool valid; //!< false if the stripe only contains NaNs
+  float min_val, max_val;
+};
+
+/*!
+ * copy the stripes of src into dst_clean with NAN_DEPTH instead of NaNs, with their min/max.
+ * If \a hists is not NULL, also fill the histogram of each stripe,
+ * cf DepthRangeOptions.
+ */
+class CleanNansAndMinMaxBody : public cv::ParallelLoopBody {
+public:
+  CleanNansAndMinMaxBody(const cv::Mat & src, cv::Mat & dst_clean,
+                         MinMaxPartial* partials, int nstripes,
+                         unsigned int* hists = NULL,
+                         const DepthRangeOptions* range_options = NULL) :
+    _src(src), _dst_clean(dst_clean), _partials(partials), _nstripes(nstripes),
+    _hists(hists), _range_options(range_options) {}
+  virtual void operator()(const cv::Range & stripes) const {
+    int values_per_row = _src.cols * _src.channels();
+    for (int stripe = stripes.start; stripe < stripes.end; ++stripe) {
+      MinMaxPartial & partial = _partials[stripe];
+      partial.valid = false;
+      partial.min_val = partial.max_val = NAN_DEPTH;
+      cv::Range rows = stripe_rows(stripe, _nstripes, _src.rows);
+      if (_hists != NULL) {
+        int nbins = _range_options->histogram_nbins;
+        histogram_stripe(rows, _hists + stripe * nbins, partial);
+        continue;
+      }
+      for (int row = rows.start; row < rows.end; ++row) {
+        const float* src_ptr = _src.ptr<float>(row);
+        float* dst_ptr = _dst_clean.ptr<float>(row);
+        for (int col = 0; col < values_per_row; ++col) {
+          float val = src_ptr[col];
+          if (is_nan_depth(val)) {
+            dst_ptr[col] = NAN_DEPTH;
+            continue;
+          }
+          dst_ptr[col] = val;
+          if (!partial.valid) {
+            partial.min_val = partial.max_val = val;
+            partial.valid = true;
+          }
+          else if (partial.min_val > val)
+            partial.min_val = val;
+          else if (partial.max_val < val)
+            partial.max_val = val;
+        } // end loop col
+      } // end loop row
+    } // end loop stripe
+  }
+private:
+  /*!
+   * The same, filling the histogram too.
+   * Kept scalar: the increments are scattered, and the pass is bound by memory.
+   * On 1920x1080 depths (11% NaN), one thread, g++ 12 -O2, it takes 8.9 ms
+   * like the plain clean and min/max scan. Computing the bins of 256 values
+   * at a time into a buffer, a loop vectorised at -O3, then incrementing them,
+   * took 12-14 ms at -O2 as at -O3.
+   */
+  void histogram_stripe(const cv::Range & rows, unsigned int* hist,
+                        MinMaxPartial & partial) const {
+    int values_per_row = _src.cols * _src.channels();
+    int nbins = _range_options->histogram_nbins;
+    float bins_per_meter = nbins / _range_options->histogram_max_depth;
+    std::fill(hist, hist + nbins, 0);
+    float min_val = std::numeric_limits<float>::max();
+    float max_val = -std::numeric_limits<float>::max();
+    for (int row = rows.start; row < rows.end; ++row) {
+      const float* src_ptr = _src.ptr<float>(row);
+      float* dst_ptr = _dst_clean.ptr<float>(row);
+      for (int col = 0; col < values_per_row; ++col) {
+        float val = src_ptr[col];
+        if (is_nan_depth(val)) {
+          dst_ptr[col] = NAN_DEPTH;
+          continue;
+        }
+        dst_ptr[col] = val;
+        min_val = std::min(min_val, val);
+        max_val = std::max(max_val, val);
+        ++hist[depth_range_bin(val, bins_per_meter, nbins)];
+      } // end loop col
+    } // end loop row
+    partial.valid = (min_val <= max_val);
+    if (partial.valid) {
+      partial.min_val = min_val;
+      partial.max_val = max_val;
+    }
+  } // end histogram_stripe()
+
+  const cv::Mat & _src;
+  cv::Mat & _dst_clean;
+  MinMaxPartial* _partials;
+  int _nstripes;
+  unsigned int* _hists;
+  const DepthRangeOptions* _range_options;
+}; // end class CleanNansAndMinMaxBody
+
+//! dist_to_image_val() on the stripes of a clean float image
+class FloatToUcharBody : public cv::ParallelLoopBody {
+public:
+  FloatToUcharBody(const cv::Mat & src_clean, cv::Mat & dst_uchar, int nstripes,
+                   const ScaleFactorType & alpha_trans, const ScaleFactorType & beta_trans) :
+    _src_clean(src_clean), _dst_uchar(dst_uchar), _nstripes(nstripes),
+    _alpha_trans(alpha_trans), _beta_trans(beta_trans) {}
+  virtual void operator()(const cv::Range & stripes) const {
+    int values_per_row = _src_clean.cols * _src_clean.channels();
+    for (int stripe = stripes.start; stripe < stripes.end; ++stripe) {
+      cv::Range rows = stripe_rows(stripe, _nstripes, _src_clean.rows);
+      for (int row = rows.start; row < rows.end; ++row) {
+        const float* src_ptr = _src_clean.ptr<float>(row);
+        uchar* dst_ptr = _dst_uchar.ptr<uchar>(row);
+        for (int col = 0; col < values_per_row; ++col)
+          dst_ptr[col] = dist_to_image_val(src_ptr[col], _alpha_trans, _beta_trans);
+      } // end loop row
+    } // end loop stripe
+  }
+private:
+  const cv::Mat & _src_clean;
+  cv::Mat & _dst_uchar;
+  int _nstripes;
+  ScaleFactorType _alpha_trans, _beta_trans;
+}; // end class FloatToUcharBody
+
+//! a lookup table remap uchar -> float on stripes
+class UcharToFloatBody : public cv::ParallelLoopBody {
+public:
+  UcharToFloatBody(const cv::Mat & src_uchar, cv::Mat & dst_float, int nstripes,
+                   const float* lookup_table) :
+    _src_uchar(src_uchar), _dst_float(dst_float), _nstripes(nstripes),
+    _lookup_table(lookup_table) {}
+  virtual void operator()(const cv::Range & stripes) const {
+    int values_per_row = _src_uchar.cols * _src_uchar.channels();
+    for (int stripe = stripes.start; stripe < stripes.end; ++stripe) {
+      cv::Range rows = stripe_rows(stripe, _nstripes, _src_uchar.rows);
+      for (int row = rows.start; row < rows.end; ++row) {
+        const uchar* src_ptr = _src_uchar.ptr<uchar>(row);
+        float* dst_ptr = _dst_float.ptr<float>(row);
+        for (int col = 0; col < values_per_row; ++col)
+          dst_ptr[col] = _lookup_table[src_ptr[col]];
+      } // end loop row
+    } // end loop stripe
+  }
+private:
+  const cv::Mat & _src_uchar;
+  cv::Mat & _dst_float;
+  int _nstripes;
+  const float* _lookup_table;
+}; // end class UcharToFloatBody
+
+////////////////////////////////////////////////////////////////////////////////
+
+//! the buffers of convert_float_to_uchar(), kept between the calls
+struct FloatToUcharWorkspace {
+  //! the float image with NaNs removed
+  cv::Mat src_float_clean;
+  //! the positions of the NaN, filled by the single-threaded min/max pass
+  NanBitset nans;
+  //! one depth histogram per stripe, cf DepthRangeOptions
+  std::vector<unsigned int> hists;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
 /*!
   Compresses a float matrix to a uchar one.
  \param src_float
     a float matrix, any number of channels <= 4
  \param dst_uchar (out)
     where the converted uchar matrix will be stored
+ \param ws
+    the buffers, reused between the calls
  \param alpha_trans (out)
     the scaling factor
  \param beta_trans (out)
@@ -179,29 +468,104 @@ inline float image_val_to_dist(const uchar & val,
     will contain the indice of all the points that are equal to NAN.
     It is sorted from smaller to bigger.
     It can be useful if the image is compressed in a lossy way afterwoards.
+ \param range_options
+    if not NULL, how to choose the depth range, cf DepthRangeOptions.
+    By default, [min, max] of the image.
 */
 inline void convert_float_to_uchar(const cv::Mat & src_float, cv::Mat & dst_uchar,
-                                   cv::Mat & src_float_clean_buffer,
+                                   FloatToUcharWorkspace & ws,
                                    ScaleFactorType & alpha_trans,
                                    ScaleFactorType & beta_trans,
-                                   std::vector<unsigned int>* src_nan_indices = NULL) {
+                                   std::vector<unsigned int>* src_nan_indices = NULL,
+                                   const DepthRangeOptions* range_options = NULL) {
+  TRACE_SPAN("convert_float_to_uchar");
+  cv::Mat & src_float_clean_buffer = ws.src_float_clean;
   // Timer timer;
   dst_uchar.create(src_float.size(), CV_8UC(src_float.channels()));
   // timer.printTime("create");
 
   bool store_indices = (src_nan_indices != NULL);
+  bool use_percentiles = (range_options != NULL && range_options->use_percentiles());
+  // one histogram per stripe, merged in the first one. Only grows.
+  std::vector<unsigned int> & hists = ws.hists;
+  // big images: striped conversion on several threads.
+  // The NaN indices are ordered, they are only stored by the single-threaded path.
+  int nstripes = parallel_conversion_nstripes(src_float);
+  if (!store_indices && nstripes > 1) {
+    TRACE_SPAN("convert_float_to_uchar(): parallel");
+    src_float_clean_buffer.create(src_float.size(), src_float.type());
+    MinMaxPartial partials[PARALLEL_CONVERSION_MAX_STRIPES];
+    if (use_percentiles && hists.size() < (size_t) nstripes * range_options->histogram_nbins)
+      hists.resize(nstripes * range_options->histogram_nbins);
+    cv::parallel_for_(cv::Range(0, nstripes),
+                      CleanNansAndMinMaxBody(src_float, src_float_clean_buffer,
+                                             partials, nstripes,
+                                             (use_percentiles ? &hists[0] : NULL),
+                                             range_options),
+                      nstripes);
+    // merge the partials, same result as remove_nans_and_minmax()
+    bool minmax_were_set = false;
+    float minVal = NAN_DEPTH, maxVal = NAN_DEPTH;
+    for (int stripe = 0; stripe < nstripes; ++stripe) {
+      if (!partials[stripe].valid)
+        continue;
+      if (!minmax_were_set) {
+        minVal = partials[stripe].min_val;
+        maxVal = partials[stripe].max_val;
+        minmax_were_set = true;
+        continue;
+      }
+      minVal = std::min(minVal, partials[stripe].min_val);
+      maxVal = std::max(maxVal, partials[stripe].max_val);
+    } // end loop stripe
+    if (use_percentiles) {
+      int nbins = range_options->histogram_nbins;
+      unsigned int nvalid = 0;
+      for (int bin = 0; bin < nbins; ++bin) {
+        for (int stripe = 1; stripe < nstripes; ++stripe)
+          hists[bin] += hists[stripe * nbins + bin];
+        nvalid += hists[bin];
+      }
+      percentile_range_from_histogram(&hists[0], nvalid, *range_options, minVal, maxVal);
+    }
+    compute_alpha_beta(minVal, maxVal, alpha_trans, beta_trans);
+    cv::parallel_for_(cv::Range(0, nstripes),
+                      FloatToUcharBody(src_float_clean_buffer, dst_uchar, nstripes,
+                                       alpha_trans, beta_trans),
+                      nstripes);
+    return;
+  } // end if (nstripes > 1)
+
   if (store_indices) { // clear and reserve some big space
     src_nan_indices->clear();
     src_nan_indices->reserve((src_float.cols * src_float.rows * src_float.channels()) / 3);
   }
   cv::Mat* src_float_clean_ptr;
+  bool nans_stored = false; // in ws.nans
 
   // find the max value
   float minVal, maxVal;
 #if 1 // find at the same time minVal, maxVal and clean NaNs
-  // cv::Mat src_float_clean_buffer = src_float.clone();
-  src_float.copyTo(src_float_clean_buffer);
-  remove_nans_and_minmax<float>(src_float_clean_buffer, minVal, maxVal, NAN_DEPTH);
+  if (use_percentiles) { // the same pass, filling the histogram too
+    src_float_clean_buffer.create(src_float.size(), src_float.type());
+    int nbins = range_options->histogram_nbins;
+    if (hists.size() < (size_t) nbins)
+      hists.resize(nbins);
+    MinMaxPartial partial;
+    CleanNansAndMinMaxBody(src_float, src_float_clean_buffer, &partial, 1,
+                           &hists[0], range_options)(cv::Range(0, 1));
+    minVal = partial.min_val;
+    maxVal = partial.max_val;
+    unsigned int nvalid = 0;
+    for (int bin = 0; bin < nbins; ++bin)
+      nvalid += hists[bin];
+    percentile_range_from_histogram(&hists[0], nvalid, *range_options, minVal, maxVal);
+  }
+  else { // copy, clean, min/max and NaN positions in a single pass
+    store_nans_and_minmax_bitset<float>(src_float, minVal, maxVal, ws.nans,
+                                        &src_float_clean_buffer, NAN_DEPTH);
+    nans_stored = true;
+  }
   src_float_clean_ptr = &src_float_clean_buffer;
 
 #elif 1 // clean NaNs, then find minVal, maxVal with minmax_nans
@@ -234,11 +598,6 @@ inline void convert_float_to_uchar(const cv::Mat & src_float, cv::Mat & dst_ucha
   minVal = minVal_double;
   maxVal = maxVal_double;
   src_float_clean_ptr = &src_float; // no cleaning
-
-#else // find at the same time minVal, maxVal and store NaNs
-  boost::unordered_set<unsigned int> src_nan_indices_set;
-  store_nans_and_minmax_set<float>(src_float, minVal, maxVal, src_nan_indices_set);
-  src_float_clean_ptr = &src_float; // no cleaning
 #endif
 
   // printf("minVal:%g, maxVal:%g\n", minVal, maxVal);
@@ -262,20 +621,17 @@ inline void convert_float_to_uchar(const cv::Mat & src_float, cv::Mat & dst_ucha
     uchar* dst_ptr = dst_uchar.ptr<uchar>(row);
     // change each value
     for (int col = 0; col < values_per_row; ++col) {
-#if 0 // use src_nan_indices_set
-      if (src_nan_indices_set.count(col + row * values_per_row))
-        *dst_ptr = NAN_UCHAR;
-      else
-#endif
-        // convert float distance to uchar
-        *dst_ptr = dist_to_image_val(*src_ptr, alpha_trans, beta_trans);
+      // convert float distance to uchar
+      *dst_ptr = dist_to_image_val(*src_ptr, alpha_trans, beta_trans);
       // store the indice if we found a NaN
-      if (store_indices && *dst_ptr == NAN_UCHAR)
+      if (store_indices && !nans_stored && *dst_ptr == NAN_UCHAR)
         src_nan_indices->push_back(col + row * values_per_row);
       ++src_ptr;
       ++dst_ptr;
     } // end loop col
   } // end loop row
+  if (store_indices && nans_stored) // same indices, without a test per value
+    ws.nans.to_indices(*src_nan_indices);
 
 #elif 1 // use the evil ptr<>() and iterate, does not work for non-continuous?
   // IplImage src_float_ipl = src_float, dst_uchar_ipl = dst_uchar;
@@ -314,6 +670,35 @@ inline void convert_float_to_uchar(const cv::Mat & src_float, cv::Mat & dst_ucha
 
 //////////////////////////////////////////////////////////////////////////////
 
+/*!
+  Compresses a float matrix to a uchar one with a given scaling,
+  for instance the fixed one of a whole sequence (cf FixedDepthScale).
+  There is no min/max search: a single pass, whose values are comparable
+  from a frame to another.
+  The values out of the range are clamped to [1, 255], cf dist_to_image_val().
+ \param src_float
+    a float matrix, any number of channels <= 4
+ \param dst_uchar (out)
+    where the converted uchar matrix will be stored
+ \param alpha_trans, beta_trans
+    the scaling and offset factors
+*/
+inline void convert_float_to_uchar_fixed(const cv::Mat & src_float, cv::Mat & dst_uchar,
+                                         const ScaleFactorType & alpha_trans,
+                                         const ScaleFactorType & beta_trans) {
+  TRACE_SPAN("convert_float_to_uchar_fixed");
+  dst_uchar.create(src_float.size(), CV_8UC(src_float.channels()));
+  // dist_to_image_val() also handles NaNs, no need for a clean copy
+  int nstripes = parallel_conversion_nstripes(src_float);
+  FloatToUcharBody body(src_float, dst_uchar, nstripes, alpha_trans, beta_trans);
+  if (nstripes > 1)
+    cv::parallel_for_(cv::Range(0, nstripes), body, nstripes);
+  else
+    body(cv::Range(0, 1));
+} // end convert_float_to_uchar_fixed();
+
+//////////////////////////////////////////////////////////////////////////////
+
 
 /*!
   Restores the compressed rounded image to the approximate float image
@@ -335,6 +720,7 @@ inline void convert_uchar_to_float(const cv::Mat & src_uchar, cv::Mat & dst_floa
                                    const ScaleFactorType & alpha_trans,
                                    const ScaleFactorType & beta_trans,
                                    const std::vector<unsigned int>* src_nan_indices = NULL) {
+  TRACE_SPAN("convert_uchar_to_float");
   dst_float.create(src_uchar.size(), CV_32FC(src_uchar.channels()));
   // parameters for NaN restoring
   bool src_nan_indices_given = (src_nan_indices != NULL);
@@ -348,6 +734,16 @@ inline void convert_uchar_to_float(const cv::Mat & src_uchar, cv::Mat & dst_floa
   for (int col = 0; col <= 255; ++col)
     lookup_table[col] = image_val_to_dist(col, alpha_trans, beta_trans);
 
+  // big images: striped conversion on several threads
+  int nstripes = parallel_conversion_nstripes(src_uchar);
+  if (!src_nan_indices_given && nstripes > 1) {
+    TRACE_SPAN("convert_uchar_to_float(): parallel");
+    cv::parallel_for_(cv::Range(0, nstripes),
+                      UcharToFloatBody(src_uchar, dst_float, nstripes, lookup_table),
+                      nstripes);
+    return;
+  }
+
   // convert the image
   // int values_per_row = src_uchar.cols * src_uchar.channels();
   int rows = src_uchar.rows;
@@ -581,6 +977,156 @@ enum FileFormat {
 
 typedef std::vector<int> ParamsVec;
 
+/*!
+ * The buffers used to read and write depth and rgb images.
+ * Passing the same workspace for all the frames of a sequence avoids
+ * reallocating full-frame buffers for each of them.
+ */
+struct ImageIOWorkspace {
+  ImageIOWorkspace() : sequence_alpha(1), sequence_beta(0), sequence_params_first(false) {}
+  //! the depth image converted to uchar
+  cv::Mat depth_img_as_uchar;
+  //! the buffers of convert_float_to_uchar()
+  FloatToUcharWorkspace float_to_uchar;
+  //! the encoded content of the last read file
+  std::vector<uchar> file_buffer;
+  //! the last sequence params file read or written, and its content
+  std::string sequence_params_filename;
+  ScaleFactorType sequence_alpha, sequence_beta;
+  //! read the params of the sequence before the ones of the frame, cf FixedDepthScale
+  bool sequence_params_first;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+//! the max depth of the default FixedDepthScale: METER2UCHAR_FACTOR levels per meter
+static const double FIXED_DEPTH_SCALE_MAX_DEPTH = 254. / METER2UCHAR_FACTOR; // m
+
+/*!
+ * The quantization of a whole sequence, instead of one per frame.
+ * [min_depth, max_depth] is mapped to [1, 255]: a grey level means the same
+ * depth in all the frames, the conversion needs no min/max pass,
+ * and the sequence has a single params file "depth_params.yaml",
+ * next to its images, instead of one "*_depth_params.yaml" per frame.
+ * The default, 0 to 12.7 m, gives 5 cm steps.
+ */
+struct FixedDepthScale {
+  FixedDepthScale(double min_depth = 0, double max_depth = FIXED_DEPTH_SCALE_MAX_DEPTH) {
+    compute_alpha_beta(min_depth, max_depth, alpha, beta);
+  }
+  ScaleFactorType alpha, beta;
+}; // end struct FixedDepthScale
+
+//! \example "/tmp/seq/frame001" -> "/tmp/seq/depth_params.yaml"
+inline std::string sequence_params_filename(const std::string & filename_prefix) {
+  size_t slash = filename_prefix.find_last_of('/');
+  if (slash == std::string::npos)
+    return "depth_params.yaml";
+  return filename_prefix.substr(0, slash + 1) + "depth_params.yaml";
+}
+
+//! write alpha and beta to a params file. \return true if success
+inline bool write_depth_params(const std::string & params_filename,
+                               const ScaleFactorType & alpha,
+                               const ScaleFactorType & beta) {
+  cv::FileStorage fs(params_filename, cv::FileStorage::WRITE);
+  if (!fs.isOpened()) {
+    printf("write_depth_params(): could not open depth params file '%s'\n",
+           params_filename.c_str());
+    return false;
+  }
+  fs << "alpha" << alpha;
+  fs << "beta" << beta;
+  fs.release();
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ \param filename
+    a relative or absolute filename
+ \return true if the file with given filename exists
+*/
+inline bool file_exists(const std::string & filename) {
+  std::ifstream my_file(filename.c_str());
+  return (my_file.good());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+  read alpha and beta from a params file.
+  \return true if success
+*/
+inline bool read_depth_params(const std::string & params_filename,
+                              ScaleFactorType & alpha, ScaleFactorType & beta) {
+  if (!file_exists(params_filename))
+    return false;
+  cv::FileStorage fs(params_filename, cv::FileStorage::READ);
+  if (!fs.isOpened())
+    return false;
+  fs["alpha"] >> alpha;
+  fs["beta"] >> beta;
+  fs.release();
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+  read the params file of the sequence of a frame, cf FixedDepthScale.
+  It is parsed once, then kept in the workspace.
+ \param filename_prefix
+    the prefix of any frame of the sequence, for instance "/tmp/seq/frame001"
+ \return true if success
+*/
+inline bool read_sequence_depth_params(const std::string & filename_prefix,
+                                       ScaleFactorType & alpha, ScaleFactorType & beta,
+                                       ImageIOWorkspace & ws) {
+  std::string params_filename = sequence_params_filename(filename_prefix);
+  if (ws.sequence_params_filename != params_filename) {
+    TRACE_SPAN("read_sequence_depth_params(): parse");
+    if (!read_depth_params(params_filename, ws.sequence_alpha, ws.sequence_beta))
+      return false;
+    ws.sequence_params_filename = params_filename;
+  }
+  alpha = ws.sequence_alpha;
+  beta = ws.sequence_beta;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+  write the params file of the sequence of a frame, cf FixedDepthScale,
+  if not done yet.
+  It fails if the sequence already has a params file with another scale.
+ \return true if success
+*/
+inline bool write_sequence_depth_params(const std::string & filename_prefix,
+                                        const FixedDepthScale & scale,
+                                        ImageIOWorkspace & ws) {
+  ScaleFactorType alpha, beta;
+  if (read_sequence_depth_params(filename_prefix, alpha, beta, ws)) {
+    if (alpha == scale.alpha && beta == scale.beta)
+      return true;
+    printf("write_sequence_depth_params(): '%s' has another scale "
+           "(alpha:%g, beta:%g), cannot write frames with alpha:%g, beta:%g!\n",
+           ws.sequence_params_filename.c_str(), alpha, beta, scale.alpha, scale.beta);
+    return false;
+  }
+  std::string params_filename = sequence_params_filename(filename_prefix);
+  if (!write_depth_params(params_filename, scale.alpha, scale.beta))
+    return false;
+  ws.sequence_params_filename = params_filename;
+  ws.sequence_alpha = scale.alpha;
+  ws.sequence_beta = scale.beta;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 inline ParamsVec format2params(FileFormat format) {
   ParamsVec ans;
   switch (format) {
@@ -626,6 +1172,8 @@ inline std::string format2extension(FileFormat format) {
     The data of the float image converted to uchar,
     using convert_float_to_uchar()
     If depth_img_as_uchar = NULL, no depth output will be written.
+    If alpha = NULL or beta = NULL, no params file is written:
+    the depth uses the scale of the sequence, cf FixedDepthScale.
  \example filename_prefix = "/tmp/test"
     will generate "/tmp/test_depth.png"; "/tmp/test_depth_params.png";
     "/tmp/test_rgb.png";
@@ -644,6 +1192,7 @@ inline bool write_rgb_and_depth_image_as_uchar_to_image_file
   if (depth_img_as_uchar != NULL) {
     std::ostringstream depth_img_filename;
     depth_img_filename << filename_prefix << "_depth" << extension;
+    TRACE_SPAN("write_rgb_and_depth_image_as_uchar_to_image_file(): depth");
     if (!cv::imwrite(depth_img_filename.str(), *depth_img_as_uchar, params)) {
       printf("write_rgb_and_depth_image_as_uchar_to_image_file(): "
              "could not write depth image '%s'\n", depth_img_filename.str().c_str());
@@ -651,17 +1200,16 @@ inline bool write_rgb_and_depth_image_as_uchar_to_image_file
     }
 
     // depth params file
+    if (alpha == NULL || beta == NULL) { // fixed scale, in the sequence params file
+      if (debug_info)
+        printf("Written depth file '%s'.\n", depth_img_filename.str().c_str());
+      return write_rgb_and_depth_image_as_uchar_to_image_file
+          (filename_prefix, rgb_img, NULL, NULL, NULL, format, debug_info);
+    }
     std::ostringstream params_textfile_filename;
     params_textfile_filename << filename_prefix << "_depth_params.yaml";
-    cv::FileStorage fs(params_textfile_filename.str(), cv::FileStorage::WRITE);
-    if (!fs.isOpened()) {
-      printf("write_rgb_and_depth_image_as_uchar_to_image_file(): "
-             "could not open depth params file '%s'\n", params_textfile_filename.str().c_str());
+    if (!write_depth_params(params_textfile_filename.str(), *alpha, *beta))
       return false;
-    }
-    fs << "alpha" << *alpha;
-    fs << "beta" << *beta;
-    fs.release();
     if (debug_info)
       printf("Written depth files '%s' and '%s'.\n",
              depth_img_filename.str().c_str(), params_textfile_filename.str().c_str());
@@ -671,6 +1219,7 @@ inline bool write_rgb_and_depth_image_as_uchar_to_image_file
   if (rgb_img != NULL) {
     std::ostringstream rgb_img_filename;
     rgb_img_filename << filename_prefix << "_rgb"  << extension;
+    TRACE_SPAN("write_rgb_and_depth_image_as_uchar_to_image_file(): rgb");
     if (!cv::imwrite(rgb_img_filename.str(), *rgb_img, params)) {
       printf("write_rgb_and_depth_image_as_uchar_to_image_file(): "
              "could not write rgb image '%s'\n", rgb_img_filename.str().c_str());
@@ -688,23 +1237,39 @@ inline bool write_rgb_and_depth_image_as_uchar_to_image_file
   Converts the float image to uchar, then write depth and rgb files to PNG images.
   If rgb_img == NULL, no RGB output is written.
   If depth_img == NULL, no depth output is written.
+  If workspace != NULL, its buffers are used for the conversion.
+  If fixed_scale != NULL, the depth is quantized with it, and the sequence
+  params file is written once instead of a params file per frame.
+  All the frames of a sequence must then use the same fixed scale.
   \see write_rgb_and_depth_image_as_uchar_to_image_file(),
-       convert_float_to_uchar()
+       convert_float_to_uchar(), FixedDepthScale
 */
 inline bool write_rgb_and_depth_image_to_image_file
 (const std::string & filename_prefix,
  const cv::Mat * rgb_img = NULL,
  const cv::Mat * depth_img = NULL,
  FileFormat format = FILE_PNG,
- bool debug_info = true)
+ bool debug_info = true,
+ ImageIOWorkspace * workspace = NULL,
+ const FixedDepthScale * fixed_scale = NULL)
 {
   if (depth_img != NULL) {
-    cv::Mat depth_img_as_uchar, src_float_clean_buffer;
+    ImageIOWorkspace local_workspace;
+    ImageIOWorkspace* ws = (workspace != NULL ? workspace : &local_workspace);
+    if (fixed_scale != NULL) {
+      if (!write_sequence_depth_params(filename_prefix, *fixed_scale, *ws))
+        return false;
+      convert_float_to_uchar_fixed(*depth_img, ws->depth_img_as_uchar,
+                                   fixed_scale->alpha, fixed_scale->beta);
+      return write_rgb_and_depth_image_as_uchar_to_image_file
+          (filename_prefix, rgb_img, &ws->depth_img_as_uchar, NULL, NULL,
+           format, debug_info);
+    }
     ScaleFactorType alpha, beta;
-    convert_float_to_uchar(*depth_img, depth_img_as_uchar, src_float_clean_buffer,
+    convert_float_to_uchar(*depth_img, ws->depth_img_as_uchar, ws->float_to_uchar,
                            alpha, beta);
     return write_rgb_and_depth_image_as_uchar_to_image_file
-        (filename_prefix, rgb_img, &depth_img_as_uchar, &alpha, &beta,
+        (filename_prefix, rgb_img, &ws->depth_img_as_uchar, &alpha, &beta,
          format, debug_info);
   } // end (depth_img != NULL)
   else
@@ -715,14 +1280,51 @@ inline bool write_rgb_and_depth_image_to_image_file
 ////////////////////////////////////////////////////////////////////////////////
 
 /*!
+  Read an image into an existing matrix.
+  Contrary to cv::imread(), the buffer of \a dst is reused
+  if it already has the right size and type.
  \param filename
     a relative or absolute filename
- \return true if the file with given filename exists
+ \param dst (out)
+    where the decoded image will be stored
+ \param flags
+    the same as for cv::imread(), ex CV_LOAD_IMAGE_COLOR
+ \param file_buffer
+    a buffer for the encoded file, kept between the calls
+ \return true if success
 */
-inline bool file_exists(const std::string & filename) {
-  std::ifstream my_file(filename.c_str());
-  return (my_file.good());
-}
+inline bool imread_into(const std::string & filename, cv::Mat & dst, int flags,
+                        std::vector<uchar> & file_buffer) {
+  TRACE_SPAN("imread_into");
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (file == NULL)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (file_size <= 0) {
+    fclose(file);
+    return false;
+  }
+  file_buffer.resize(file_size);
+  size_t nread = 0;
+  {
+    TRACE_SPAN("imread_into(): read file");
+    nread = fread(&(file_buffer[0]), 1, file_size, file);
+  }
+  fclose(file);
+  if (nread != (size_t) file_size)
+    return false;
+  TRACE_SPAN("imread_into(): cv::imdecode()");
+  try {
+    cv::imdecode(file_buffer, flags, &dst);
+  }
+  catch (cv::Exception e) {
+    printf("imread_into('%s'): exception '%s'\n", filename.c_str(), e.what());
+    return false;
+  }
+  return !dst.empty();
+} // end imread_into()
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -737,16 +1339,24 @@ inline bool file_exists(const std::string & filename) {
     The data of the float-as-uchar image,
     which can be used for convert_uchar_to_float();
     If depth_img_as_uchar = NULL, no depth input will be read.
+    Without "*_depth_params.yaml" file, the params of the sequence
+    are used, cf FixedDepthScale. With workspace->sequence_params_first,
+    they are read first, and the file of the frame is only a fallback.
  \example filename_prefix = "/tmp/test"
     will generate "/tmp/test_depth.png"; "/tmp/test_depth_params.png";
     "/tmp/test_rgb.png";
+ \param workspace
+    If not NULL, the images are decoded into the existing buffers
+    of rgb_img and depth_img_as_uchar, using its file buffer,
+    and the params of the sequence are parsed only once.
 */
 inline bool read_rgb_and_depth_image_as_uchar_from_image_file
 (const std::string & filename_prefix,
  cv::Mat * rgb_img = NULL,
  cv::Mat * depth_img_as_uchar = NULL,
  ScaleFactorType * alpha = NULL, ScaleFactorType * beta = NULL,
- FileFormat format = FILE_PNG)
+ FileFormat format = FILE_PNG,
+ ImageIOWorkspace * workspace = NULL)
 {
   std::string extension = format2extension(format);
   if (depth_img_as_uchar != NULL) {
@@ -758,23 +1368,32 @@ inline bool read_rgb_and_depth_image_as_uchar_from_image_file
              depth_img_filename.str().c_str());
       return false;
     }
-    *depth_img_as_uchar = cv::imread(depth_img_filename.str(), CV_LOAD_IMAGE_GRAYSCALE);
+    if (workspace != NULL)
+      imread_into(depth_img_filename.str(), *depth_img_as_uchar,
+                  CV_LOAD_IMAGE_GRAYSCALE, workspace->file_buffer);
+    else
+      *depth_img_as_uchar = cv::imread(depth_img_filename.str(), CV_LOAD_IMAGE_GRAYSCALE);
     if (depth_img_as_uchar->empty()) {
       printf("depth_img_as_uchar '%s' is corrupted!\n", depth_img_filename.str().c_str());
       return false;
     }
-    // params file
+    // params file: the one of the frame, otherwise the one of the sequence
     std::ostringstream params_textfile_filename;
     params_textfile_filename << filename_prefix << "_depth_params.yaml";
-    if (!file_exists(params_textfile_filename.str())) {
-      printf("params_textfile img file '%s' does not exist, cannot read it!\n",
-             params_textfile_filename.str().c_str());
+    TRACE_SPAN("read_rgb_and_depth_image_as_uchar_from_image_file(): params");
+    ImageIOWorkspace local_workspace;
+    ImageIOWorkspace & ws = (workspace != NULL ? *workspace : local_workspace);
+    bool params_read = (ws.sequence_params_first
+                        && read_sequence_depth_params(filename_prefix, *alpha, *beta, ws));
+    if (!params_read
+        && !read_depth_params(params_textfile_filename.str(), *alpha, *beta)
+        && (ws.sequence_params_first
+            || !read_sequence_depth_params(filename_prefix, *alpha, *beta, ws))) {
+      printf("neither params_textfile '%s' nor '%s' exist, cannot read them!\n",
+             params_textfile_filename.str().c_str(),
+             sequence_params_filename(filename_prefix).c_str());
       return false;
     }
-    cv::FileStorage fs(params_textfile_filename.str(), cv::FileStorage::READ);
-    fs["alpha"] >> *alpha;
-    fs["beta"] >> *beta;
-    fs.release();
     //    printf("Read depth file '%s' (params_textfile:'%s').\n",
     //           depth_img_filename.str().c_str(),
     //           params_textfile_filename.str().c_str());
@@ -789,7 +1408,11 @@ inline bool read_rgb_and_depth_image_as_uchar_from_image_file
              rgb_img_filename.str().c_str());
       return false;
     }
-    *rgb_img = cv::imread(rgb_img_filename.str());
+    if (workspace != NULL)
+      imread_into(rgb_img_filename.str(), *rgb_img,
+                  CV_LOAD_IMAGE_COLOR, workspace->file_buffer);
+    else
+      *rgb_img = cv::imread(rgb_img_filename.str());
     // printf("Read rgb file '%s'.\n", rgb_img_filename.str().c_str());
     if (rgb_img->empty()) {
       printf("rgb_img '%s' is corrupted!\n", rgb_img_filename.str().c_str());
@@ -806,6 +1429,8 @@ inline bool read_rgb_and_depth_image_as_uchar_from_image_file
   then converts depth-as-uchar to depth-as-float.
   If rgb_img == NULL, no RGB input is read.
   If depth_img == NULL, no depth input is read.
+  If workspace != NULL, its buffers are used for decoding,
+  and the buffers of rgb_img and depth_img are reused.
   \see read_rgb_and_depth_image_as_uchar_from_image_file(),
        convert_float_to_uchar()
 */
@@ -813,20 +1438,25 @@ inline bool read_rgb_and_depth_image_from_image_file
 (const std::string & filename_prefix,
  cv::Mat * rgb_img = NULL,
  cv::Mat * depth_img = NULL,
- FileFormat format = FILE_PNG)
+ FileFormat format = FILE_PNG,
+ ImageIOWorkspace * workspace = NULL)
 {
+  TRACE_SPAN("read_rgb_and_depth_image_from_image_file");
   if (depth_img != NULL) {
-    cv::Mat depth_img_as_uchar;
+    cv::Mat local_depth_img_as_uchar;
+    cv::Mat* depth_img_as_uchar = (workspace != NULL ? &workspace->depth_img_as_uchar
+                                                     : &local_depth_img_as_uchar);
     ScaleFactorType alpha = 1, beta = 0;
     bool ok = read_rgb_and_depth_image_as_uchar_from_image_file
-              (filename_prefix, rgb_img, &depth_img_as_uchar, &alpha, &beta, format);
+              (filename_prefix, rgb_img, depth_img_as_uchar, &alpha, &beta, format,
+               workspace);
     if (!ok)
       return false;
-    convert_uchar_to_float(depth_img_as_uchar, *depth_img, alpha, beta);
+    convert_uchar_to_float(*depth_img_as_uchar, *depth_img, alpha, beta);
     return true;
   } // end (depth_img != NULL)
   return read_rgb_and_depth_image_as_uchar_from_image_file
-      (filename_prefix, rgb_img, NULL, NULL, NULL, format);
+      (filename_prefix, rgb_img, NULL, NULL, NULL, format, workspace);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
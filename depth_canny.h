@@ -23,6 +23,15 @@ ________________________________________________________________________________
 \class DepthCanny
 A class to apply Canny filters on depth images.
 
+The processing itself is the stateless DepthCanny::compute():
+depth image + DepthCannyParams -> contour image + DepthCannyStats,
+all the intermediate images living in a DepthCannyWorkspace supplied
+by the caller. It does not print anything, so that several threads
+can process frames concurrently, each with its own workspace,
+for instance taken from a DepthCannyWorkspacePool.
+A DepthCanny instance is a convenience wrapper for a single thread,
+owning its params and workspace.
+
  */
 
 #ifndef DEPTH_CANNY_H
@@ -32,27 +41,72 @@ A class to apply Canny filters on depth images.
 #include <opencv2/imgproc/imgproc.hpp>
 // AD
 #include <cv_conversion_float_uchar.h>
-//#include <vision_utils/image_utils/value_remover.h>
+#include <span_tracer.h>
+#include <allocation_counter.h>
+#include <value_remover.h>
+#include <normal_edges.h>
 //#include <vision_utils/image_utils/io.h>
 
-//#define CHART_TIMER_ON
-//#define TIMER_ON
+//! the parameters of DepthCanny::compute()
+struct DepthCannyParams {
+  //! the default values, defined after DepthCanny
+  DepthCannyParams();
+
+  //! Canny parameters, in meters
+  double canny_thres1, canny_thres2;
+  //! the depth range mapped to 8 bits before Canny, cf DepthRangeOptions
+  image_utils::DepthRangeOptions depth_range;
+  //! if true, fixed_depth_scale is used instead of depth_range:
+  //! the same grey levels, hence the same Canny thresholds, for all the frames
+  bool fixed_depth_scale_enabled;
+  image_utils::FixedDepthScale fixed_depth_scale;
+  //! how the holes (NaN) of the depth image are filled before Canny
+  image_utils::NaNRemovalMethod nan_removal_method;
+  //! how the holes touching the image border are filled
+  image_utils::BorderHolePolicy border_hole_policy;
+  //! also detect the creases of the surfaces, cf NormalEdges
+  bool normal_edges_enabled;
+  double crease_angle; //!< degrees
+  double normal_edges_budget_ms;
+}; // end struct DepthCannyParams
 
-#ifdef CHART_TIMER_ON // chart timer
-#include <vision_utils/visu_utils/timer_chart.h> // uncomment for timer chart
+////////////////////////////////////////////////////////////////////////////////
 
-#elif defined TIMER_ON // chart timer
-#define TIMER_CREATE(t)                     Timer t;
-#define TIMER_RESET(t)                      t.reset();
-#define TIMER_PRINT_RESET(t, msg)           t.printTime(msg); t.reset();
-#define TIMER_DISPLAY_CHART(t, step)        // empty
+//! the intermediate images of DepthCanny::compute(), kept between the frames
+struct DepthCannyWorkspace {
+  // float -> uchar
+  cv::Mat1b img_uchar;
+  image_utils::FloatToUcharWorkspace float_to_uchar;
+  // nan removal
+  cv::Mat1b img_uchar_with_no_nan;
+  // edge detection
+  cv::Mat1b edges;
+  std::vector<uchar> edges_vertical_max; //!< cf invert_erode_and_merge_nans()
+  // creases - the adaptive stride is per workspace
+  NormalEdges normal_edges;
+}; // end struct DepthCannyWorkspace
+
+////////////////////////////////////////////////////////////////////////////////
+
+//! what happened during DepthCanny::compute()
+struct DepthCannyStats {
+  DepthCannyStats() { clear(); }
+  inline void clear() {
+    alpha_trans = beta_trans = 0;
+    nan_removal_npixels = 0;
+    nan_removal_ms = normal_edges_ms = total_ms = 0;
+    normal_edges_stride = 0;
+  }
+  //! the float -> uchar scaling, cf convert_float_to_uchar()
+  image_utils::ScaleFactorType alpha_trans, beta_trans;
+  unsigned int nan_removal_npixels; //!< the number of filled pixels
+  double nan_removal_ms;
+  int normal_edges_stride; //!< 0 if the creases were not computed
+  double normal_edges_ms;
+  double total_ms;
+}; // end struct DepthCannyStats
 
-#else // do nothing
-#define TIMER_CREATE(t)                     // empty
-#define TIMER_RESET(t)                      // empty
-#define TIMER_PRINT_RESET(t, msg)           // empty
-#define TIMER_DISPLAY_CHART(t, step)        // empty
-#endif // CHART_TIMER_ON
+////////////////////////////////////////////////////////////////////////////////
 
 class DepthCanny {
 public:
@@ -64,128 +118,326 @@ public:
   static const double DEFAULT_CANNY_THRES1 = 1; // m
   static const double DEFAULT_CANNY_THRES2 = 1.6; // m
 
-  DepthCanny() {
-    set_canny_thresholds(DEFAULT_CANNY_THRES1, DEFAULT_CANNY_THRES2);
-    //eset_nan_removal_method(image_utils::VALUE_REMOVAL_METHOD_DO_NOTHING);
-  }
+  DepthCanny() : _verbose(true) {}
 
   //////////////////////////////////////////////////////////////////////////////
 
   //! set Canny parameters, in meters
   inline void set_canny_thresholds(const double canny_thres1,
                                    const double canny_thres2) {
-    _canny_thres1 = canny_thres1;
-    _canny_thres2 = canny_thres2;
+    _params.canny_thres1 = canny_thres1;
+    _params.canny_thres2 = canny_thres2;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*! map the [low, high] percentiles of the depth to 8 bits instead of [min, max],
+   * cf DepthRangeOptions. (0, 100) for [min, max]. */
+  inline bool set_depth_range_percentiles(const double low, const double high) {
+    image_utils::DepthRangeOptions range(low, high);
+    if (!range.is_valid()) {
+      printf("DepthCanny: invalid depth percentiles (%g, %g), "
+             "need 0 <= low < high <= 100, keeping (%g, %g)\n", low, high,
+             _params.depth_range.low_percentile, _params.depth_range.high_percentile);
+      return false;
+    }
+    _params.depth_range.low_percentile = low;
+    _params.depth_range.high_percentile = high;
+    return true;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! map the depth to 8 bits with a fixed scale, cf FixedDepthScale. NULL for none
+  inline void set_fixed_depth_scale(const image_utils::FixedDepthScale* scale) {
+    _params.fixed_depth_scale_enabled = (scale != NULL);
+    if (scale != NULL)
+      _params.fixed_depth_scale = *scale;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! how the holes (NaN) of the depth image are filled before Canny
+  inline void set_nan_removal_method(const image_utils::NaNRemovalMethod m) {
+    _params.nan_removal_method = m;
+  }
+  //! how the holes touching the image border are filled
+  inline void set_border_hole_policy(const image_utils::BorderHolePolicy p) {
+    _params.border_hole_policy = p;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! also detect the creases of the surfaces, cf NormalEdges
+  inline void set_normal_edges_enabled(bool enabled) {
+    _params.normal_edges_enabled = enabled;
+  }
+  inline bool get_normal_edges_enabled() const {
+    return _params.normal_edges_enabled;
+  }
+  inline void set_normal_edges_params(double crease_angle, double budget_ms) {
+    _params.crease_angle = crease_angle;
+    _params.normal_edges_budget_ms = budget_ms;
   }
 
   //////////////////////////////////////////////////////////////////////////////
 
-//  inline void set_nan_removal_method(const image_utils::NaNRemovalMethod m) {
-//    _nan_removal_method = m;
-//  }
+  //! print the stats of each frame
+  inline void set_verbose(bool verbose) {
+    _verbose = verbose;
+  }
+  inline const DepthCannyParams & get_params() const {
+    return _params;
+  }
+  inline const DepthCannyStats & get_stats() const {
+    return _stats;
+  }
 
   //////////////////////////////////////////////////////////////////////////////
 
   void thresh(const cv::Mat & depth_img) {
-    if (depth_img.empty())
+    compute(depth_img, _params, _workspace, _contours, &_stats);
+    if (!_verbose || depth_img.empty())
       return;
+    printf("canny_thres1:%g, canny_thres2:%g, alpha_trans:%g, "
+           "NaN removal: %u pixels in %.2f ms, total: %.2f ms\n",
+           _params.canny_thres1, _params.canny_thres2, _stats.alpha_trans,
+           _stats.nan_removal_npixels, _stats.nan_removal_ms, _stats.total_ms);
+    if (_stats.normal_edges_stride > 0)
+      printf("normal edges: stride %i, %.2f ms\n",
+             _stats.normal_edges_stride, _stats.normal_edges_ms);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
 
-    TIMER_RESET(timer);
-    image_utils::convert_float_to_uchar(depth_img, _img_uchar, src_float_clean_buffer,
-                                        _alpha_trans, _beta_trans);
+  inline const cv::Mat1b & get_thresholded_image() const {
+    return _contours;
+  }
+  inline       cv::Mat1b & get_thresholded_image() {
+    return _contours;
+  }
 
-    TIMER_PRINT_RESET(timer, "thresh(): remapping depth float->uchar");
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * The stateless processing: safe to call from several threads,
+   * as long as each of them uses its own workspace.
+   * \param depth_img
+   *    a CV_32F depth image, in meters
+   * \param contours (out)
+   *    the contour image: 0 for edges, 255 elsewhere
+   * \param stats (out)
+   *    if not NULL, what happened
+   */
+  static void compute(const cv::Mat & depth_img,
+                      const DepthCannyParams & params,
+                      DepthCannyWorkspace & ws,
+                      cv::Mat1b & contours,
+                      DepthCannyStats* stats = NULL) {
+    TRACE_SPAN("DepthCanny::compute");
+    DepthCannyStats local_stats;
+    DepthCannyStats & st = (stats != NULL ? *stats : local_stats);
+    st.clear();
+    if (depth_img.empty())
+      return;
+    int64 begin_ticks = cv::getTickCount();
+    double ticks2ms = 1000. / cv::getTickFrequency();
+
+    {
+      TRACE_SPAN("compute(): remapping depth float->uchar");
+      // the buffers are in ws, but cv::parallel_for_() may allocate its jobs
+      ALLOCATION_CHECK_IGNORE();
+      if (params.fixed_depth_scale_enabled) { // no min/max pass
+        st.alpha_trans = params.fixed_depth_scale.alpha;
+        st.beta_trans = params.fixed_depth_scale.beta;
+        image_utils::convert_float_to_uchar_fixed(depth_img, ws.img_uchar,
+                                                  st.alpha_trans, st.beta_trans);
+      }
+      else
+        image_utils::convert_float_to_uchar(depth_img, ws.img_uchar, ws.float_to_uchar,
+                                            st.alpha_trans, st.beta_trans,
+                                            NULL, &params.depth_range);
+    }
 
     /*
-     *remove NaN from input image
+     *remove NaN from input image, so that the shadows do not make contours
      */
-    _img_uchar.copyTo(_img_uchar_with_no_nan);
-    cv::Rect roi(0, 0, _img_uchar.cols, _img_uchar.rows);
-    //  cv::Rect roi = image_utils::remove_value
-    //      (_img_uchar, _img_uchar_with_no_nan, image_utils::NAN_UCHAR,
-    //       _inpaint_mask, _nan_removal_method);
-    TIMER_PRINT_RESET(timer, "thresh(): image_utils::remove_value(NAN_UCHAR)");
+    const cv::Mat1b* canny_input = &ws.img_uchar;
+    if (params.nan_removal_method != image_utils::VALUE_REMOVAL_METHOD_DO_NOTHING) {
+      TRACE_SPAN("compute(): image_utils::remove_value(NAN_UCHAR)");
+      int64 nan_begin_ticks = cv::getTickCount();
+      st.nan_removal_npixels = image_utils::remove_value
+          (ws.img_uchar, ws.img_uchar_with_no_nan, image_utils::NAN_UCHAR,
+           params.nan_removal_method, params.border_hole_policy);
+      st.nan_removal_ms = (cv::getTickCount() - nan_begin_ticks) * ticks2ms;
+      canny_input = &ws.img_uchar_with_no_nan;
+    }
 
     /*
      *edge detection
      */
-    // canny
-    printf("canny_thres1:%g, canny_thres2:%g, alpha_trans:%g\n",
-                 _canny_thres1, _canny_thres2, _alpha_trans);
-    cv::Canny(_img_uchar_with_no_nan, _edges,
-              _alpha_trans *_canny_thres1, _alpha_trans *_canny_thres2);
-
-    std::ostringstream sentence;
-    sentence << "thresh(): Canny (param1:" <<_canny_thres1
-             << ", param2: " << _canny_thres2 << ")";
-    TIMER_PRINT_RESET(timer, sentence.str().c_str());
-
-    /*invert the edges */
-#if 1 // faster
-    cv::threshold(_edges, _edges_inverted, 128, 255, cv::THRESH_BINARY_INV);
-#else
-    _edges_inverted = (_edges == 0);
-#endif
-    TIMER_PRINT_RESET(timer, "thresh(): cv::threshold(_edges) -> _edges_inverted");
-
-    // close borders
-    //image_utils::close_borders(edges_inverted_with_nan, (uchar) 255);
-    //    cv::morphologyEx(edges_inverted, edges_inverted_opened,
-    //                     cv::MORPH_OPEN,
-    //                     cv::Mat(MORPH_OPEN_KERNEL_SIZE, MORPH_OPEN_KERNEL_SIZE, CV_8U, 255));
-    cv::erode(_edges_inverted, _edges_inverted_opened,
-              cv::Mat(MORPH_OPEN_KERNEL_SIZE, MORPH_OPEN_KERNEL_SIZE, CV_8U, 255));
-    TIMER_PRINT_RESET(timer, "thresh(): cv::erode()");
+    {
+      TRACE_SPAN("compute(): cv::Canny()");
+      ALLOCATION_CHECK_IGNORE(); // cv::Canny() internals
+      cv::Canny(*canny_input, ws.edges,
+                st.alpha_trans * params.canny_thres1, st.alpha_trans * params.canny_thres2);
+    }
 
     /*
-     *combine canny with nan
+     *invert the edges, close borders with an erosion, combine with the
+     *remaining NaN of depth (all of them if they were not removed)
      */
-#if 1 // faster
-    _edges_inverted_opened.copyTo(_edges_inverted_opened_with_nan);
-    _img_uchar(roi).copyTo(_edges_inverted_opened_with_nan,
-                           (_img_uchar(roi) == image_utils::NAN_UCHAR));
-#else
-    cv::min(_edges_inverted_opened, _img_uchar(roi), _edges_inverted_opened_with_nan);
-    cv::threshold(_edges_inverted_opened_with_nan, _edges_inverted_opened_with_nan,
-                  image_utils::NAN_UCHAR, 255, cv::THRESH_BINARY);
-#endif
-    TIMER_PRINT_RESET(timer, "thresh(): combining Canny edges and NAN of depth");
-  }
+    {
+      TRACE_SPAN("compute(): invert_erode_and_merge_nans()");
+      invert_erode_and_merge_nans(ws.edges, *canny_input, contours,
+                                  ws.edges_vertical_max);
+    }
+
+    /*
+     *add the creases, where depth is continuous
+     */
+    if (params.normal_edges_enabled) {
+      ws.normal_edges.set_crease_angle(params.crease_angle);
+      ws.normal_edges.set_budget_ms(params.normal_edges_budget_ms);
+      st.normal_edges_stride = ws.normal_edges.get_stride(); // before adaptation
+      ws.normal_edges.thresh(depth_img);
+      st.normal_edges_ms = ws.normal_edges.get_last_ms();
+      TRACE_SPAN("compute(): merging normal edges");
+      cv::min(contours, ws.normal_edges.get_thresholded_image(), contours);
+    }
+    st.total_ms = (cv::getTickCount() - begin_ticks) * ticks2ms;
+  } // end compute()
 
   //////////////////////////////////////////////////////////////////////////////
 
-  inline const cv::Mat1b & get_thresholded_image() const {
-    return _edges_inverted_opened_with_nan;
-  }
-  inline       cv::Mat1b & get_thresholded_image() {
-    return _edges_inverted_opened_with_nan;
-  }
+  /*!
+   * In a single pass, the same as
+   * cv::threshold(edges, inv, 128, 255, cv::THRESH_BINARY_INV);
+   * cv::erode(inv, opened, MORPH_OPEN_KERNEL_SIZE x MORPH_OPEN_KERNEL_SIZE);
+   * opened.copyTo(out); img_uchar.copyTo(out, img_uchar == NAN_UCHAR);
+   * that is, out is 0 where there is an edge in the kernel window
+   * or a NaN in img_uchar, 255 elsewhere.
+   * As for cv::erode(), the pixels outside of the image are ignored.
+   * Rows are streamed: the vertical max of the kernel rows is computed
+   * into \a vertical_max_buffer, then the horizontal max is taken on the fly.
+   */
+  static void invert_erode_and_merge_nans(const cv::Mat1b & edges,
+                                          const cv::Mat1b & img_uchar,
+                                          cv::Mat1b & out,
+                                          std::vector<uchar> & vertical_max_buffer) {
+    const int radius = MORPH_OPEN_KERNEL_SIZE / 2;
+    int rows = edges.rows, cols = edges.cols;
+    out.create(edges.size());
+    vertical_max_buffer.resize(cols);
+    uchar* vertical_max = (cols > 0 ? &(vertical_max_buffer[0]) : NULL);
+    for (int row = 0; row < rows; ++row) {
+      // vertical max of the edges on the rows of the window
+      int row_begin = std::max(row - radius, 0), row_end = std::min(row + radius, rows - 1);
+      const uchar* edges_ptr = edges.ptr<uchar>(row_begin);
+      for (int col = 0; col < cols; ++col)
+        vertical_max[col] = edges_ptr[col];
+      for (int window_row = row_begin + 1; window_row <= row_end; ++window_row) {
+        edges_ptr = edges.ptr<uchar>(window_row);
+        for (int col = 0; col < cols; ++col)
+          vertical_max[col] = std::max(vertical_max[col], edges_ptr[col]);
+      }
+      // horizontal max, inversion and NaN
+      const uchar* img_ptr = img_uchar.ptr<uchar>(row);
+      uchar* out_ptr = out.ptr<uchar>(row);
+      for (int col = 0; col < cols; ++col) {
+        if (img_ptr[col] == image_utils::NAN_UCHAR) {
+          out_ptr[col] = image_utils::NAN_UCHAR;
+          continue;
+        }
+        int col_begin = std::max(col - radius, 0), col_end = std::min(col + radius, cols - 1);
+        uchar window_max = 0;
+        for (int window_col = col_begin; window_col <= col_end; ++window_col)
+          window_max = std::max(window_max, vertical_max[window_col]);
+        out_ptr[col] = (window_max > 128 ? 0 : 255);
+      } // end loop col
+    } // end loop row
+  } // end invert_erode_and_merge_nans()
 
   //////////////////////////////////////////////////////////////////////////////
 
-  // private:
-  TIMER_CREATE(timer)
+private:
+  bool _verbose;
+  DepthCannyParams _params;
+  DepthCannyWorkspace _workspace;
+  DepthCannyStats _stats;
+  cv::Mat1b _contours;
+}; // end class DepthCanny
+
+////////////////////////////////////////////////////////////////////////////////
 
-  // float -> uchar
-  image_utils::ScaleFactorType _alpha_trans, _beta_trans;
-  cv::Mat1b _img_uchar;
-  cv::Mat src_float_clean_buffer;
+inline DepthCannyParams::DepthCannyParams() :
+  canny_thres1(DepthCanny::DEFAULT_CANNY_THRES1),
+  canny_thres2(DepthCanny::DEFAULT_CANNY_THRES2),
+  fixed_depth_scale_enabled(false),
+  nan_removal_method(image_utils::VALUE_REMOVAL_METHOD_BACKGROUND),
+  border_hole_policy(image_utils::BORDER_HOLES_EXTEND),
+  normal_edges_enabled(false),
+  crease_angle(NormalEdges::DEFAULT_CREASE_ANGLE),
+  normal_edges_budget_ms(NormalEdges::DEFAULT_BUDGET_MS) {}
 
-  // nan removal
-  cv::Mat1b _img_uchar_with_no_nan;
-  // image_utils::NaNRemovalMethod _nan_removal_method;
-  cv::Mat1b _inpaint_mask;
+////////////////////////////////////////////////////////////////////////////////
 
-  // edge detection
-  double _canny_thres1, _canny_thres2;
-  //  int canny_tb1_value, canny_tb2_value;
-
-  cv::Mat1b _edges;
-  cv::Mat1b _edges_inverted;
-  cv::Mat1b _edges_inverted_opened_with_nan;
-  cv::Mat1b _edges_inverted_opened;
-  //cv::Mat1b harrisCorners;
-}; // end class DepthCanny
+/*!
+ * A pool of workspaces for DepthCanny::compute(), shared by worker threads.
+ * The workspaces are created on demand and reused, so that once each thread
+ * has processed a frame, the frames are processed without allocation.
+ * Use ScopedWorkspace to release the workspace automatically.
+ */
+class DepthCannyWorkspacePool {
+public:
+  ~DepthCannyWorkspacePool() {
+    for (unsigned int i = 0; i < _all.size(); ++i)
+      delete _all[i];
+  }
+
+  //! a workspace for the calling thread, to be given back with release()
+  DepthCannyWorkspace* acquire() {
+    cv::AutoLock lock(_mutex);
+    if (!_available.empty()) {
+      DepthCannyWorkspace* ws = _available.back();
+      _available.pop_back();
+      return ws;
+    }
+    DepthCannyWorkspace* ws = new DepthCannyWorkspace();
+    _all.push_back(ws);
+    _available.reserve(_all.size()); // release() does not allocate
+    return ws;
+  }
+
+  void release(DepthCannyWorkspace* ws) {
+    cv::AutoLock lock(_mutex);
+    _available.push_back(ws);
+  }
+
+  //! the number of workspaces created so far
+  unsigned int size() const {
+    cv::AutoLock lock(_mutex);
+    return _all.size();
+  }
+
+  //! acquires a workspace for the lifetime of the object
+  class ScopedWorkspace {
+  public:
+    ScopedWorkspace(DepthCannyWorkspacePool & pool) :
+      _pool(pool), _ws(pool.acquire()) {}
+    ~ScopedWorkspace() { _pool.release(_ws); }
+    inline DepthCannyWorkspace & operator*() { return *_ws; }
+    inline DepthCannyWorkspace* operator->() { return _ws; }
+  private:
+    DepthCannyWorkspacePool & _pool;
+    DepthCannyWorkspace* _ws;
+  }; // end class ScopedWorkspace
+
+private:
+  mutable cv::Mutex _mutex;
+  std::vector<DepthCannyWorkspace*> _all; //!< owned
+  std::vector<DepthCannyWorkspace*> _available;
+}; // end class DepthCannyWorkspacePool
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -0,0 +1,147 @@
+/*!
+  \file        depth_jump_edges.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+\class DepthJumpEdges
+An edge detector for depth images working directly on the float depth,
+an alternative to DepthCanny.
+
+Two 4-connected neighbours make an edge if their depth difference
+is bigger than
+  min_jump + jump_factor * depth^2
+(depth being the nearer of both, in meters),
+as the noise of structured light sensors grows with the square of the depth.
+The farther pixel of the pair is marked as an edge,
+so that the regions of the foreground objects keep their full extent.
+The NaN pixels are edges too.
+
+Contrary to DepthCanny, there is no quantization to 8 bits,
+so the thresholds are metric and consistent across the frames,
+and the whole detection is one pass over the image.
+The output has the same format as DepthCanny::get_thresholded_image():
+0 for edges, 255 elsewhere.
+ */
+
+#ifndef DEPTH_JUMP_EDGES_H
+#define DEPTH_JUMP_EDGES_H
+
+#include <stdio.h>
+#include <cmath>
+#include <algorithm>
+#include <opencv2/core/core.hpp>
+#include <nan_handling.h>
+#include <span_tracer.h>
+
+class DepthJumpEdges {
+public:
+  //! the jump threshold at 0 meter (m)
+  static const double DEFAULT_MIN_JUMP = .03; // m
+  //! how the threshold grows with the square of the depth (1/m)
+  static const double DEFAULT_JUMP_FACTOR = .01; // 1/m
+
+  DepthJumpEdges() {
+    set_thresholds(DEFAULT_MIN_JUMP, DEFAULT_JUMP_FACTOR);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! cf the description of the class
+  inline void set_thresholds(const double min_jump, const double jump_factor) {
+    _min_jump = min_jump;
+    _jump_factor = jump_factor;
+  }
+  inline double get_min_jump() const { return _min_jump; }
+  inline double get_jump_factor() const { return _jump_factor; }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! \param depth_img a CV_32F depth image, in meters
+  void thresh(const cv::Mat & depth_img) {
+    TRACE_SPAN("DepthJumpEdges::thresh");
+    if (depth_img.empty() || depth_img.type() != CV_32FC1) {
+      printf("DepthJumpEdges::thresh(): expected a non empty CV_32FC1 image!\n");
+      return;
+    }
+    int rows = depth_img.rows, cols = depth_img.cols;
+    _edges.create(depth_img.size());
+    const float min_jump = _min_jump, jump_factor = _jump_factor;
+    if (rows > 0)
+      init_row(depth_img.ptr<float>(0), _edges.ptr<uchar>(0), cols);
+    for (int row = 0; row < rows; ++row) {
+      const float* depth_ptr = depth_img.ptr<float>(row);
+      uchar* edges_ptr = _edges.ptr<uchar>(row);
+      bool has_down = (row + 1 < rows);
+      const float* down_depth_ptr = (has_down ? depth_img.ptr<float>(row + 1) : NULL);
+      uchar* down_edges_ptr = (has_down ? _edges.ptr<uchar>(row + 1) : NULL);
+      // the row below can be marked by this row, initialize it first
+      if (has_down)
+        init_row(down_depth_ptr, down_edges_ptr, cols);
+      for (int col = 0; col < cols; ++col) {
+        float depth = depth_ptr[col];
+        if (image_utils::is_nan_depth(depth))
+          continue; // already an edge
+        // right neighbour
+        if (col + 1 < cols) {
+          float right = depth_ptr[col + 1];
+          if (!image_utils::is_nan_depth(right)) {
+            float nearer = std::min(depth, right);
+            if (std::fabs(right - depth) > min_jump + jump_factor * nearer * nearer) {
+              if (right > depth) edges_ptr[col + 1] = 0;
+              else               edges_ptr[col] = 0;
+            }
+          }
+        }
+        // down neighbour
+        if (has_down) {
+          float down = down_depth_ptr[col];
+          if (!image_utils::is_nan_depth(down)) {
+            float nearer = std::min(depth, down);
+            if (std::fabs(down - depth) > min_jump + jump_factor * nearer * nearer) {
+              if (down > depth) down_edges_ptr[col] = 0;
+              else              edges_ptr[col] = 0;
+            }
+          }
+        }
+      } // end loop col
+    } // end loop row
+  } // end thresh()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  inline const cv::Mat1b & get_thresholded_image() const {
+    return _edges;
+  }
+  inline       cv::Mat1b & get_thresholded_image() {
+    return _edges;
+  }
+
+private:
+  //! NaN -> edge (0), the rest is free (255)
+  static inline void init_row(const float* depth_ptr, uchar* edges_ptr, int cols) {
+    for (int col = 0; col < cols; ++col)
+      edges_ptr[col] = (image_utils::is_nan_depth(depth_ptr[col]) ? 0 : 255);
+  }
+
+  double _min_jump, _jump_factor;
+  cv::Mat1b _edges;
+}; // end class DepthJumpEdges
+
+#endif // DEPTH_JUMP_EDGES_H
@@ -0,0 +1,294 @@
+/*!
+  \file        frame_source.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+Sources of rgb and depth frames for the annotators.
+
+\class FrameSource
+The interface: a fixed number of frames, each with a unique name
+used as a prefix for its annotation files.
+
+\class ImageFileFrameSource
+The frames are pairs of "<prefix>_rgb.png", "<prefix>_depth.png" files
+(depth stored as uchar, cf cv_conversion_float_uchar.h).
+
+\class VideoFrameSource
+The frames are read from video containers with cv::VideoCapture,
+for instance lossless FFV1 recordings: one for rgb (optional),
+one for depth, with the depth stored as integers (by default in millimeters).
+Frames are decoded sequentially, with a seek on random access,
+and a decode-ahead buffer is filled when the GUI is idle,
+so that going to the next frame is usually a simple copy.
+Frame names are "<prefix>_frame000123".
+ */
+
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <opencv2/highgui/highgui.hpp>
+#include "cv_conversion_float_uchar.h"
+#include "span_tracer.h"
+
+namespace image_utils {
+
+class FrameSource {
+public:
+  virtual ~FrameSource() {}
+
+  virtual unsigned int nframes() const = 0;
+
+  //! the unique name of a frame, used as a prefix for its annotations
+  virtual const std::string & frame_name(unsigned int frame_idx) const = 0;
+
+  /*!
+   * \param rgb, depth (out)
+   *    the images of the frame, their buffers are reused if possible.
+   *    depth is in meters, CV_32F, with NAN_DEPTH for unknown values.
+   *    rgb is empty if the source has no rgb.
+   * \return true if success
+   */
+  virtual bool read_frame(unsigned int frame_idx, cv::Mat & rgb, cv::Mat & depth) = 0;
+
+  //! some work to do when the GUI is idle. \return true if something was done
+  virtual bool prefetch() { return false; }
+
+  //! a description of the prefetch state, for the HUD
+  virtual std::string state() const { return "prefetch:none"; }
+}; // end class FrameSource
+
+////////////////////////////////////////////////////////////////////////////////
+
+class ImageFileFrameSource : public FrameSource {
+public:
+  //! \param prefixes for instance "/tmp/test" for "/tmp/test_depth.png"
+  ImageFileFrameSource(const std::vector<std::string> & prefixes) :
+    _prefixes(prefixes) {}
+
+  virtual unsigned int nframes() const {
+    return _prefixes.size();
+  }
+  virtual const std::string & frame_name(unsigned int frame_idx) const {
+    return _prefixes[frame_idx];
+  }
+  //! for sequences written with a FixedDepthScale: one params file, read first
+  inline void set_sequence_params_first(bool first) {
+    _workspace.sequence_params_first = first;
+  }
+
+  virtual bool read_frame(unsigned int frame_idx, cv::Mat & rgb, cv::Mat & depth) {
+    if (frame_idx >= _prefixes.size())
+      return false;
+    // read depth and rgb, decoded into the buffers of the previous frame
+    if (!read_rgb_and_depth_image_from_image_file
+        (_prefixes[frame_idx], &rgb, &depth, FILE_PNG, &_workspace)) {
+      // rgb is optional: try again with depth only
+      rgb.release();
+      return read_rgb_and_depth_image_from_image_file
+          (_prefixes[frame_idx], NULL, &depth, FILE_PNG, &_workspace);
+    }
+    return true;
+  }
+
+private:
+  std::vector<std::string> _prefixes;
+  ImageIOWorkspace _workspace;
+}; // end class ImageFileFrameSource
+
+////////////////////////////////////////////////////////////////////////////////
+
+class VideoFrameSource : public FrameSource {
+public:
+  //! the number of decoded frames kept, the current one included
+  static const unsigned int DEFAULT_BUFFER_SIZE = 8;
+  //! meters per depth unit, for depth in millimeters
+  static const double DEFAULT_DEPTH_SCALE = 1E-3;
+
+  /*!
+   * \param rgb_filename
+   *    the rgb video, can be empty
+   * \param depth_filename
+   *    the depth video
+   * \param name_prefix
+   *    the frame names will be "<name_prefix>_frame000123"
+   * \param depth_scale
+   *    meters per unit of the depth video
+   * \param buffer_size
+   *    the number of decoded frames kept in memory
+   */
+  VideoFrameSource(const std::string & rgb_filename,
+                   const std::string & depth_filename,
+                   const std::string & name_prefix,
+                   double depth_scale = DEFAULT_DEPTH_SCALE,
+                   unsigned int buffer_size = DEFAULT_BUFFER_SIZE) :
+    _depth_scale(depth_scale), _slots(std::max(buffer_size, 2u)),
+    _current_idx(0), _next_decode_idx(0), _nframes(0)
+  {
+    _has_rgb = !rgb_filename.empty();
+    if (_has_rgb && !_rgb_capture.open(rgb_filename)) {
+      printf("VideoFrameSource: could not open rgb video '%s'\n", rgb_filename.c_str());
+      return;
+    }
+    if (!_depth_capture.open(depth_filename)) {
+      printf("VideoFrameSource: could not open depth video '%s'\n", depth_filename.c_str());
+      return;
+    }
+    // keep the raw depth values instead of 8-bit BGR, when the backend allows it
+    _depth_capture.set(CV_CAP_PROP_CONVERT_RGB, 0);
+    double nframes = _depth_capture.get(CV_CAP_PROP_FRAME_COUNT);
+    if (_has_rgb) {
+      double rgb_nframes = _rgb_capture.get(CV_CAP_PROP_FRAME_COUNT);
+      if (rgb_nframes != nframes)
+        printf("VideoFrameSource: %g rgb frames but %g depth frames, "
+               "using the shortest\n", rgb_nframes, nframes);
+      nframes = std::min(nframes, rgb_nframes);
+    }
+    if (nframes <= 0) {
+      printf("VideoFrameSource: could not get the number of frames of '%s'\n",
+             depth_filename.c_str());
+      return;
+    }
+    _nframes = nframes;
+    _names.reserve(_nframes);
+    char suffix[32];
+    for (unsigned int frame_idx = 0; frame_idx < _nframes; ++frame_idx) {
+      snprintf(suffix, sizeof(suffix), "_frame%06u", frame_idx);
+      _names.push_back(name_prefix + suffix);
+    }
+    printf("VideoFrameSource: %u frames in '%s'\n", _nframes, depth_filename.c_str());
+  } // end ctor
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  virtual unsigned int nframes() const {
+    return _nframes;
+  }
+  virtual const std::string & frame_name(unsigned int frame_idx) const {
+    return _names[frame_idx];
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  virtual bool read_frame(unsigned int frame_idx, cv::Mat & rgb, cv::Mat & depth) {
+    TRACE_SPAN("VideoFrameSource::read_frame");
+    if (frame_idx >= _nframes)
+      return false;
+    _current_idx = frame_idx;
+    Slot & slot = _slots[frame_idx % _slots.size()];
+    if (slot.frame_idx != (int) frame_idx && !decode(frame_idx))
+      return false;
+    if (_has_rgb)
+      slot.rgb.copyTo(rgb);
+    else
+      rgb.release();
+    slot.depth.copyTo(depth);
+    return true;
+  } // end read_frame()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! decode the next missing frame after the current one, if any
+  virtual bool prefetch() {
+    for (unsigned int ahead = 1; ahead < _slots.size(); ++ahead) {
+      unsigned int frame_idx = _current_idx + ahead;
+      if (frame_idx >= _nframes)
+        return false;
+      if (_slots[frame_idx % _slots.size()].frame_idx != (int) frame_idx) {
+        TRACE_SPAN("VideoFrameSource::prefetch");
+        return decode(frame_idx);
+      }
+    } // end loop ahead
+    return false;
+  } // end prefetch()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  virtual std::string state() const {
+    unsigned int nahead = 0;
+    while (nahead + 1 < _slots.size()) {
+      unsigned int frame_idx = _current_idx + nahead + 1;
+      if (_slots[frame_idx % _slots.size()].frame_idx != (int) frame_idx)
+        break;
+      ++nahead;
+    }
+    char ans[64];
+    snprintf(ans, sizeof(ans), "prefetch:%u/%u frames ahead",
+             nahead, (unsigned int) _slots.size() - 1);
+    return ans;
+  }
+
+private:
+  //! a decoded frame
+  struct Slot {
+    Slot() : frame_idx(-1) {}
+    int frame_idx; //!< -1 if empty
+    cv::Mat rgb, depth;
+  };
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! decode a frame into its slot, seeking if it is not the next one
+  bool decode(unsigned int frame_idx) {
+    TRACE_SPAN("VideoFrameSource::decode");
+    if (frame_idx != _next_decode_idx) {
+      TRACE_SPAN("VideoFrameSource::decode(): seek");
+      if (_has_rgb)
+        _rgb_capture.set(CV_CAP_PROP_POS_FRAMES, frame_idx);
+      _depth_capture.set(CV_CAP_PROP_POS_FRAMES, frame_idx);
+    }
+    Slot & slot = _slots[frame_idx % _slots.size()];
+    slot.frame_idx = -1;
+    _next_decode_idx = frame_idx + 1;
+    if ((_has_rgb && !_rgb_capture.read(slot.rgb))
+        || !_depth_capture.read(_raw_depth)) {
+      printf("VideoFrameSource: could not decode frame %u\n", frame_idx);
+      _next_decode_idx = _nframes; // force a seek next time
+      return false;
+    }
+    // depth units -> meters. 0 stays 0 = NAN_DEPTH
+    if (_raw_depth.channels() > 1) { // grey depth converted to BGR by the backend
+      cv::extractChannel(_raw_depth, _raw_depth_channel, 0);
+      _raw_depth_channel.convertTo(slot.depth, CV_32F, _depth_scale);
+    }
+    else
+      _raw_depth.convertTo(slot.depth, CV_32F, _depth_scale);
+    slot.frame_idx = frame_idx;
+    return true;
+  } // end decode()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  cv::VideoCapture _rgb_capture, _depth_capture;
+  bool _has_rgb;
+  double _depth_scale;
+  std::vector<Slot> _slots; //!< frame i is in _slots[i % size]
+  cv::Mat _raw_depth, _raw_depth_channel;
+  unsigned int _current_idx; //!< the last frame read with read_frame()
+  unsigned int _next_decode_idx; //!< the frame the captures will decode next
+  unsigned int _nframes;
+  std::vector<std::string> _names;
+}; // end class VideoFrameSource
+
+} // end namespace image_utils
+
+#endif // FRAME_SOURCE_H
@@ -0,0 +1,104 @@
+/*!
+  \file        generate_button_icons.cpp
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+A build-time tool: read the button icons, resize them to the button size
+and write them as BGR pixel arrays in a header,
+so that ContourImageAnnotator builds its buttons without any file I/O,
+wherever the binary is.
+
+Synopsis:
+$ generate_button_icons OUTPUT_HEADER SIZE ICON_FOLDER NAME...
+reads "ICON_FOLDER/NAME.png" for each NAME.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+int main(int argc, char** argv) {
+  if (argc < 5) {
+    printf("Synopsis: %s OUTPUT_HEADER SIZE ICON_FOLDER NAME...\n", argv[0]);
+    return -1;
+  }
+  std::string output_filename(argv[1]), folder(argv[3]);
+  int size = atoi(argv[2]);
+  if (size <= 0) {
+    printf("generate_button_icons: invalid size '%s'\n", argv[2]);
+    return -1;
+  }
+  FILE* out = fopen(output_filename.c_str(), "w");
+  if (out == NULL) {
+    printf("generate_button_icons: could not write '%s'\n", output_filename.c_str());
+    return -1;
+  }
+  fprintf(out, "/*!\n"
+          " * \\file button_icons.h\n"
+          " * Generated by generate_button_icons from the icons, do not edit.\n"
+          " * Each icon is %i x %i, BGR, row-major.\n"
+          " */\n"
+          "#ifndef BUTTON_ICONS_H\n"
+          "#define BUTTON_ICONS_H\n\n"
+          "#include <string.h>\n\n"
+          "static const int BUTTON_ICONS_SIZE = %i;\n\n", size, size, size);
+  cv::Mat3b icon_resized;
+  for (int i = 4; i < argc; ++i) {
+    std::string filename = folder + "/" + argv[i] + ".png";
+    cv::Mat3b icon = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
+    if (icon.empty()) { // fail the build rather than showing garbage
+      printf("generate_button_icons: could not read '%s'\n", filename.c_str());
+      fclose(out);
+      remove(output_filename.c_str());
+      return -1;
+    }
+    cv::resize(icon, icon_resized, cv::Size(size, size), 0, 0, cv::INTER_AREA);
+    fprintf(out, "static const unsigned char BUTTON_ICON_%s[%i] = {", argv[i], size * size * 3);
+    int nvalues = 0;
+    for (int row = 0; row < size; ++row) {
+      const uchar* icon_ptr = icon_resized.ptr<uchar>(row);
+      for (int col = 0; col < 3 * size; ++col, ++nvalues)
+        fprintf(out, "%s%i,", (nvalues % 24 == 0 ? "\n  " : ""), icon_ptr[col]);
+    } // end loop row
+    fprintf(out, "\n};\n\n");
+  } // end loop i
+  // the lookup by name
+  fprintf(out, "struct ButtonIcon {\n"
+          "  const char* name;\n"
+          "  const unsigned char* bgr;\n"
+          "};\n"
+          "static const ButtonIcon BUTTON_ICONS[] = {\n");
+  for (int i = 4; i < argc; ++i)
+    fprintf(out, "  {\"%s\", BUTTON_ICON_%s},\n", argv[i], argv[i]);
+  fprintf(out, "  {NULL, NULL}\n"
+          "};\n\n"
+          "//! \\return the pixels of the icon, NULL if there is none with that name\n"
+          "inline const unsigned char* find_button_icon(const char* name) {\n"
+          "  for (const ButtonIcon* icon = BUTTON_ICONS; icon->name != NULL; ++icon)\n"
+          "    if (strcmp(icon->name, name) == 0)\n"
+          "      return icon->bgr;\n"
+          "  return NULL;\n"
+          "}\n\n"
+          "#endif // BUTTON_ICONS_H\n");
+  fclose(out);
+  printf("Wrote %i icons in '%s'\n", argc - 4, output_filename.c_str());
+  return 0;
+}
@@ -34,6 +34,7 @@ ________________________________________________________________________________
 #include <pcl/sample_consensus/method_types.h>
 #include <pcl/sample_consensus/model_types.h>
 #include <pcl/segmentation/sac_segmentation.h>
+#include "span_tracer.h"
 // http://blog.martinperis.com/2012/01/3d-reconstruction-with-opencv-and-point.html
 // http://docs.pointclouds.org/trunk/classpcl_1_1_range_image.html
 // http://pointclouds.org/documentation/tutorials/range_image_creation.php
@@ -69,6 +70,7 @@ public:
                      double distance_threshold_m = DEFAULT_DISTANCE_THRESHOLD_M,
                      double lower_ratio_to_use = DEFAULT_LOWER_RATIO_TO_USE,
                      int data_skip = DEFAULT_DATA_SKIP) {
+    TRACE_SPAN("GroundPlaneFinder::compute_plane");
     // use only second half of the image
     if (depth.rows == 0) {
       printf("GroundPlaneFinder:depth image too small!\n");
@@ -154,6 +156,7 @@ public:
               double min_dist = -1, double max_dist = -1,
               double distance_threshold_m = 0.05,
               bool mark_if_ground = true) const {
+    TRACE_SPAN("GroundPlaneFinder::to_img");
     img.create(depth.size());
     img.setTo(0);
     if (!_plane_found) {
@@ -0,0 +1,307 @@
+/*!
+  \file        label_propagation.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+\class LabelPropagator
+Pre-fill the user image of a frame with the labels of the previous frame,
+consecutive frames of a recording being nearly identical.
+
+The labels of the previous frame are stored once as color indices.
+The free regions of the new contour image are labelled with scanline floodfills,
+then a single pass fills the overlap table:
+for each new region and each previous label, the number of pixels
+of the region having that label in the previous frame,
+and, if both depths are given, a depth change below max_depth_change.
+A region whose best label covers at least min_overlap of it gets that label,
+a second pass paints the chosen labels.
+So the matching is done on the table, (number of regions x number of colors),
+and the whole propagation is three passes over the image.
+ */
+
+#ifndef LABEL_PROPAGATION_H
+#define LABEL_PROPAGATION_H
+
+#include <cmath>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "scanline_floodfill.h"
+#include "nan_handling.h"
+#include "span_tracer.h"
+
+namespace image_utils {
+
+class LabelPropagator {
+public:
+  //! the min part of a region with the same previous label for propagating it
+  static const double DEFAULT_MIN_OVERLAP = .5;
+  //! the max depth change of a pixel for counting its previous label (m)
+  static const double DEFAULT_MAX_DEPTH_CHANGE = .05; // m
+  //! the regions smaller than that are not pre-filled (pixels)
+  static const int MIN_REGION_SIZE = 16;
+
+  /*!
+   * \param palette, ncolors
+   *    the colors of the labels, the other colors of the user images are ignored
+   */
+  LabelPropagator(const cv::Scalar* palette, unsigned int ncolors) :
+    _min_overlap(DEFAULT_MIN_OVERLAP), _max_depth_change(DEFAULT_MAX_DEPTH_CHANGE),
+    _has_previous(false), _last_ms(0) {
+    for (unsigned int i = 0; i < ncolors; ++i) {
+      cv::Vec3b color(palette[i][0], palette[i][1], palette[i][2]);
+      if (color != cv::Vec3b(0, 0, 0)) // black: not annotated
+        _palette.push_back(color);
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  inline void set_thresholds(double min_overlap, double max_depth_change) {
+    _min_overlap = min_overlap;
+    _max_depth_change = max_depth_change;
+  }
+  inline bool has_previous() const { return _has_previous; }
+  inline void forget() { _has_previous = false; }
+  //! the duration of the last propagate() (ms)
+  inline double get_last_ms() const { return _last_ms; }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Allocate the image-sized workspaces of propagate() for a size of image.
+   * The per-region tables still grow with the number of regions of a frame.
+   */
+  void reserve(const cv::Size & size) {
+    _contours_buffer.create(size);
+    _regions.create(size);
+    _seeds.reserve(scanline_floodfill_buffer_size(size));
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Store the labels of a frame, before going to the next one.
+   * \param depth
+   *    its CV_32F depth in meters, NULL or empty for no depth consistency
+   */
+  void remember(const cv::Mat3b & user_image, const cv::Mat* depth = NULL) {
+    TRACE_SPAN("LabelPropagator::remember");
+    _prev_labels.create(user_image.size());
+    unsigned int nlabels = 0;
+    for (int row = 0; row < user_image.rows; ++row) {
+      const cv::Vec3b* user_ptr = user_image.ptr<cv::Vec3b>(row);
+      uchar* labels_ptr = _prev_labels.ptr<uchar>(row);
+      cv::Vec3b last_color(0, 0, 0);
+      uchar last_label = 0;
+      for (int col = 0; col < user_image.cols; ++col) {
+        // the labels come in runs: only search the palette when the color changes
+        if (user_ptr[col] != last_color) {
+          last_color = user_ptr[col];
+          last_label = color_to_label(last_color);
+        }
+        labels_ptr[col] = last_label;
+        nlabels += (last_label != 0);
+      }
+    } // end loop row
+    if (depth && !depth->empty() && depth->type() == CV_32FC1
+        && depth->size() == user_image.size())
+      depth->copyTo(_prev_depth);
+    else
+      _prev_depth.release();
+    _has_previous = (nlabels > 0);
+  } // end remember()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Paint the labels of the previous frame on the matching regions.
+   * Only the unlabelled pixels of user_image are painted.
+   * \param contours
+   *    the contour image of the new frame, 255 for the free pixels
+   * \param depth
+   *    the depth of the new frame, cf remember()
+   * \return the number of pre-filled regions
+   */
+  unsigned int propagate(const cv::Mat1b & contours, const cv::Mat* depth,
+                         cv::Mat3b & user_image) {
+    if (!_has_previous || contours.size() != _prev_labels.size()
+        || user_image.size() != contours.size())
+      return 0;
+    TRACE_SPAN("LabelPropagator::propagate");
+    int64 begin_ticks = cv::getTickCount();
+    unsigned int nregions = label_regions(contours);
+    fill_overlap_table(nregions, depth);
+    unsigned int nfilled = choose_labels(nregions);
+    if (nfilled > 0)
+      paint_labels(user_image);
+    _last_ms = 1000. * (cv::getTickCount() - begin_ticks) / cv::getTickFrequency();
+    return nfilled;
+  } // end propagate()
+
+  //! the number of free regions of the last propagate()
+  inline unsigned int nregions() const { return _region_labels.size(); }
+
+  /*!
+   * After propagate(): \return true if a region was pre-filled,
+   * with a pixel of it and its color, for instance to replay it as a floodfill
+   */
+  bool filled_region(unsigned int region, cv::Point & seed, cv::Vec3b & color) const {
+    if (region >= _region_labels.size() || _region_labels[region] == 0)
+      return false;
+    seed = _region_seeds[region];
+    color = _palette[_region_labels[region] - 1];
+    return true;
+  }
+
+private:
+  //! 0 if not in the palette
+  inline uchar color_to_label(const cv::Vec3b & color) const {
+    for (unsigned int i = 0; i < _palette.size(); ++i)
+      if (_palette[i] == color)
+        return i + 1;
+    return 0;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! a span visitor writing the index of the region in the region image
+  struct RegionPainter {
+    RegionPainter(cv::Mat1i & regions, int region) : _regions(regions), _region(region) {}
+    inline void operator()(int row, int col_begin, int col_end) {
+      int* regions_ptr = _regions.ptr<int>(row);
+      for (int col = col_begin; col < col_end; ++col)
+        regions_ptr[col] = _region;
+    }
+    cv::Mat1i & _regions;
+    int _region;
+  };
+
+  //! _regions: the index of the free region of each pixel, -1 for the edges
+  unsigned int label_regions(const cv::Mat1b & contours) {
+    TRACE_SPAN("LabelPropagator::label_regions");
+    contours.copyTo(_contours_buffer);
+    _regions.create(contours.size());
+    _regions.setTo(-1);
+    _region_sizes.clear();
+    _region_seeds.clear();
+    for (int row = 0; row < _contours_buffer.rows; ++row) {
+      const uchar* buffer_ptr = _contours_buffer.ptr<uchar>(row);
+      for (int col = 0; col < _contours_buffer.cols; ++col) {
+        if (buffer_ptr[col] != 255)
+          continue;
+        RegionPainter painter(_regions, _region_sizes.size());
+        _region_seeds.push_back(cv::Point(col, row));
+        _region_sizes.push_back
+            (scanline_floodfill(_contours_buffer, cv::Point(col, row), 254,
+                                _seeds, painter));
+      } // end loop col
+    } // end loop row
+    return _region_sizes.size();
+  } // end label_regions()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! _overlap[region * nlabels + label]: the consistent pixels of the region with label
+  void fill_overlap_table(unsigned int nregions, const cv::Mat* depth) {
+    TRACE_SPAN("LabelPropagator::fill_overlap_table");
+    unsigned int nlabels = _palette.size() + 1;
+    _overlap.assign(nregions * nlabels, 0);
+    bool use_depth = (depth && !_prev_depth.empty() && depth->type() == CV_32FC1
+                      && depth->size() == _prev_depth.size());
+    const float max_depth_change = _max_depth_change;
+    for (int row = 0; row < _regions.rows; ++row) {
+      const int* regions_ptr = _regions.ptr<int>(row);
+      const uchar* labels_ptr = _prev_labels.ptr<uchar>(row);
+      const float* depth_ptr = (use_depth ? depth->ptr<float>(row) : NULL);
+      const float* prev_depth_ptr = (use_depth ? _prev_depth.ptr<float>(row) : NULL);
+      for (int col = 0; col < _regions.cols; ++col) {
+        if (regions_ptr[col] < 0 || labels_ptr[col] == 0)
+          continue;
+        if (use_depth
+            && (is_nan_depth(depth_ptr[col]) || is_nan_depth(prev_depth_ptr[col])
+                || std::fabs(depth_ptr[col] - prev_depth_ptr[col]) > max_depth_change))
+          continue; // the object moved
+        ++_overlap[regions_ptr[col] * nlabels + labels_ptr[col]];
+      } // end loop col
+    } // end loop row
+  } // end fill_overlap_table()
+
+  //! _region_labels: the label given to each region, 0 for none. \return nb of labelled regions
+  unsigned int choose_labels(unsigned int nregions) {
+    unsigned int nlabels = _palette.size() + 1, nfilled = 0;
+    _region_labels.assign(nregions, 0);
+    for (unsigned int region = 0; region < nregions; ++region) {
+      int size = _region_sizes[region];
+      if (size < MIN_REGION_SIZE)
+        continue;
+      const int* overlap_ptr = &(_overlap[region * nlabels]);
+      int best_count = 0;
+      for (unsigned int label = 1; label < nlabels; ++label) {
+        if (overlap_ptr[label] > best_count) {
+          best_count = overlap_ptr[label];
+          _region_labels[region] = label;
+        }
+      }
+      if (best_count < _min_overlap * size)
+        _region_labels[region] = 0;
+      else
+        ++nfilled;
+    } // end loop region
+    return nfilled;
+  } // end choose_labels()
+
+  void paint_labels(cv::Mat3b & user_image) const {
+    TRACE_SPAN("LabelPropagator::paint_labels");
+    const cv::Vec3b black(0, 0, 0);
+    for (int row = 0; row < _regions.rows; ++row) {
+      const int* regions_ptr = _regions.ptr<int>(row);
+      cv::Vec3b* user_ptr = user_image.ptr<cv::Vec3b>(row);
+      for (int col = 0; col < _regions.cols; ++col) {
+        if (regions_ptr[col] < 0 || user_ptr[col] != black)
+          continue;
+        uchar label = _region_labels[regions_ptr[col]];
+        if (label)
+          user_ptr[col] = _palette[label - 1];
+      } // end loop col
+    } // end loop row
+  } // end paint_labels()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  std::vector<cv::Vec3b> _palette; //!< label i + 1 -> color _palette[i]
+  double _min_overlap, _max_depth_change;
+  bool _has_previous;
+  double _last_ms;
+  // the previous frame
+  cv::Mat1b _prev_labels;
+  cv::Mat1f _prev_depth;
+  // workspaces
+  cv::Mat1b _contours_buffer;
+  cv::Mat1i _regions;
+  std::vector<cv::Point> _seeds;
+  std::vector<int> _region_sizes;
+  std::vector<cv::Point> _region_seeds; //!< the first pixel of each region
+  std::vector<int> _overlap;
+  std::vector<uchar> _region_labels;
+}; // end class LabelPropagator
+
+} // end namespace image_utils
+
+#endif // LABEL_PROPAGATION_H
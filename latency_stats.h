@@ -0,0 +1,112 @@
+/*!
+  \file        latency_stats.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+Rolling latency statistics (percentiles and max) over the last samples.
+ */
+
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <algorithm>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+class LatencyStats {
+public:
+  static const unsigned int DEFAULT_WINDOW_SIZE = 128;
+
+  //! all the buffers are allocated here, add() never allocates
+  LatencyStats(unsigned int window_size = DEFAULT_WINDOW_SIZE) :
+    _samples(std::max(window_size, 1u)), _sorted(_samples.size()) {
+    clear();
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  inline void clear() {
+    _next = _nsamples = 0;
+    _total_count = 0;
+    _total_ms = _max_ever_ms = 0;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  inline void add(double latency_ms) {
+    _samples[_next] = latency_ms;
+    _next = (_next + 1) % _samples.size();
+    if (_nsamples < _samples.size())
+      ++_nsamples;
+    ++_total_count;
+    _total_ms += latency_ms;
+    _max_ever_ms = std::max(_max_ever_ms, latency_ms);
+  }
+
+  /*!
+   * Add the time elapsed since begin_ticks, obtained with cv::getTickCount().
+   * \return that time (ms)
+   */
+  inline double add_since(int64 begin_ticks) {
+    double latency_ms = 1000. * (cv::getTickCount() - begin_ticks) / cv::getTickFrequency();
+    add(latency_ms);
+    return latency_ms;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * \param p
+   *    in [0, 1], for instance .95 for the 95th percentile
+   * \return the p-th percentile of the samples of the window, 0 if no sample
+   */
+  inline double percentile(double p) const {
+    if (_nsamples == 0)
+      return 0;
+    std::copy(_samples.begin(), _samples.begin() + _nsamples, _sorted.begin());
+    unsigned int rank = std::min((unsigned int) (p * _nsamples), _nsamples - 1);
+    std::nth_element(_sorted.begin(), _sorted.begin() + rank,
+                     _sorted.begin() + _nsamples);
+    return _sorted[rank];
+  }
+
+  //! the max of the samples of the window
+  inline double max() const {
+    if (_nsamples == 0)
+      return 0;
+    return *std::max_element(_samples.begin(), _samples.begin() + _nsamples);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  inline unsigned int window_count() const { return _nsamples; }
+  inline unsigned int total_count() const { return _total_count; }
+  inline double total_ms() const { return _total_ms; }
+  inline double max_ever_ms() const { return _max_ever_ms; }
+
+private:
+  std::vector<double> _samples; //!< ring buffer of the last samples
+  mutable std::vector<double> _sorted; //!< buffer for percentile()
+  unsigned int _next, _nsamples;
+  unsigned int _total_count;
+  double _total_ms, _max_ever_ms;
+}; // end class LatencyStats
+
+#endif // LATENCY_STATS_H
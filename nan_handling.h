@@ -26,7 +26,10 @@ Some functions to remove or store NaNs in images.
 #ifndef NAN_HANDLING_H
 #define NAN_HANDLING_H
 
-#include <boost/unordered_set.hpp>
+#include <stdio.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
 #include <opencv2/core/core.hpp>
 
 namespace image_utils {
@@ -112,38 +115,268 @@ inline void remove_nans_and_minmax(cv::Mat & img,
 
 ////////////////////////////////////////////////////////////////////////////////
 
-/*! store all NaN in a matrix, and perform a min/max search.
+/*!
+ * The positions of the NaN of an image, one bit per value.
+ * The index of a value is row * (cols * channels) + col * channels + channel.
+ * 20-40% of NaN in a 640x480 frame take 38 kB, in a single allocation
+ * kept between the frames.
+ */
+class NanBitset {
+public:
+  typedef unsigned int Word;
+  static const unsigned int WORD_BITS = 32;
+
+  NanBitset() : _nvalues(0) {}
+
+  //! make room for nvalues values, all of them not NaN
+  inline void reset(unsigned int nvalues) {
+    _nvalues = nvalues;
+    _words.assign((nvalues + WORD_BITS - 1) / WORD_BITS, 0);
+  }
+  inline unsigned int nvalues() const { return _nvalues; }
+  inline void set(unsigned int idx) {
+    _words[idx / WORD_BITS] |= (Word) 1 << (idx % WORD_BITS);
+  }
+  inline bool test(unsigned int idx) const {
+    return (_words[idx / WORD_BITS] >> (idx % WORD_BITS)) & 1;
+  }
+  //! the number of NaN
+  inline unsigned int count() const {
+    unsigned int ans = 0;
+    for (unsigned int i = 0; i < _words.size(); ++i)
+      ans += __builtin_popcount(_words[i]);
+    return ans;
+  }
+  //! append the indices of the NaN to indices, in increasing order
+  inline void to_indices(std::vector<unsigned int> & indices) const {
+    for (unsigned int word_idx = 0; word_idx < _words.size(); ++word_idx) {
+      Word word = _words[word_idx];
+      while (word != 0) {
+        indices.push_back(word_idx * WORD_BITS + __builtin_ctz(word));
+        word &= word - 1; // clear lowest set bit
+      }
+    }
+  }
+  inline const std::vector<Word> & words() const { return _words; }
+  inline       std::vector<Word> & words()       { return _words; }
+
+private:
+  std::vector<Word> _words;
+  unsigned int _nvalues;
+}; // end class NanBitset
+
+////////////////////////////////////////////////////////////////////////////////
+
+//! a run of consecutive NaN values [begin, end[, indices as for NanBitset
+struct NanRun {
+  unsigned int begin, end;
+};
+/*!
+ * The positions of the NaN of an image, as sorted runs.
+ * More compact than NanBitset when the holes are big blobs,
+ * as Kinect shadows are.
+ */
+typedef std::vector<NanRun> NanRuns;
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*! store all NaN of a matrix, and perform a min/max search, in a single pass.
   Template<_T>: the basic type of the mat, ex float for cv::Mat3f
+  The NaN bits are accumulated in a register word, written once every
+  NanBitset::WORD_BITS values, and the min/max are updated without
+  data-dependent branches.
  \param img
-    the image to clean
+    the image, not modified
  \param min_val, max_val
-    output: the min and max values of img (NaN excluded of course)
+    output: the min and max values of img (NaN excluded of course),
+    0 if img only contains NaN
+ \param nans (out)
+    the positions of the NaN
+ \param clean (out)
+    if not NULL, a copy of img with the NaN replaced by new_val,
+    written in the same pass. Can be &img.
  \param new_val
-    what to put instead of the NaN
+    what to put instead of the NaN in clean
 */
 template<class _BasicType>
-inline void store_nans_and_minmax_set(const cv::Mat & img,
-                                      _BasicType & min_val, _BasicType & max_val,
-                                      boost::unordered_set<unsigned int> & src_nan_indices) {
-  int values_per_row = img.cols * img.channels();
-  min_val = std::numeric_limits<_BasicType>::max();
-  max_val = -std::numeric_limits<_BasicType>::max();
-  src_nan_indices.clear();
+inline void store_nans_and_minmax_bitset(const cv::Mat & img,
+                                         _BasicType & min_val, _BasicType & max_val,
+                                         NanBitset & nans,
+                                         cv::Mat* clean = NULL,
+                                         _BasicType new_val = (_BasicType)(0)) {
+  unsigned int values_per_row = img.cols * img.channels();
+  nans.reset(values_per_row * img.rows);
+  if (clean != NULL && clean->data != img.data)
+    clean->create(img.size(), img.type());
+  _BasicType min_et = std::numeric_limits<_BasicType>::max();
+  _BasicType max_et = -std::numeric_limits<_BasicType>::max();
+  std::vector<NanBitset::Word> & words = nans.words();
+  NanBitset::Word word = 0; // the word being filled
+  unsigned int word_idx = 0, bit = 0;
   for (int row = 0; row < img.rows; ++row) {
-    // get the address of row
     const _BasicType* src_ptr = img.ptr<_BasicType>(row);
-    // change each value
-    for (int col = 0; col < values_per_row; ++col) {
-      if (is_nan_depth(*src_ptr))
-        src_nan_indices.insert(col + row * values_per_row);
-      else if (min_val > *src_ptr)
-        min_val = *src_ptr;
-      else if (max_val < *src_ptr)
-        max_val = *src_ptr;
-      ++src_ptr;
+    _BasicType* clean_ptr = (clean != NULL ? clean->ptr<_BasicType>(row) : NULL);
+    for (unsigned int col = 0; col < values_per_row; ++col) {
+      _BasicType val = src_ptr[col];
+      bool nan = is_nan_depth(val);
+      word |= (NanBitset::Word) nan << bit;
+      min_et = (!nan && val < min_et ? val : min_et);
+      max_et = (!nan && val > max_et ? val : max_et);
+      if (clean_ptr)
+        clean_ptr[col] = (nan ? new_val : val);
+      if (++bit == NanBitset::WORD_BITS) {
+        words[word_idx++] = word;
+        word = 0;
+        bit = 0;
+      }
     } // end loop col
   } // end loop row
-} // end store_nans_and_minmax_set()
+  if (bit > 0)
+    words[word_idx] = word;
+  if (min_et > max_et) // only NaN
+    min_et = max_et = 0;
+  min_val = min_et;
+  max_val = max_et;
+} // end store_nans_and_minmax_bitset()
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*! store all NaN of a matrix as runs, and perform a min/max search, in a single pass.
+  Template<_T>: the basic type of the mat, ex float for cv::Mat3f
+ \param img, min_val, max_val, clean, new_val
+    \see store_nans_and_minmax_bitset()
+ \param nans (out)
+    the runs of NaN, sorted
+*/
+template<class _BasicType>
+inline void store_nans_and_minmax_runs(const cv::Mat & img,
+                                       _BasicType & min_val, _BasicType & max_val,
+                                       NanRuns & nans,
+                                       cv::Mat* clean = NULL,
+                                       _BasicType new_val = (_BasicType)(0)) {
+  unsigned int values_per_row = img.cols * img.channels();
+  nans.clear();
+  if (clean != NULL && clean->data != img.data)
+    clean->create(img.size(), img.type());
+  _BasicType min_et = std::numeric_limits<_BasicType>::max();
+  _BasicType max_et = -std::numeric_limits<_BasicType>::max();
+  bool in_run = false;
+  NanRun run;
+  unsigned int idx = 0;
+  for (int row = 0; row < img.rows; ++row) {
+    const _BasicType* src_ptr = img.ptr<_BasicType>(row);
+    _BasicType* clean_ptr = (clean != NULL ? clean->ptr<_BasicType>(row) : NULL);
+    for (unsigned int col = 0; col < values_per_row; ++col, ++idx) {
+      _BasicType val = src_ptr[col];
+      if (clean_ptr)
+        clean_ptr[col] = (is_nan_depth(val) ? new_val : val);
+      if (is_nan_depth(val)) {
+        if (!in_run) {
+          run.begin = idx;
+          in_run = true;
+        }
+        continue;
+      }
+      if (in_run) {
+        run.end = idx;
+        nans.push_back(run);
+        in_run = false;
+      }
+      min_et = (val < min_et ? val : min_et);
+      max_et = (val > max_et ? val : max_et);
+    } // end loop col
+  } // end loop row
+  if (in_run) {
+    run.end = idx;
+    nans.push_back(run);
+  }
+  if (min_et > max_et) // only NaN
+    min_et = max_et = 0;
+  min_val = min_et;
+  max_val = max_et;
+} // end store_nans_and_minmax_runs()
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*! set the values of a matrix at the positions of a NanBitset.
+  Template<_T>: the basic type of the mat, ex float for cv::Mat3f
+  Words without NaN are skipped, so the cost depends on the number of NaN.
+ \param img
+    the image to modify, same size as when the NaN were stored
+ \param nans
+    the positions of the NaN
+ \param nan_val
+    the value to write, for instance NAN_DEPTH
+*/
+template<class _BasicType>
+inline void restore_nans(cv::Mat & img, const NanBitset & nans,
+                         const _BasicType nan_val = (_BasicType)(0)) {
+  unsigned int values_per_row = img.cols * img.channels();
+  if (nans.nvalues() != values_per_row * img.rows) {
+    printf("restore_nans(): %i values in image, but %i in bitset!\n",
+           values_per_row * img.rows, nans.nvalues());
+    return;
+  }
+  const std::vector<NanBitset::Word> & words = nans.words();
+  for (unsigned int word_idx = 0; word_idx < words.size(); ++word_idx) {
+    NanBitset::Word word = words[word_idx];
+    while (word != 0) {
+      unsigned int idx = word_idx * NanBitset::WORD_BITS + __builtin_ctz(word);
+      img.ptr<_BasicType>(idx / values_per_row)[idx % values_per_row] = nan_val;
+      word &= word - 1; // clear lowest set bit
+    }
+  } // end loop word_idx
+} // end restore_nans()
+
+/*! set the values of a matrix in NaN runs.
+  Template<_T>: the basic type of the mat, ex float for cv::Mat3f
+  \see restore_nans()
+*/
+template<class _BasicType>
+inline void restore_nans(cv::Mat & img, const NanRuns & nans,
+                         const _BasicType nan_val = (_BasicType)(0)) {
+  unsigned int values_per_row = img.cols * img.channels();
+  for (unsigned int run_idx = 0; run_idx < nans.size(); ++run_idx) {
+    // a run can span several rows
+    unsigned int idx = nans[run_idx].begin, end = nans[run_idx].end;
+    while (idx < end) {
+      unsigned int row = idx / values_per_row, col = idx % values_per_row;
+      unsigned int row_end = std::min(end, (row + 1) * values_per_row);
+      _BasicType* img_ptr = img.ptr<_BasicType>(row);
+      std::fill(img_ptr + col, img_ptr + col + (row_end - idx), nan_val);
+      idx = row_end;
+    }
+  } // end loop run_idx
+} // end restore_nans()
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*! remove all NaN in a matrix, store their positions and perform a min/max search,
+  in a single pass.
+  Template<_T>: the basic type of the mat, ex float for cv::Mat3f
+ \param img
+    the image to clean
+ \param min_val, max_val, nans
+    \see store_nans_and_minmax_bitset()
+ \param new_val
+    what to put instead of the NaN
+*/
+template<class _BasicType>
+inline void remove_nans_and_minmax_bitset(cv::Mat & img,
+                                          _BasicType & min_val, _BasicType & max_val,
+                                          NanBitset & nans,
+                                          _BasicType new_val = (_BasicType)(0)) {
+  store_nans_and_minmax_bitset(img, min_val, max_val, nans, &img, new_val);
+} // end remove_nans_and_minmax_bitset()
+
+//! the same with NaN runs. \see remove_nans_and_minmax_bitset()
+template<class _BasicType>
+inline void remove_nans_and_minmax_runs(cv::Mat & img,
+                                        _BasicType & min_val, _BasicType & max_val,
+                                        NanRuns & nans,
+                                        _BasicType new_val = (_BasicType)(0)) {
+  store_nans_and_minmax_runs(img, min_val, max_val, nans, &img, new_val);
+} // end remove_nans_and_minmax_runs()
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -0,0 +1,259 @@
+/*!
+  \file        normal_edges.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+\class NormalEdges
+An edge detector for the creases of depth images, that is the boundaries
+where the depth is continuous but the surface orientation changes,
+for instance feet on the floor or a hand on a table.
+Depth jumps are left to DepthCanny or DepthJumpEdges.
+
+The depth image is back-projected into 3D points, whose integral images
+give the mean point of any window in O(1).
+The normal of a pixel is the cross product of two tangents:
+(mean of the right window - mean of the left window) and
+(mean of the bottom window - mean of the top window)
+("average 3D gradient", as in the PCL IntegralImageNormalEstimation).
+The cost thus does not depend on the window size.
+Two neighbour normals making an angle bigger than the crease angle
+give an edge between them.
+
+For interactive use, the normals are computed on a grid whose stride
+adapts to a time budget: it doubles when a frame was over budget,
+and halves when a frame took less than a quarter of it.
+The output has the same format as DepthCanny::get_thresholded_image():
+0 for edges, 255 elsewhere.
+ */
+
+#ifndef NORMAL_EDGES_H
+#define NORMAL_EDGES_H
+
+#include <cmath>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <nan_handling.h>
+#include <span_tracer.h>
+
+class NormalEdges {
+public:
+  //! the angle between two normals making an edge (degrees)
+  static const double DEFAULT_CREASE_ANGLE = 35;
+  //! the windows used for the tangents are (2 * radius + 1) x radius pixels
+  static const int DEFAULT_WINDOW_RADIUS = 5;
+  //! the time budget of thresh() (ms)
+  static const double DEFAULT_BUDGET_MS = 15;
+  //! the biggest stride of the normal grid (pixels)
+  static const int MAX_STRIDE = 8;
+  //! the default focal length of the depth camera (Kinect, pixels)
+  static const double DEFAULT_FOCAL = 525;
+
+  NormalEdges() :
+    _window_radius(DEFAULT_WINDOW_RADIUS), _budget_ms(DEFAULT_BUDGET_MS),
+    _stride(1), _last_ms(0), _fx(DEFAULT_FOCAL), _fy(DEFAULT_FOCAL), _cx(-1), _cy(-1)
+  {
+    set_crease_angle(DEFAULT_CREASE_ANGLE);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  inline void set_crease_angle(double angle_deg) {
+    _cos_crease_angle = cos(angle_deg * M_PI / 180);
+  }
+  inline void set_window_radius(int radius) {
+    _window_radius = std::max(radius, 1);
+  }
+  //! \param budget_ms the time budget of thresh(), <= 0 for always using a stride of 1
+  inline void set_budget_ms(double budget_ms) {
+    _budget_ms = budget_ms;
+    if (_budget_ms <= 0)
+      _stride = 1;
+  }
+  //! \param cx, cy the optical center, < 0 for the center of the image
+  inline void set_intrinsics(double fx, double fy, double cx, double cy) {
+    _fx = fx; _fy = fy; _cx = cx; _cy = cy;
+  }
+
+  //! the stride used by the last thresh()
+  inline int get_stride() const { return _stride; }
+  //! the duration of the last thresh() (ms)
+  inline double get_last_ms() const { return _last_ms; }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! \param depth_img a CV_32F depth image, in meters
+  void thresh(const cv::Mat & depth_img) {
+    TRACE_SPAN("NormalEdges::thresh");
+    int64 begin_ticks = cv::getTickCount();
+    if (depth_img.empty() || depth_img.type() != CV_32FC1) {
+      printf("NormalEdges::thresh(): expected a non empty CV_32FC1 image!\n");
+      return;
+    }
+    back_project(depth_img);
+    {
+      TRACE_SPAN("NormalEdges::thresh(): cv::integral()");
+      cv::integral(_points, _points_integral, CV_64F);
+      cv::integral(_valid, _valid_integral, CV_32S);
+    }
+    compute_normals();
+    mark_creases();
+    // adapt the stride to the budget for the next frame
+    _last_ms = 1000. * (cv::getTickCount() - begin_ticks) / cv::getTickFrequency();
+    if (_budget_ms > 0 && _last_ms > _budget_ms && _stride < MAX_STRIDE)
+      _stride *= 2;
+    else if (_budget_ms > 0 && _last_ms < _budget_ms / 4 && _stride > 1)
+      _stride /= 2;
+  } // end thresh()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  inline const cv::Mat1b & get_thresholded_image() const {
+    return _edges;
+  }
+
+private:
+  //! depth -> 3D points in _points, valid mask in _valid
+  void back_project(const cv::Mat & depth_img) {
+    TRACE_SPAN("NormalEdges::back_project()");
+    int rows = depth_img.rows, cols = depth_img.cols;
+    double cx = (_cx < 0 ? (cols - 1) / 2. : _cx), cy = (_cy < 0 ? (rows - 1) / 2. : _cy);
+    _points.create(depth_img.size());
+    _valid.create(depth_img.size());
+    for (int row = 0; row < rows; ++row) {
+      const float* depth_ptr = depth_img.ptr<float>(row);
+      cv::Vec3f* points_ptr = _points.ptr<cv::Vec3f>(row);
+      uchar* valid_ptr = _valid.ptr<uchar>(row);
+      float y_factor = (row - cy) / _fy;
+      for (int col = 0; col < cols; ++col) {
+        float z = depth_ptr[col];
+        if (image_utils::is_nan_depth(z)) {
+          points_ptr[col] = cv::Vec3f(0, 0, 0);
+          valid_ptr[col] = 0;
+          continue;
+        }
+        points_ptr[col] = cv::Vec3f(z * (col - cx) / _fx, z * y_factor, z);
+        valid_ptr[col] = 1;
+      } // end loop col
+    } // end loop row
+  } // end back_project()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * The mean point of the window [row_begin, row_end[ x [col_begin, col_end[.
+   * \return false if less than half of its points are valid
+   */
+  inline bool window_mean(int row_begin, int col_begin, int row_end, int col_end,
+                          cv::Vec3d & mean) const {
+    int count = _valid_integral(row_end, col_end) - _valid_integral(row_begin, col_end)
+                - _valid_integral(row_end, col_begin) + _valid_integral(row_begin, col_begin);
+    if (2 * count < (row_end - row_begin) * (col_end - col_begin))
+      return false;
+    mean = (_points_integral(row_end, col_end) - _points_integral(row_begin, col_end)
+            - _points_integral(row_end, col_begin) + _points_integral(row_begin, col_begin))
+           * (1. / count);
+    return true;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! the unit normals on the grid of stride _stride, (0, 0, 0) if unknown
+  void compute_normals() {
+    TRACE_SPAN("NormalEdges::compute_normals()");
+    int rows = _points.rows, cols = _points.cols, r = _window_radius;
+    _normals.create((rows + _stride - 1) / _stride, (cols + _stride - 1) / _stride);
+    cv::Vec3d left, right, top, bottom;
+    for (int grid_row = 0; grid_row < _normals.rows; ++grid_row) {
+      cv::Vec3f* normals_ptr = _normals.ptr<cv::Vec3f>(grid_row);
+      int row = grid_row * _stride;
+      for (int grid_col = 0; grid_col < _normals.cols; ++grid_col) {
+        int col = grid_col * _stride;
+        normals_ptr[grid_col] = cv::Vec3f(0, 0, 0);
+        if (row < r || row + r >= rows || col < r || col + r >= cols
+            || !_valid(row, col)
+            || !window_mean(row - r, col - r, row + r + 1, col, left)
+            || !window_mean(row - r, col + 1, row + r + 1, col + r + 1, right)
+            || !window_mean(row - r, col - r, row, col + r + 1, top)
+            || !window_mean(row + 1, col - r, row + r + 1, col + r + 1, bottom))
+          continue;
+        cv::Vec3d normal = (right - left).cross(bottom - top);
+        double norm = cv::norm(normal);
+        if (norm > 0)
+          normals_ptr[grid_col] = normal * (1. / norm);
+      } // end loop grid_col
+    } // end loop grid_row
+  } // end compute_normals()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! compare the neighbour normals of the grid and draw the creases between them
+  void mark_creases() {
+    TRACE_SPAN("NormalEdges::mark_creases()");
+    int rows = _points.rows, cols = _points.cols;
+    _edges.create(_points.size());
+    _edges.setTo(255);
+    const cv::Vec3f unknown(0, 0, 0);
+    for (int grid_row = 0; grid_row < _normals.rows; ++grid_row) {
+      const cv::Vec3f* normals_ptr = _normals.ptr<cv::Vec3f>(grid_row);
+      const cv::Vec3f* down_normals_ptr =
+          (grid_row + 1 < _normals.rows ? _normals.ptr<cv::Vec3f>(grid_row + 1) : NULL);
+      int row = grid_row * _stride;
+      for (int grid_col = 0; grid_col < _normals.cols; ++grid_col) {
+        const cv::Vec3f & normal = normals_ptr[grid_col];
+        if (normal == unknown)
+          continue;
+        int col = grid_col * _stride;
+        // right neighbour: vertical segment between both
+        if (grid_col + 1 < _normals.cols && normals_ptr[grid_col + 1] != unknown
+            && normal.dot(normals_ptr[grid_col + 1]) < _cos_crease_angle) {
+          int edge_col = std::min(col + _stride / 2, cols - 1);
+          for (int edge_row = row; edge_row < std::min(row + _stride, rows); ++edge_row)
+            _edges(edge_row, edge_col) = 0;
+        }
+        // down neighbour: horizontal segment between both
+        if (down_normals_ptr != NULL && down_normals_ptr[grid_col] != unknown
+            && normal.dot(down_normals_ptr[grid_col]) < _cos_crease_angle) {
+          uchar* edges_ptr = _edges.ptr<uchar>(std::min(row + _stride / 2, rows - 1));
+          for (int edge_col = col; edge_col < std::min(col + _stride, cols); ++edge_col)
+            edges_ptr[edge_col] = 0;
+        }
+      } // end loop grid_col
+    } // end loop grid_row
+  } // end mark_creases()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  // parameters
+  double _cos_crease_angle;
+  int _window_radius;
+  double _budget_ms;
+  int _stride;
+  double _last_ms;
+  double _fx, _fy, _cx, _cy;
+  // workspaces
+  cv::Mat3f _points;
+  cv::Mat1b _valid;
+  cv::Mat_<cv::Vec3d> _points_integral;
+  cv::Mat1i _valid_integral;
+  cv::Mat3f _normals;
+  cv::Mat1b _edges;
+}; // end class NormalEdges
+
+#endif // NORMAL_EDGES_H
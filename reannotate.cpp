@@ -0,0 +1,474 @@
+/*!
+  \file        reannotate.cpp
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+Re-annotate frames under new edge detection parameters, without the GUI.
+
+For each frame "<prefix>" (same arguments as user_image_annotator):
+- the contours are computed again from its depth with the new parameters;
+- the annotation operations are replayed on them:
+  the saved ones of the journal (--journal) if they rebuild its existing user
+  image "<prefix>_ground_truth_user.png" from a blank one
+  (cf AnnotationJournal::covers_from_blank()), otherwise one fill per region
+  of this user image, seeded at the innermost pixel of the region;
+- the new user image is written to "<prefix>_ground_truth_user_reannotated.png",
+  or over the existing one with --in-place, unless the frame is flagged;
+- the region of each seed in the new user image is compared with its region
+  in the old one: the frame is flagged if their intersection over union
+  is below --min-iou, for instance when a seed now falls in a region
+  that merged with the background, or on an edge.
+  It is also flagged if more than --max-lost-ratio of the labelled pixels
+  of the old user image are black or of another color in the new one.
+
+The frames are processed in parallel with cv::parallel_for_(),
+each thread with its own DepthCannyWorkspace.
+ */
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "contour_image_annotator.h"
+#include "depth_jump_edges.h"
+
+//! the default min intersection over union of the old and new regions of a seed
+static const double DEFAULT_MIN_IOU = .5;
+//! the smallest region of an existing user image giving a seed (pixels)
+static const int MIN_INFERRED_REGION_SIZE = 16;
+//! the default max ratio of the labelled pixels lost by the new user image
+static const double DEFAULT_MAX_LOST_RATIO = .01;
+
+struct ReannotationParams {
+  ReannotationParams() :
+    depth_jumps(false),
+    jump_min(DepthJumpEdges::DEFAULT_MIN_JUMP),
+    jump_factor(DepthJumpEdges::DEFAULT_JUMP_FACTOR),
+    user_image_suffix("_ground_truth_user"),
+    output_suffix("_ground_truth_user_reannotated"),
+    review_suffix("_ground_truth_user_reannotated"),
+    min_iou(DEFAULT_MIN_IOU),
+    max_lost_ratio(DEFAULT_MAX_LOST_RATIO) {
+    canny.normal_edges_budget_ms = 0; // full resolution, reproducible
+  }
+  DepthCannyParams canny;
+  bool depth_jumps; //!< use DepthJumpEdges instead of DepthCanny
+  double jump_min, jump_factor;
+  AnnotationJournal::OpsMap journal_ops; //!< the saved operations of each frame
+  std::string user_image_suffix, output_suffix;
+  //! where the flagged frames are written instead of over their user image
+  std::string review_suffix;
+  double min_iou, max_lost_ratio;
+}; // end struct ReannotationParams
+
+//! what happened to a frame, filled by a worker thread, printed at the end
+struct FrameReport {
+  FrameReport() : success(false), from_journal(false), journal_incomplete(false),
+    nseeds(0), nflagged(0), worst_iou(1), nlabelled(0), nlost(0), for_review(false) {}
+  inline bool flagged(double max_lost_ratio) const {
+    return nflagged > 0 || nlost > max_lost_ratio * nlabelled;
+  }
+  bool success;
+  bool from_journal; //!< false if the seeds were inferred from the user image
+  bool journal_incomplete; //!< the journal has operations, not rebuilding the user image
+  unsigned int nseeds, nflagged;
+  double worst_iou;
+  cv::Point worst_seed;
+  //! the labelled pixels of the old user image, those black or recolored in the new one
+  unsigned int nlabelled, nlost;
+  bool for_review; //!< flagged with --in-place: written with the review suffix
+  std::string error;
+}; // end struct FrameReport
+
+////////////////////////////////////////////////////////////////////////////////
+
+//! a span visitor keeping the pixel of the biggest distance of the filled region
+struct InnermostPixelFinder {
+  InnermostPixelFinder(const cv::Mat1f & dist) : _dist(dist), best_dist(-1), npixels(0) {}
+  inline void operator()(int row, int col_begin, int col_end) {
+    const float* dist_ptr = _dist.ptr<float>(row);
+    for (int col = col_begin; col < col_end; ++col) {
+      if (dist_ptr[col] > best_dist) {
+        best_dist = dist_ptr[col];
+        best = cv::Point(col, row);
+      }
+    }
+    npixels += col_end - col_begin;
+  }
+  const cv::Mat1f & _dist;
+  float best_dist;
+  cv::Point best;
+  int npixels;
+}; // end struct InnermostPixelFinder
+
+/*!
+ * One fill per 4-connected region of each user color,
+ * seeded at its innermost pixel, so that small contour changes
+ * do not move the seed out of its region.
+ */
+void infer_seeds(const cv::Mat3b & user_image, AnnotationJournal::Ops & fills) {
+  fills.clear();
+  cv::Mat1b mask;
+  cv::Mat1f dist;
+  std::vector<cv::Point> seeds;
+  for (unsigned int color_idx = 0; color_idx < NCOLORS; ++color_idx) {
+    cv::Vec3b color(USER_COLOR[color_idx][0], USER_COLOR[color_idx][1],
+                    USER_COLOR[color_idx][2]);
+    if (color == cv::Vec3b(0, 0, 0))
+      continue; // not annotated
+    mask.create(user_image.size());
+    int npixels = 0;
+    for (int row = 0; row < user_image.rows; ++row) {
+      const cv::Vec3b* user_ptr = user_image.ptr<cv::Vec3b>(row);
+      uchar* mask_ptr = mask.ptr<uchar>(row);
+      for (int col = 0; col < user_image.cols; ++col) {
+        mask_ptr[col] = (user_ptr[col] == color ? 255 : 0);
+        npixels += (mask_ptr[col] != 0);
+      }
+    } // end loop row
+    if (npixels == 0)
+      continue;
+    cv::distanceTransform(mask, dist, CV_DIST_L2, 3);
+    for (int row = 0; row < mask.rows; ++row) {
+      const uchar* mask_ptr = mask.ptr<uchar>(row);
+      for (int col = 0; col < mask.cols; ++col) {
+        if (mask_ptr[col] != 255)
+          continue;
+        InnermostPixelFinder finder(dist);
+        image_utils::scanline_floodfill(mask, cv::Point(col, row), 128, seeds, finder);
+        if (finder.npixels < MIN_INFERRED_REGION_SIZE)
+          continue;
+        AnnotationJournal::Op op = AnnotationJournal::Op();
+        op.type = AnnotationJournal::OP_FILL;
+        op.x = finder.best.x;
+        op.y = finder.best.y;
+        for (int i = 0; i < 3; ++i)
+          op.color[i] = color[i];
+        fills.push_back(op);
+      } // end loop col
+    } // end loop row
+  } // end loop color_idx
+} // end infer_seeds()
+
+////////////////////////////////////////////////////////////////////////////////
+
+//! the 4-connected region of the pixels of img equal to img(seed), as 255 in region
+void color_region(const cv::Mat3b & img, const cv::Point & seed,
+                  cv::Mat1b & region, std::vector<cv::Point> & seeds) {
+  cv::Vec3b color = img(seed.y, seed.x);
+  region.create(img.size());
+  for (int row = 0; row < img.rows; ++row) {
+    const cv::Vec3b* img_ptr = img.ptr<cv::Vec3b>(row);
+    uchar* region_ptr = region.ptr<uchar>(row);
+    for (int col = 0; col < img.cols; ++col)
+      region_ptr[col] = (img_ptr[col] == color ? 1 : 0);
+  }
+  image_utils::FloodfillSpanIgnorer ignorer;
+  image_utils::scanline_floodfill(region, seed, 255, seeds, ignorer);
+}
+
+/*!
+ * Compare the regions of each seed in the old and new user images.
+ * Seeds unannotated in both are ignored, a color change counts as no overlap.
+ */
+void check_seeds(const cv::Mat3b & old_user, const cv::Mat3b & new_user,
+                 const AnnotationJournal::Ops & fills, double min_iou,
+                 FrameReport & report) {
+  cv::Mat1b old_region, new_region, checked(new_user.size(), (uchar) 0);
+  std::vector<cv::Point> seeds;
+  const cv::Vec3b black(0, 0, 0);
+  for (unsigned int i = 0; i < fills.size(); ++i) {
+    cv::Point seed(fills[i].x, fills[i].y);
+    if (seed.x < 0 || seed.x >= new_user.cols || seed.y < 0 || seed.y >= new_user.rows)
+      continue;
+    const cv::Vec3b & old_color = old_user(seed.y, seed.x), & new_color = new_user(seed.y, seed.x);
+    if ((old_color == black && new_color == black) || checked(seed.y, seed.x))
+      continue;
+    ++report.nseeds;
+    double iou = 0;
+    if (old_color == new_color) {
+      color_region(old_user, seed, old_region, seeds);
+      color_region(new_user, seed, new_region, seeds);
+      int ninter = 0, nunion = 0;
+      for (int row = 0; row < new_user.rows; ++row) {
+        const uchar* old_ptr = old_region.ptr<uchar>(row);
+        const uchar* new_ptr = new_region.ptr<uchar>(row);
+        uchar* checked_ptr = checked.ptr<uchar>(row);
+        for (int col = 0; col < new_user.cols; ++col) {
+          bool in_old = (old_ptr[col] == 255), in_new = (new_ptr[col] == 255);
+          ninter += (in_old && in_new);
+          nunion += (in_old || in_new);
+          if (in_new)
+            checked_ptr[col] = 1; // same result for the other seeds of the region
+        }
+      } // end loop row
+      iou = (nunion > 0 ? 1. * ninter / nunion : 1);
+    }
+    if (iou < min_iou)
+      ++report.nflagged;
+    if (iou < report.worst_iou) {
+      report.worst_iou = iou;
+      report.worst_seed = seed;
+    }
+  } // end loop i
+} // end check_seeds()
+
+//! count the labelled pixels of old_user, and those black or recolored in new_user
+void check_pixels(const cv::Mat3b & old_user, const cv::Mat3b & new_user,
+                  FrameReport & report) {
+  const cv::Vec3b black(0, 0, 0);
+  for (int row = 0; row < old_user.rows; ++row) {
+    const cv::Vec3b* old_ptr = old_user.ptr<cv::Vec3b>(row);
+    const cv::Vec3b* new_ptr = new_user.ptr<cv::Vec3b>(row);
+    for (int col = 0; col < old_user.cols; ++col) {
+      if (old_ptr[col] == black)
+        continue;
+      ++report.nlabelled;
+      report.nlost += (new_ptr[col] != old_ptr[col]);
+    }
+  } // end loop row
+} // end check_pixels()
+
+////////////////////////////////////////////////////////////////////////////////
+
+class ReannotateBody : public cv::ParallelLoopBody {
+public:
+  ReannotateBody(const std::vector<std::string> & prefixes,
+                 const ReannotationParams & params,
+                 DepthCannyWorkspacePool & pool,
+                 std::vector<FrameReport> & reports) :
+    _prefixes(prefixes), _params(params), _pool(pool), _reports(reports) {}
+
+  virtual void operator()(const cv::Range & range) const {
+    for (int frame_idx = range.start; frame_idx < range.end; ++frame_idx)
+      process_frame(frame_idx);
+  }
+
+private:
+  void process_frame(int frame_idx) const {
+    const std::string & prefix = _prefixes[frame_idx];
+    FrameReport & report = _reports[frame_idx];
+    // new contours
+    cv::Mat depth;
+    image_utils::ImageIOWorkspace io_ws;
+    io_ws.sequence_params_first = _params.canny.fixed_depth_scale_enabled;
+    if (!image_utils::read_rgb_and_depth_image_from_image_file
+        (prefix, NULL, &depth, image_utils::FILE_PNG, &io_ws) || depth.empty()) {
+      report.error = "could not read the depth";
+      return;
+    }
+    cv::Mat1b contours;
+    if (_params.depth_jumps) {
+      DepthJumpEdges jump_edges;
+      jump_edges.set_thresholds(_params.jump_min, _params.jump_factor);
+      jump_edges.thresh(depth);
+      jump_edges.get_thresholded_image().copyTo(contours);
+    }
+    else {
+      DepthCannyWorkspacePool::ScopedWorkspace ws(_pool);
+      DepthCanny::compute(depth, _params.canny, *ws, contours);
+    }
+    // old user image
+    std::string user_prefix = remove_filename_extension(prefix);
+    std::string output_filename = user_prefix + _params.output_suffix + ".png";
+    FrameLock lock; // with --in-place, an annotator may be editing it
+    if (!lock.acquire(output_filename)) {
+      report.error = "locked by another instance";
+      return;
+    }
+    cv::Mat3b old_user = cv::imread(user_prefix + _params.user_image_suffix + ".png",
+                                    CV_LOAD_IMAGE_COLOR);
+    // 0 if none, as in the journal
+    unsigned long long old_user_hash = (old_user.empty() ? 0 : image_content_hash(old_user));
+    if (old_user.empty())
+      old_user = cv::Mat3b(contours.size(), cv::Vec3b(0, 0, 0));
+    if (old_user.size() != contours.size()) {
+      report.error = "the user image and the depth have different sizes";
+      return;
+    }
+    // replay
+    AnnotationJournal::Ops fills;
+    AnnotationEditor editor; // the same edits as ContourImageAnnotator
+    editor.set_frame(cv::Mat3b(contours.size(), cv::Vec3b(0, 0, 0)), contours);
+    editor.reserve(contours.size());
+    // the journal alone misses the edits it did not record, and what they started from
+    AnnotationJournal::OpsMap::const_iterator journal_it = _params.journal_ops.find(prefix);
+    if (journal_it != _params.journal_ops.end()) {
+      report.from_journal = AnnotationJournal::covers_from_blank(journal_it->second,
+                                                                 old_user_hash);
+      report.journal_incomplete = !report.from_journal;
+    }
+    if (report.from_journal)
+      editor.replay(journal_it->second, &fills);
+    else {
+      AnnotationJournal::Ops inferred;
+      infer_seeds(old_user, inferred);
+      editor.replay(inferred, &fills);
+    }
+    check_seeds(old_user, editor.user_image(), fills, _params.min_iou, report);
+    check_pixels(old_user, editor.user_image(), report);
+    // never overwrite a ground truth with a flagged result
+    report.for_review = (_params.output_suffix == _params.user_image_suffix
+                         && report.flagged(_params.max_lost_ratio));
+    if (report.for_review)
+      output_filename = user_prefix + _params.review_suffix + ".png";
+    if (!imwrite_atomic(output_filename, editor.user_image())) {
+      report.error = "could not write the new user image";
+      return;
+    }
+    report.success = true;
+  } // end process_frame()
+
+  const std::vector<std::string> & _prefixes;
+  const ReannotationParams & _params;
+  DepthCannyWorkspacePool & _pool;
+  std::vector<FrameReport> & _reports;
+}; // end class ReannotateBody
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+  std::vector<std::string> prefixes;
+  ReannotationParams params;
+  std::string journal_filename;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--canny" && i + 2 < argc) {
+      params.canny.canny_thres1 = atof(argv[++i]);
+      params.canny.canny_thres2 = atof(argv[++i]);
+      continue;
+    }
+    if (arg == "--depth-percentiles" && i + 2 < argc) {
+      params.canny.depth_range.low_percentile = atof(argv[++i]);
+      params.canny.depth_range.high_percentile = atof(argv[++i]);
+      continue;
+    }
+    if (arg == "--fixed-depth-scale" && i + 2 < argc) {
+      double min_depth = atof(argv[++i]), max_depth = atof(argv[++i]);
+      if (min_depth >= max_depth) {
+        printf("Invalid --fixed-depth-scale %g %g, need MIN < MAX.\n", min_depth, max_depth);
+        return -1;
+      }
+      params.canny.fixed_depth_scale_enabled = true;
+      params.canny.fixed_depth_scale = image_utils::FixedDepthScale(min_depth, max_depth);
+      continue;
+    }
+    if (arg == "--nan-removal" && i + 1 < argc) {
+      std::string method(argv[++i]);
+      if (method == "none")
+        params.canny.nan_removal_method = image_utils::VALUE_REMOVAL_METHOD_DO_NOTHING;
+      else if (method == "nearest")
+        params.canny.nan_removal_method = image_utils::VALUE_REMOVAL_METHOD_NEAREST;
+      else if (method == "background")
+        params.canny.nan_removal_method = image_utils::VALUE_REMOVAL_METHOD_BACKGROUND;
+      else
+        printf("Unknown NaN removal method '%s', ignoring it.\n", method.c_str());
+      continue;
+    }
+    if (arg == "--keep-border-holes") {
+      params.canny.border_hole_policy = image_utils::BORDER_HOLES_KEEP;
+      continue;
+    }
+    if (arg == "--normal-edges") {
+      params.canny.normal_edges_enabled = true;
+      continue;
+    }
+    if (arg == "--crease-angle" && i + 1 < argc) {
+      params.canny.crease_angle = atof(argv[++i]);
+      continue;
+    }
+    if (arg == "--depth-jumps") {
+      params.depth_jumps = true;
+      continue;
+    }
+    if (arg == "--jump-min" && i + 1 < argc) {
+      params.jump_min = atof(argv[++i]);
+      continue;
+    }
+    if (arg == "--jump-factor" && i + 1 < argc) {
+      params.jump_factor = atof(argv[++i]);
+      continue;
+    }
+    if (arg == "--journal" && i + 1 < argc) {
+      journal_filename = argv[++i];
+      continue;
+    }
+    if (arg == "--min-iou" && i + 1 < argc) {
+      params.min_iou = atof(argv[++i]);
+      continue;
+    }
+    if (arg == "--max-lost-ratio" && i + 1 < argc) {
+      params.max_lost_ratio = atof(argv[++i]);
+      continue;
+    }
+    if (arg == "--in-place") {
+      params.output_suffix = params.user_image_suffix;
+      continue;
+    }
+    find_and_replace(arg, "_depth.png", "");
+    find_and_replace(arg, "_rgb.png", "");
+    prefixes.push_back(arg);
+  } // end loop i
+  if (prefixes.empty()) {
+    printf("Synopsis: %s [options] FRAME_PREFIX...\n", argv[0]);
+    return -1;
+  }
+  if (!params.canny.depth_range.is_valid()) {
+    printf("Invalid --depth-percentiles %g %g, need 0 <= low < high <= 100.\n",
+           params.canny.depth_range.low_percentile,
+           params.canny.depth_range.high_percentile);
+    return -1;
+  }
+  if (!journal_filename.empty()) {
+    AnnotationJournal::OpsMap pending;
+    if (!AnnotationJournal::read_history(journal_filename, params.journal_ops, pending))
+      printf("Could not read the journal '%s', inferring all the seeds.\n",
+             journal_filename.c_str());
+  }
+
+  std::vector<FrameReport> reports(prefixes.size());
+  DepthCannyWorkspacePool pool;
+  cv::parallel_for_(cv::Range(0, prefixes.size()),
+                    ReannotateBody(prefixes, params, pool, reports));
+
+  unsigned int nsuccess = 0, nflagged = 0;
+  for (unsigned int frame_idx = 0; frame_idx < prefixes.size(); ++frame_idx) {
+    const FrameReport & report = reports[frame_idx];
+    if (!report.success) {
+      printf("'%s': %s\n", prefixes[frame_idx].c_str(), report.error.c_str());
+      continue;
+    }
+    ++nsuccess;
+    if (report.journal_incomplete)
+      printf("'%s': the journal does not rebuild its user image, seeds inferred\n",
+             prefixes[frame_idx].c_str());
+    if (!report.flagged(params.max_lost_ratio))
+      continue;
+    ++nflagged;
+    printf("'%s': FLAGGED, %i/%i seeds (%s) below IoU %g, worst %.2f at (%i, %i), "
+           "%i/%i labelled pixels lost%s\n",
+           prefixes[frame_idx].c_str(), report.nflagged, report.nseeds,
+           (report.from_journal ? "journal" : "inferred"), params.min_iou,
+           report.worst_iou, report.worst_seed.x, report.worst_seed.y,
+           report.nlost, report.nlabelled,
+           (report.for_review ? ", user image kept" : ""));
+  } // end loop frame_idx
+  printf("Re-annotated %i/%i frames with %i workspaces, %i flagged for review.\n",
+         nsuccess, (int) prefixes.size(), pool.size(), nflagged);
+  return (nsuccess == prefixes.size() ? 0 : -1);
+}
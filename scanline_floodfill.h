@@ -0,0 +1,175 @@
+/*!
+  \file        scanline_floodfill.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+A scanline floodfill working on a caller-supplied seed buffer.
+Contrary to cv::floodFill(), it does not allocate anything once the buffer
+is big enough, and it reports the filled pixels as horizontal spans,
+so that the caller can paint another image without a full-frame mask.
+ */
+
+#ifndef SCANLINE_FLOODFILL_H
+#define SCANLINE_FLOODFILL_H
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace image_utils {
+
+/*!
+ * A span visitor that paints each filled span with a constant value.
+ * Template<_T>: the pixel type of the painted image, ex cv::Vec3b for cv::Mat3b
+ */
+template<class _T>
+class FloodfillSpanPainter {
+public:
+  FloodfillSpanPainter(cv::Mat_<_T> & img, const _T & value) :
+    _img(img), _value(value) {}
+  inline void operator()(int row, int col_begin, int col_end) {
+    _T* img_ptr = _img.template ptr<_T>(row);
+    for (int col = col_begin; col < col_end; ++col)
+      img_ptr[col] = _value;
+  }
+private:
+  cv::Mat_<_T> & _img;
+  _T _value;
+}; // end class FloodfillSpanPainter
+
+////////////////////////////////////////////////////////////////////////////////
+
+//! a span visitor doing nothing, when only the filled image matters
+struct FloodfillSpanIgnorer {
+  inline void operator()(int /*row*/, int /*col_begin*/, int /*col_end*/) {}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * The capacity of the seed buffer that no fill can exceed, for an image
+ * of a given size: reserving it once avoids any reallocation during the fills.
+ * A seed is the first pixel of a run of old_val pixels, so there are at most
+ * (width + 1) / 2 of them per row, and a pixel is pushed at most twice,
+ * by the span above it and by the span below it, before being filled.
+ */
+inline size_t scanline_floodfill_buffer_size(const cv::Size & img_size) {
+  return 2 * ((size_t) (img_size.width + 1) / 2) * img_size.height + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * Floodfill the 4-connected region of \a img containing \a seed,
+ * same behaviour as cv::floodFill() with a null tolerance.
+ * \param img
+ *    the image to fill, modified in place
+ * \param seed
+ *    the starting point of the fill
+ * \param new_val
+ *    the value given to the filled pixels
+ * \param seeds_buffer
+ *    a buffer, kept between the calls to avoid reallocations
+ * \param visitor
+ *    a functor called as visitor(row, col_begin, col_end) for each
+ *    filled span [col_begin, col_end[
+ * \return the number of filled pixels
+ */
+template<class _SpanVisitor>
+inline unsigned int scanline_floodfill(cv::Mat1b & img,
+                                       const cv::Point & seed,
+                                       const uchar new_val,
+                                       std::vector<cv::Point> & seeds_buffer,
+                                       _SpanVisitor & visitor) {
+  int rows = img.rows, cols = img.cols;
+  if (seed.x < 0 || seed.x >= cols || seed.y < 0 || seed.y >= rows)
+    return 0;
+  const uchar old_val = img(seed.y, seed.x);
+  if (old_val == new_val)
+    return 0;
+  unsigned int npixels = 0;
+  seeds_buffer.clear();
+  seeds_buffer.push_back(seed);
+  while (!seeds_buffer.empty()) {
+    cv::Point pt = seeds_buffer.back();
+    seeds_buffer.pop_back();
+    uchar* img_ptr = img.ptr<uchar>(pt.y);
+    if (img_ptr[pt.x] != old_val) // already filled by another span
+      continue;
+    // extend the span to the left and to the right
+    int col_begin = pt.x, col_end = pt.x + 1;
+    while (col_begin > 0 && img_ptr[col_begin - 1] == old_val)
+      --col_begin;
+    while (col_end < cols && img_ptr[col_end] == old_val)
+      ++col_end;
+    for (int col = col_begin; col < col_end; ++col)
+      img_ptr[col] = new_val;
+    npixels += col_end - col_begin;
+    visitor(pt.y, col_begin, col_end);
+    // push one seed per run of old_val in the rows above and below
+    for (int row = pt.y - 1; row <= pt.y + 1; row += 2) {
+      if (row < 0 || row >= rows)
+        continue;
+      const uchar* row_ptr = img.ptr<uchar>(row);
+      bool in_run = false;
+      for (int col = col_begin; col < col_end; ++col) {
+        if (row_ptr[col] != old_val)
+          in_run = false;
+        else if (!in_run) {
+          seeds_buffer.push_back(cv::Point(col, row));
+          in_run = true;
+        }
+      } // end loop col
+    } // end loop row
+  } // end while (!seeds_buffer.empty())
+  return npixels;
+} // end scanline_floodfill()
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * Count the 4-connected regions made of pixels equal to \a region_val,
+ * for instance the free (white) regions of a contour image.
+ * \param buffer
+ *    where a copy of \a img is filled, kept between the calls
+ * \param seeds_buffer
+ *    cf scanline_floodfill()
+ */
+inline unsigned int count_regions(const cv::Mat1b & img, const uchar region_val,
+                                  cv::Mat1b & buffer,
+                                  std::vector<cv::Point> & seeds_buffer) {
+  img.copyTo(buffer);
+  const uchar filled_val = (region_val == 0 ? 1 : region_val - 1);
+  FloodfillSpanIgnorer ignorer;
+  unsigned int nregions = 0;
+  for (int row = 0; row < buffer.rows; ++row) {
+    const uchar* buffer_ptr = buffer.ptr<uchar>(row);
+    for (int col = 0; col < buffer.cols; ++col) {
+      if (buffer_ptr[col] != region_val)
+        continue;
+      scanline_floodfill(buffer, cv::Point(col, row), filled_val, seeds_buffer, ignorer);
+      ++nregions;
+    } // end loop col
+  } // end loop row
+  return nregions;
+} // end count_regions()
+
+} // end namespace image_utils
+
+#endif // SCANLINE_FLOODFILL_H
@@ -0,0 +1,211 @@
+/*!
+  \file        span_tracer.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+A lightweight scoped-span tracer.
+
+It is always compiled in, but does nothing until span_tracer::enable()
+is called. Then each TRACE_SPAN("name") records the duration of its scope
+into a ring buffer owned by the current thread (no lock, no allocation
+once the buffer exists).
+When the program exits, the spans of all the threads are dumped
+as a Chrome trace JSON file, that can be opened
+in chrome://tracing or https://ui.perfetto.dev .
+
+Span names must be string literals, as only their pointer is stored.
+ */
+
+#ifndef SPAN_TRACER_H
+#define SPAN_TRACER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace span_tracer {
+
+//! the default number of spans kept per thread - the oldest are overwritten
+static const unsigned int DEFAULT_CAPACITY = 65536;
+
+struct Span {
+  const char* name;
+  int64 begin_ticks, end_ticks;
+};
+
+//! the spans of a given thread
+struct RingBuffer {
+  std::vector<Span> spans;
+  unsigned int next; //!< where the next span will be written
+  unsigned int nspans; //!< the number of valid spans, <= spans.size()
+  unsigned int thread_id;
+};
+
+//! the global state of the tracer
+struct TracerState {
+  TracerState() : enabled(false), capacity(DEFAULT_CAPACITY) {}
+  bool enabled;
+  std::string filename;
+  unsigned int capacity;
+  cv::Mutex buffers_mutex;
+  std::vector<RingBuffer*> buffers; //!< all threads, never freed
+};
+
+inline TracerState & state() {
+  static TracerState s;
+  return s;
+}
+
+//! the buffer of the current thread, created on its first span
+static __thread RingBuffer* thread_buffer = NULL;
+
+////////////////////////////////////////////////////////////////////////////////
+
+inline bool is_enabled() {
+  return state().enabled;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+inline RingBuffer* get_thread_buffer() {
+  if (thread_buffer != NULL)
+    return thread_buffer;
+  TracerState & s = state();
+  RingBuffer* buffer = new RingBuffer();
+  buffer->spans.resize(s.capacity);
+  buffer->next = buffer->nspans = 0;
+  cv::AutoLock lock(s.buffers_mutex);
+  buffer->thread_id = s.buffers.size();
+  s.buffers.push_back(buffer);
+  thread_buffer = buffer;
+  return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+inline void record(const char* name, int64 begin_ticks, int64 end_ticks) {
+  RingBuffer* buffer = get_thread_buffer();
+  Span & span = buffer->spans[buffer->next];
+  span.name = name;
+  span.begin_ticks = begin_ticks;
+  span.end_ticks = end_ticks;
+  buffer->next = (buffer->next + 1) % buffer->spans.size();
+  if (buffer->nspans < buffer->spans.size())
+    ++buffer->nspans;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * Write the spans of all the threads as a Chrome trace JSON file.
+ * Should be called when the other threads do not record spans anymore.
+ * \return true if success
+ */
+inline bool dump(const std::string & filename) {
+  TracerState & s = state();
+  FILE* file = fopen(filename.c_str(), "w");
+  if (file == NULL) {
+    printf("span_tracer::dump(): could not open '%s'\n", filename.c_str());
+    return false;
+  }
+  double ticks2us = 1E6 / cv::getTickFrequency();
+  int pid = getpid();
+  unsigned int nspans_total = 0;
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  cv::AutoLock lock(s.buffers_mutex);
+  bool first = true;
+  for (unsigned int buffer_idx = 0; buffer_idx < s.buffers.size(); ++buffer_idx) {
+    const RingBuffer* buffer = s.buffers[buffer_idx];
+    fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":%u,"
+            "\"args\":{\"name\":\"%s%u\"}}",
+            (first ? "" : ",\n"), pid, buffer->thread_id,
+            (buffer->thread_id == 0 ? "main" : "worker"), buffer->thread_id);
+    first = false;
+    // oldest span first
+    unsigned int capacity = buffer->spans.size();
+    unsigned int begin = (buffer->next + capacity - buffer->nspans) % capacity;
+    for (unsigned int i = 0; i < buffer->nspans; ++i) {
+      const Span & span = buffer->spans[(begin + i) % capacity];
+      fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%i,\"tid\":%u,"
+              "\"ts\":%.3f,\"dur\":%.3f}",
+              span.name, pid, buffer->thread_id,
+              span.begin_ticks * ticks2us,
+              (span.end_ticks - span.begin_ticks) * ticks2us);
+    } // end loop i
+    nspans_total += buffer->nspans;
+  } // end loop buffer_idx
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  printf("span_tracer: written %u spans of %u threads to '%s'\n",
+         nspans_total, (unsigned int) s.buffers.size(), filename.c_str());
+  return true;
+} // end dump()
+
+////////////////////////////////////////////////////////////////////////////////
+
+inline void dump_at_exit() {
+  dump(state().filename);
+}
+
+/*!
+ * Start recording spans. They will be dumped into \a filename at exit.
+ * \param capacity
+ *    the number of spans kept per thread
+ */
+inline void enable(const std::string & filename,
+                   unsigned int capacity = DEFAULT_CAPACITY) {
+  TracerState & s = state();
+  if (s.enabled)
+    return;
+  s.filename = filename;
+  s.capacity = std::max(capacity, 1u);
+  s.enabled = true;
+  atexit(dump_at_exit);
+  printf("span_tracer: tracing enabled, will be written to '%s'\n", filename.c_str());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//! records the duration of its own life
+class ScopedSpan {
+public:
+  ScopedSpan(const char* name) :
+    _name(name), _begin_ticks(is_enabled() ? cv::getTickCount() : 0) {}
+  ~ScopedSpan() {
+    if (_begin_ticks != 0 && is_enabled())
+      record(_name, _begin_ticks, cv::getTickCount());
+  }
+private:
+  const char* _name;
+  int64 _begin_ticks;
+}; // end class ScopedSpan
+
+} // end namespace span_tracer
+
+#define TRACE_SPAN_CONCAT2(a, b)  a##b
+#define TRACE_SPAN_CONCAT(a, b)   TRACE_SPAN_CONCAT2(a, b)
+//! record the duration of the current scope under the given name
+#define TRACE_SPAN(name) \
+  span_tracer::ScopedSpan TRACE_SPAN_CONCAT(span_tracer_scope_, __LINE__)(name);
+
+#endif // SPAN_TRACER_H
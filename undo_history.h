@@ -0,0 +1,223 @@
+/*!
+  \file        undo_history.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+\class UndoHistory
+An undo / redo history of the edits of an image, stored as deltas.
+
+An action (a floodfill, an erase, a brush stroke) writes a single value
+on some pixels of one of the layers (user image or contours).
+It is stored as the horizontal runs of pixels it changed,
+with their previous values, and the written value once.
+Undoing it copies the previous values back, redoing it writes the value
+again: both cost O(changed pixels), whatever the image size.
+
+The total size of the actions is bounded by a memory budget:
+beyond it, the oldest actions are forgotten.
+ */
+
+#ifndef UNDO_HISTORY_H
+#define UNDO_HISTORY_H
+
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+class UndoHistory {
+public:
+  //! the images an action can modify
+  enum Layer {
+    LAYER_USER_IMAGE = 0, //!< CV_8UC3
+    LAYER_CONTOURS = 1    //!< CV_8UC1
+  };
+  //! the default max memory used by the actions (bytes)
+  static const size_t DEFAULT_MEMORY_BUDGET = 64 * 1024 * 1024;
+
+  UndoHistory(size_t memory_budget = DEFAULT_MEMORY_BUDGET) :
+    _memory_budget(memory_budget), _memory_used(0), _recording(false) {}
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! forget all the actions, for instance when changing frame
+  void clear() {
+    _undo_stack.clear();
+    _redo_stack.clear();
+    _memory_used = 0;
+    _recording = false;
+  }
+
+  inline bool can_undo() const { return !_undo_stack.empty(); }
+  inline bool can_redo() const { return !_redo_stack.empty(); }
+  inline size_t memory_used() const { return _memory_used; }
+  inline bool recording() const { return _recording; }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Start recording an action. Must be followed by add_run()s then end_action().
+   * \param value
+   *    what the action writes, elem_size(layer) bytes
+   */
+  void begin_action(Layer layer, const uchar* value) {
+    _recording = true;
+    _current.layer = layer;
+    memcpy(_current.value, value, elem_size(layer));
+    _current.runs.clear();
+    _current.previous.clear();
+  }
+
+  /*!
+   * Add changed pixels to the current action, before they are modified.
+   * \param previous
+   *    their values, length * elem_size(layer) bytes
+   */
+  inline void add_run(int row, int col, int length, const uchar* previous) {
+    if (!_recording || length <= 0)
+      return;
+    Run run = {row, col, length};
+    _current.runs.push_back(run);
+    _current.previous.insert(_current.previous.end(), previous,
+                             previous + length * elem_size(_current.layer));
+  }
+
+  //! store the current action, if it changed something. It clears the redo stack
+  void end_action() {
+    if (!_recording)
+      return;
+    _recording = false;
+    if (_current.runs.empty())
+      return;
+    for (unsigned int i = 0; i < _redo_stack.size(); ++i)
+      _memory_used -= _redo_stack[i].memory();
+    _redo_stack.clear();
+    _undo_stack.push_back(Action());
+    _undo_stack.back().swap(_current);
+    _memory_used += _undo_stack.back().memory();
+    // forget the oldest actions beyond the budget, but always keep the last one
+    while (_memory_used > _memory_budget && _undo_stack.size() > 1) {
+      _memory_used -= _undo_stack.front().memory();
+      _undo_stack.pop_front();
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Undo the last action.
+   * \param changed (out)
+   *    the bounding box of the changed pixels
+   * \return false if there was nothing to undo
+   */
+  bool undo(cv::Mat & user_image, cv::Mat & contours,
+            Layer & layer, cv::Rect & changed) {
+    if (_undo_stack.empty())
+      return false;
+    Action & action = _undo_stack.back();
+    cv::Mat & img = (action.layer == LAYER_USER_IMAGE ? user_image : contours);
+    size_t elem = elem_size(action.layer);
+    const uchar* previous = &(action.previous[0]);
+    for (unsigned int i = 0; i < action.runs.size(); ++i) {
+      const Run & run = action.runs[i];
+      memcpy(img.ptr(run.row) + run.col * elem, previous, run.length * elem);
+      previous += run.length * elem;
+    }
+    layer = action.layer;
+    changed = action.bounding_box();
+    _redo_stack.push_back(Action());
+    _redo_stack.back().swap(action);
+    _undo_stack.pop_back();
+    return true;
+  }
+
+  //! redo the last undone action. \see undo()
+  bool redo(cv::Mat & user_image, cv::Mat & contours,
+            Layer & layer, cv::Rect & changed) {
+    if (_redo_stack.empty())
+      return false;
+    Action & action = _redo_stack.back();
+    cv::Mat & img = (action.layer == LAYER_USER_IMAGE ? user_image : contours);
+    size_t elem = elem_size(action.layer);
+    for (unsigned int i = 0; i < action.runs.size(); ++i) {
+      const Run & run = action.runs[i];
+      uchar* img_ptr = img.ptr(run.row) + run.col * elem;
+      for (int col = 0; col < run.length; ++col, img_ptr += elem)
+        memcpy(img_ptr, action.value, elem);
+    }
+    layer = action.layer;
+    changed = action.bounding_box();
+    _undo_stack.push_back(Action());
+    _undo_stack.back().swap(action);
+    _redo_stack.pop_back();
+    return true;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  static inline size_t elem_size(Layer layer) {
+    return (layer == LAYER_USER_IMAGE ? 3 : 1);
+  }
+
+private:
+  struct Run {
+    int row, col, length;
+  };
+
+  struct Action {
+    Layer layer;
+    uchar value[3];
+    std::vector<Run> runs;
+    std::vector<uchar> previous; //!< the previous values of all the runs
+
+    inline void swap(Action & b) {
+      std::swap(layer, b.layer);
+      for (int i = 0; i < 3; ++i)
+        std::swap(value[i], b.value[i]);
+      runs.swap(b.runs);
+      previous.swap(b.previous);
+    }
+    inline size_t memory() const {
+      return sizeof(Action) + runs.size() * sizeof(Run) + previous.size();
+    }
+    cv::Rect bounding_box() const {
+      if (runs.empty())
+        return cv::Rect();
+      cv::Point tl(runs[0].col, runs[0].row), br = tl;
+      for (unsigned int i = 0; i < runs.size(); ++i) {
+        tl.x = std::min(tl.x, runs[i].col);
+        tl.y = std::min(tl.y, runs[i].row);
+        br.x = std::max(br.x, runs[i].col + runs[i].length);
+        br.y = std::max(br.y, runs[i].row + 1);
+      }
+      return cv::Rect(tl, br);
+    }
+  }; // end struct Action
+
+  size_t _memory_budget;
+  size_t _memory_used; //!< by the actions of both stacks
+  std::deque<Action> _undo_stack;
+  std::vector<Action> _redo_stack;
+  Action _current;
+  bool _recording;
+}; // end class UndoHistory
+
+#endif // UNDO_HISTORY_H
@@ -23,14 +23,25 @@ ________________________________________________________________________________
 \todo Description of the file
  */
 #include <contour_image_annotator.h>
+#include <frame_source.h>
+#include <depth_jump_edges.h>
+#include <contour_cache.h>
 #if USE_PCL_FOR_GROUND_PLANE
 #include <ground_plane_finder.h>
 #endif // USE_PCL_FOR_GROUND_PLANE
 #define TRACK_BAR_SCALE_FACTOR 25.f
 
+//! the edge detectors that generate the contour image
+enum EdgeEngine {
+  //! Canny on the depth converted to uchar, cf DepthCanny
+  EDGE_ENGINE_CANNY = 0,
+  //! metric depth discontinuities on the float depth, cf DepthJumpEdges
+  EDGE_ENGINE_DEPTH_JUMP = 1
+};
+
 class UserImageAnnotator : public ContourImageAnnotator {
 public:
-  UserImageAnnotator() {
+  UserImageAnnotator() : _source(NULL), _edge_engine(EDGE_ENGINE_CANNY) {
     canny_tb1_value = DepthCanny::DEFAULT_CANNY_THRES1 * TRACK_BAR_SCALE_FACTOR;
     canny_tb2_value = DepthCanny::DEFAULT_CANNY_THRES2 * TRACK_BAR_SCALE_FACTOR;
     cv::createTrackbar("canny_param1", WINNAME, &canny_tb1_value, 100,
@@ -39,30 +50,151 @@ public:
                        &UserImageAnnotator::trackbar_cb, this);
   }
 
+  ~UserImageAnnotator() {
+    delete _source;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! must be called before loading the frames
+  void set_edge_engine(EdgeEngine engine) {
+    _edge_engine = engine;
+  }
+  //! the thresholds of the depth jump engine, cf DepthJumpEdges
+  void set_depth_jump_thresholds(double min_jump, double jump_factor) {
+    _jump_edges.set_thresholds(min_jump, jump_factor);
+  }
+  //! add the creases to the Canny contours, cf NormalEdges
+  void set_normal_edges(bool enabled, double crease_angle, double budget_ms) {
+    _canny.set_normal_edges_enabled(enabled);
+    _canny.set_normal_edges_params(crease_angle, budget_ms);
+  }
+
+  //! must be called before loading the frames, cf ContourCache
+  void set_contour_cache(const std::string & folder, unsigned long max_bytes) {
+    _contour_cache.open(folder, max_bytes);
+  }
+
+  //! must be called before loading the frames, cf DepthRangeOptions
+  void set_depth_range_percentiles(double low, double high) {
+    _canny.set_depth_range_percentiles(low, high);
+  }
+
+  //! must be called before loading the frames, cf FixedDepthScale. NULL for none
+  void set_fixed_depth_scale(const image_utils::FixedDepthScale* scale) {
+    _canny.set_fixed_depth_scale(scale);
+  }
+
+  //! must be called before loading the frames
+  void set_nan_removal(image_utils::NaNRemovalMethod method,
+                       image_utils::BorderHolePolicy border) {
+    _canny.set_nan_removal_method(method);
+    _canny.set_border_hole_policy(border);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * Annotate the frames of a source, that will be deleted by the annotator.
+   * \param claim_mode, claim_block_size
+   *    to share the source with other instances, cf load_playlist_images()
+   */
+  bool load_frame_source(image_utils::FrameSource* source,
+                         WorkClaims::ClaimMode claim_mode = WorkClaims::CLAIM_NONE,
+                         unsigned int claim_block_size = WorkClaims::DEFAULT_BLOCK_SIZE) {
+    delete _source;
+    _source = source;
+    std::vector<std::string> frame_names;
+    for (unsigned int frame_idx = 0; frame_idx < _source->nframes(); ++frame_idx)
+      frame_names.push_back(_source->frame_name(frame_idx));
+    return load_playlist_images(frame_names, claim_mode, claim_block_size);
+  }
+
 protected:
   inline virtual bool load_playlist_image(const std::string & filename) {
+    TRACE_SPAN("UserImageAnnotator::load_playlist_image");
     printf("UserImageAnnotator::load_playlist_image('%s')\n", filename.c_str());
-    // remove _depth.png if needed
-    // read depth and rgb
-    image_utils::read_rgb_and_depth_image_from_image_file
-        (filename, &_rgb, &_depth);
-    if (_depth.empty())
+    bool success = false;
+    {
+      ALLOCATION_CHECK_IGNORE(); // filenames and codec internals
+      success = _source->read_frame(get_current_dataset_idx(), _rgb, _depth);
+    }
+    if (!success || _depth.empty())
       return false;
     _rgb_ok = (!_rgb.empty());
     //if (_rgb_ok) cv::imshow("rgb", _rgb);
     load_current_user_image();
-    compute_canny();
+    return compute_canny();
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * a description of the edge detection parameters, for ContourCache.
+   * Empty if the result is not reproducible (creases with a time budget).
+   */
+  std::string edge_params_description() const {
+    std::ostringstream out;
+    if (_edge_engine == EDGE_ENGINE_DEPTH_JUMP) {
+      out << "depth_jumps " << _jump_edges.get_min_jump()
+          << " " << _jump_edges.get_jump_factor();
+      return out.str();
+    }
+    const DepthCannyParams & p = _canny.get_params();
+    if (p.normal_edges_enabled && p.normal_edges_budget_ms > 0)
+      return ""; // the stride depends on the timings
+    out << "canny " << p.canny_thres1 << " " << p.canny_thres2
+        << " range " << p.depth_range.low_percentile
+        << " " << p.depth_range.high_percentile;
+    if (p.fixed_depth_scale_enabled)
+      out << " fixed " << p.fixed_depth_scale.alpha << " " << p.fixed_depth_scale.beta;
+    out
+        << " nan " << p.nan_removal_method << " " << p.border_hole_policy
+        << " normals " << p.normal_edges_enabled << " " << p.crease_angle;
+    return out.str();
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! for the depth consistency of the label propagation
+  virtual const cv::Mat* current_depth() const {
+    return &_depth;
   }
 
   //////////////////////////////////////////////////////////////////////////////
 
-  //! apply Canny to get contour
+  //! apply the edge detector to get contour, or read it from the cache
   bool compute_canny() {
+    ALLOCATION_CHECK("compute_canny");
+    TRACE_SPAN("UserImageAnnotator::compute_canny");
+    begin_latency(LATENCY_EDGES);
     canny_param1 = 1.f *canny_tb1_value / TRACK_BAR_SCALE_FACTOR;
     canny_param2 = 1.f *canny_tb2_value / TRACK_BAR_SCALE_FACTOR;
     _canny.set_canny_thresholds(canny_param1, canny_param2);
-    _canny.thresh(_depth);
-    _canny.get_thresholded_image().copyTo(_contour);
+    ContourCache::Key key = 0;
+    bool use_cache = false;
+    if (_contour_cache.is_open()) {
+      ALLOCATION_CHECK_IGNORE(); // file I/O
+      std::string params = edge_params_description();
+      use_cache = !params.empty();
+      if (use_cache) {
+        key = ContourCache::make_key(_depth, params);
+        if (_contour_cache.get(key, _depth.size(), _contour))
+          return set_images(_user_image, _contour);
+      }
+    }
+    if (_edge_engine == EDGE_ENGINE_DEPTH_JUMP) {
+      _jump_edges.thresh(_depth);
+      _jump_edges.get_thresholded_image().copyTo(_contour);
+    }
+    else {
+      _canny.thresh(_depth);
+      _canny.get_thresholded_image().copyTo(_contour);
+    }
+    if (use_cache) {
+      ALLOCATION_CHECK_IGNORE(); // file I/O
+      _contour_cache.put(key, _contour);
+    }
     // use in interface
     return set_images(_user_image, _contour);
   }
@@ -71,6 +203,7 @@ protected:
 
   void compute_ground_plane() {
 #if USE_PCL_FOR_GROUND_PLANE
+    TRACE_SPAN("compute_ground_plane");
     printf("Computing ground plane...\n");
     goto_playlist_image(_playlist_idx);
     _finder.compute_plane(_depth, GroundPlaneFinder::DEFAULT_DISTANCE_THRESHOLD_M,
@@ -88,6 +221,18 @@ protected:
 
   virtual void custom_key_handler(char c) {
     if (c == 'g') compute_ground_plane();
+    else if (c == 'e') { // switch edge engine
+      _edge_engine = (_edge_engine == EDGE_ENGINE_CANNY ? EDGE_ENGINE_DEPTH_JUMP
+                                                        : EDGE_ENGINE_CANNY);
+      printf("Edge engine: %s\n",
+             (_edge_engine == EDGE_ENGINE_CANNY ? "Canny" : "depth jumps"));
+      compute_canny();
+    }
+    else if (c == 'N') { // toggle the creases
+      _canny.set_normal_edges_enabled(!_canny.get_normal_edges_enabled());
+      printf("Normal edges: %s\n", (_canny.get_normal_edges_enabled() ? "on" : "off"));
+      compute_canny();
+    }
   } // end custom_key_handler()
 
   //////////////////////////////////////////////////////////////////////////////
@@ -98,12 +243,25 @@ protected:
 
   //////////////////////////////////////////////////////////////////////////////
 
+  //! decode the next frames while the user is annotating
+  virtual void idle_handler() {
+    ALLOCATION_CHECK_IGNORE(); // codec internals
+    _source->prefetch();
+  }
+
+  virtual std::string cache_state() const {
+    return _source->state() + " " + _contour_cache.state();
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+
   static void trackbar_cb(int pos, void* cookie) {
     ((UserImageAnnotator*) cookie)->compute_canny();
   }
 
 protected:
   cv::Mat _depth;
+  image_utils::FrameSource* _source;
   cv::Mat1b _contour, _plane;
 #if USE_PCL_FOR_GROUND_PLANE
   GroundPlaneFinder _finder;
@@ -112,6 +270,9 @@ protected:
   double canny_param1, canny_param2;
   int canny_tb1_value, canny_tb2_value;
   DepthCanny _canny;
+  EdgeEngine _edge_engine;
+  DepthJumpEdges _jump_edges;
+  ContourCache _contour_cache;
 }; // end class UserImageAnnotator
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -119,13 +280,181 @@ protected:
 
 int main(int argc, char** argv) {
   std::vector<std::string> filenames;
+  bool hud = false, persist_contour_edits = false, recover_without_asking = false;
+  bool propagation = true;
+  WorkClaims::ClaimMode claim_mode = WorkClaims::CLAIM_NONE;
+  unsigned int claim_block_size = WorkClaims::DEFAULT_BLOCK_SIZE;
+  std::string journal_filename;
+  std::string session_summary_filename;
+  std::string rgb_video, depth_video;
+  image_utils::NaNRemovalMethod nan_removal = image_utils::VALUE_REMOVAL_METHOD_BACKGROUND;
+  image_utils::BorderHolePolicy border_holes = image_utils::BORDER_HOLES_EXTEND;
+  EdgeEngine edge_engine = EDGE_ENGINE_CANNY;
+  double jump_min = DepthJumpEdges::DEFAULT_MIN_JUMP;
+  double jump_factor = DepthJumpEdges::DEFAULT_JUMP_FACTOR;
+  bool normal_edges = false;
+  double crease_angle = NormalEdges::DEFAULT_CREASE_ANGLE;
+  double normal_budget_ms = NormalEdges::DEFAULT_BUDGET_MS;
+  double depth_scale = image_utils::VideoFrameSource::DEFAULT_DEPTH_SCALE;
+  double low_percentile = 0, high_percentile = 100;
+  bool fixed_depth_scale = false;
+  double fixed_min_depth = 0, fixed_max_depth = image_utils::FIXED_DEPTH_SCALE_MAX_DEPTH;
+  std::string contour_cache_folder; // no cache unless asked for
+  unsigned long contour_cache_bytes = ContourCache::DEFAULT_MAX_BYTES;
   for (unsigned int i = 1; i < argc; ++i) {
     std::string filename_clean(argv[i]);
+    if (filename_clean == "--trace" && i + 1 < argc) {
+      span_tracer::enable(argv[++i]);
+      continue;
+    }
+    if (filename_clean == "--hud") {
+      hud = true;
+      continue;
+    }
+    if (filename_clean == "--session-summary" && i + 1 < argc) {
+      session_summary_filename = argv[++i];
+      continue;
+    }
+    if (filename_clean == "--persist-contour-edits") {
+      persist_contour_edits = true;
+      continue;
+    }
+    if (filename_clean == "--journal" && i + 1 < argc) {
+      journal_filename = argv[++i];
+      continue;
+    }
+    if (filename_clean == "--recover") {
+      recover_without_asking = true;
+      continue;
+    }
+    if (filename_clean == "--no-propagation") {
+      propagation = false;
+      continue;
+    }
+    if (filename_clean == "--claim-frames") {
+      claim_mode = WorkClaims::CLAIM_FRAMES;
+      continue;
+    }
+    if (filename_clean == "--claim-blocks" && i + 1 < argc) {
+      claim_mode = WorkClaims::CLAIM_BLOCKS;
+      claim_block_size = atoi(argv[++i]);
+      continue;
+    }
+    if (filename_clean == "--rgb-video" && i + 1 < argc) {
+      rgb_video = argv[++i];
+      continue;
+    }
+    if (filename_clean == "--depth-video" && i + 1 < argc) {
+      depth_video = argv[++i];
+      continue;
+    }
+    if (filename_clean == "--depth-scale" && i + 1 < argc) {
+      depth_scale = atof(argv[++i]);
+      continue;
+    }
+    if (filename_clean == "--nan-removal" && i + 1 < argc) {
+      std::string method(argv[++i]);
+      if (method == "none")
+        nan_removal = image_utils::VALUE_REMOVAL_METHOD_DO_NOTHING;
+      else if (method == "nearest")
+        nan_removal = image_utils::VALUE_REMOVAL_METHOD_NEAREST;
+      else if (method == "background")
+        nan_removal = image_utils::VALUE_REMOVAL_METHOD_BACKGROUND;
+      else
+        printf("Unknown NaN removal method '%s', ignoring it.\n", method.c_str());
+      continue;
+    }
+    if (filename_clean == "--contour-cache" && i + 1 < argc) {
+      contour_cache_folder = argv[++i];
+      continue;
+    }
+    if (filename_clean == "--contour-cache-size" && i + 1 < argc) {
+      contour_cache_bytes = atof(argv[++i]) * 1024 * 1024;
+      continue;
+    }
+    if (filename_clean == "--no-contour-cache") {
+      contour_cache_folder.clear();
+      continue;
+    }
+    if (filename_clean == "--depth-percentiles" && i + 2 < argc) {
+      low_percentile = atof(argv[++i]);
+      high_percentile = atof(argv[++i]);
+      continue;
+    }
+    if (filename_clean == "--fixed-depth-scale" && i + 2 < argc) {
+      fixed_depth_scale = true;
+      fixed_min_depth = atof(argv[++i]);
+      fixed_max_depth = atof(argv[++i]);
+      continue;
+    }
+    if (filename_clean == "--keep-border-holes") {
+      border_holes = image_utils::BORDER_HOLES_KEEP;
+      continue;
+    }
+    if (filename_clean == "--depth-jumps") {
+      edge_engine = EDGE_ENGINE_DEPTH_JUMP;
+      continue;
+    }
+    if (filename_clean == "--jump-min" && i + 1 < argc) {
+      jump_min = atof(argv[++i]);
+      continue;
+    }
+    if (filename_clean == "--jump-factor" && i + 1 < argc) {
+      jump_factor = atof(argv[++i]);
+      continue;
+    }
+    if (filename_clean == "--normal-edges") {
+      normal_edges = true;
+      continue;
+    }
+    if (filename_clean == "--crease-angle" && i + 1 < argc) {
+      crease_angle = atof(argv[++i]);
+      continue;
+    }
+    if (filename_clean == "--normal-budget" && i + 1 < argc) {
+      normal_budget_ms = atof(argv[++i]);
+      continue;
+    }
     find_and_replace(filename_clean, "_depth.png", "");
     find_and_replace(filename_clean, "_rgb.png", "");
     filenames.push_back(filename_clean);
   }
+  if (!image_utils::DepthRangeOptions(low_percentile, high_percentile).is_valid()) {
+    printf("Invalid --depth-percentiles %g %g, need 0 <= low < high <= 100.\n",
+           low_percentile, high_percentile);
+    return -1;
+  }
+  if (fixed_depth_scale && fixed_min_depth >= fixed_max_depth) {
+    printf("Invalid --fixed-depth-scale %g %g, need MIN < MAX.\n",
+           fixed_min_depth, fixed_max_depth);
+    return -1;
+  }
   UserImageAnnotator annot;
-  annot.load_playlist_images(filenames);
+  annot.set_nan_removal(nan_removal, border_holes);
+  annot.set_depth_range_percentiles(low_percentile, high_percentile);
+  image_utils::FixedDepthScale scale(fixed_min_depth, fixed_max_depth);
+  annot.set_fixed_depth_scale(fixed_depth_scale ? &scale : NULL);
+  if (!contour_cache_folder.empty())
+    annot.set_contour_cache(contour_cache_folder, contour_cache_bytes);
+  annot.set_edge_engine(edge_engine);
+  annot.set_depth_jump_thresholds(jump_min, jump_factor);
+  annot.set_normal_edges(normal_edges, crease_angle, normal_budget_ms);
+  annot.set_hud_enabled(hud);
+  annot.set_session_summary_filename(session_summary_filename);
+  annot.set_persist_contour_edits(persist_contour_edits);
+  annot.set_propagation_enabled(propagation);
+  if (!journal_filename.empty())
+    annot.set_journal(journal_filename, !recover_without_asking);
+  if (!depth_video.empty()) // annotations keyed by frame number, next to the video
+    annot.load_frame_source(new image_utils::VideoFrameSource
+                            (rgb_video, depth_video,
+                             remove_filename_extension(depth_video), depth_scale),
+                            claim_mode, claim_block_size);
+  else {
+    image_utils::ImageFileFrameSource* source =
+        new image_utils::ImageFileFrameSource(filenames);
+    source->set_sequence_params_first(fixed_depth_scale);
+    annot.load_frame_source(source, claim_mode, claim_block_size);
+  }
   annot.run();
 }
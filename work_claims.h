@@ -0,0 +1,171 @@
+/*!
+  \file        work_claims.h
+  \author      Arnaud Ramey <arnaud.a.ramey@gmail.com>
+                -- Robotics Lab, University Carlos III of Madrid
+  \date        2014/11/15
+
+________________________________________________________________________________
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+________________________________________________________________________________
+
+\class WorkClaims
+Share a dataset between several annotators without any coordination.
+
+Each instance is given the whole dataset and claims the frames
+it will annotate, one by one or by blocks, in the dataset order.
+A frame is skipped if it is done (its user image exists,
+or "<user image>.done" if it was reviewed and left blank)
+or claimed by another instance.
+A claim is a FrameLock on "<user image>.claim": claiming is atomic,
+and the kernel releases the claims of an instance that crashed or was killed.
+A claim is released when its frame is saved (the user image then marks it
+as done) or left unchanged (mark_done()), and all of them at exit.
+The lock files must be on a filesystem supporting flock()
+(local, or NFS with a Linux client).
+ */
+
+#ifndef WORK_CLAIMS_H
+#define WORK_CLAIMS_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "atomic_file.h"
+
+class WorkClaims {
+public:
+  enum ClaimMode {
+    CLAIM_NONE = 0, //!< annotate the whole playlist
+    CLAIM_FRAMES,   //!< claim one frame at a time
+    CLAIM_BLOCKS    //!< claim block_size frames at a time
+  };
+  //! the default number of frames of CLAIM_BLOCKS
+  static const unsigned int DEFAULT_BLOCK_SIZE = 20;
+
+  WorkClaims() : _mode(CLAIM_NONE), _block_size(1), _next(0) {}
+  ~WorkClaims() { release_all(); }
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  /*!
+   * \param user_filenames
+   *    the user image of each frame of the dataset
+   */
+  void set_dataset(const std::vector<std::string> & user_filenames,
+                   ClaimMode mode, unsigned int block_size = DEFAULT_BLOCK_SIZE) {
+    release_all();
+    _user_filenames = user_filenames;
+    _mode = mode;
+    _block_size = (mode == CLAIM_BLOCKS ? std::max(block_size, 1U) : 1);
+    _next = 0;
+  }
+
+  inline bool enabled() const { return _mode != CLAIM_NONE; }
+  inline unsigned int nclaimed() const { return _claims.size(); }
+
+  /*!
+   * Claim the next frames of the dataset that are neither done
+   * nor claimed: one with CLAIM_FRAMES, up to block_size with CLAIM_BLOCKS.
+   * \param claimed (out)
+   *    their indices in the dataset are appended to it
+   * \return the number of claimed frames, 0 if there is no work left
+   */
+  unsigned int claim_next(std::vector<unsigned int> & claimed) {
+    if (!enabled())
+      return 0;
+    unsigned int nclaimed = 0, nannotated = 0, nclaimed_by_others = 0;
+    for (; _next < _user_filenames.size() && nclaimed < _block_size; ++_next) {
+      const std::string & user_filename = _user_filenames[_next];
+      if (is_done(user_filename)) {
+        ++nannotated;
+        continue;
+      }
+      FrameLock* lock = new FrameLock();
+      if (!lock->acquire(user_filename, ".claim")) {
+        delete lock;
+        ++nclaimed_by_others;
+        continue;
+      }
+      // the other instance may have saved it and released its claim meanwhile
+      if (is_done(user_filename)) {
+        delete lock;
+        ++nannotated;
+        continue;
+      }
+      _claims.insert(std::make_pair(user_filename, lock));
+      claimed.push_back(_next);
+      ++nclaimed;
+    } // end loop _next
+    printf("WorkClaims: claimed %i frames, skipped %i annotated and %i claimed by others, "
+           "%i frames left in the dataset.\n", nclaimed, nannotated, nclaimed_by_others,
+           (int) (_user_filenames.size() - _next));
+    return nclaimed;
+  } // end claim_next()
+
+  //////////////////////////////////////////////////////////////////////////////
+
+  //! release the claim on a frame, if any, for instance once it is saved
+  void release(const std::string & user_filename) {
+    ClaimMap::iterator it = _claims.find(user_filename);
+    if (it == _claims.end())
+      return;
+    delete it->second; // releases it
+    _claims.erase(it);
+  }
+
+  /*!
+   * A claimed frame was reviewed and left without user image:
+   * mark it as done with "<user image>.done", so that no instance claims it again,
+   * and release its claim.
+   */
+  void mark_done(const std::string & user_filename) {
+    ClaimMap::iterator it = _claims.find(user_filename);
+    if (it == _claims.end())
+      return;
+    std::string done_filename = user_filename + ".done";
+    int fd = ::open(done_filename.c_str(), O_WRONLY | O_CREAT, 0666);
+    if (fd < 0)
+      printf("WorkClaims: could not create '%s'!\n", done_filename.c_str());
+    else
+      ::close(fd);
+    release(user_filename);
+  }
+
+  //! true if the frame has a user image, or was marked as done
+  static bool is_done(const std::string & user_filename) {
+    return access(user_filename.c_str(), F_OK) == 0
+        || access((user_filename + ".done").c_str(), F_OK) == 0;
+  }
+
+  void release_all() {
+    for (ClaimMap::iterator it = _claims.begin(); it != _claims.end(); ++it)
+      delete it->second;
+    _claims.clear();
+  }
+
+private:
+  typedef std::map<std::string, FrameLock*> ClaimMap;
+
+  ClaimMode _mode;
+  unsigned int _block_size;
+  std::vector<std::string> _user_filenames; //!< the user image of each dataset frame
+  unsigned int _next; //!< the first dataset frame not yet examined
+  ClaimMap _claims; //!< user image -> its claim
+}; // end class WorkClaims
+
+#endif // WORK_CLAIMS_H